@@ -118,20 +118,26 @@ unsigned ram_gettotal(void);
 unsigned ram_getkernel(void);
 unsigned ram_gettotalpages(void);
 unsigned ram_getallocatedpages(void);
+unsigned ram_getfreeruns(unsigned *runs, unsigned nbuckets);
 unsigned ram_leaked(void);
 #endif /* OPT_VM_ALLOC */
 
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * Each request covers a range of pages of one address space, so that a
+ * whole munmap costs one IPI per CPU. Up to 16 requests can be queued
+ * on a CPU.
  */
 
+struct semaphore;
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* Address space of the pages */
+	vaddr_t ts_vaddr;		/* First page to invalidate */
+	unsigned ts_npages;		/* Number of pages */
+	struct semaphore *ts_done;	/* Signalled when done, if not NULL */
 };
 
 #define TLBSHOOTDOWN_MAX 16
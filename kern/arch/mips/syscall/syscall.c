@@ -39,6 +39,11 @@
 #include <opt-wait.h>
 #include <opt-file.h>
 #include <opt-sys_io.h>
+#include <opt-sys_vm.h>
+#include <opt-mmapfile.h>
+#include <opt-affinity.h>
+#include <opt-timer.h>
+#include <copyinout.h>
 
 
 /*
@@ -85,6 +90,10 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#if OPT_SYS_VM
+	int fd;
+	off_t offset;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -113,6 +122,13 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+#if OPT_TIMER
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+#endif /* OPT_TIMER */
+
 #if OPT_SYS_IO
       case SYS_write:
     err = retval = sys_write(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2);
@@ -174,6 +190,38 @@ syscall(struct trapframe *tf)
       break;
 #endif /* OPT_FILE */
 
+#if OPT_SYS_VM
+    case SYS_sbrk:
+      err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+      break;
+
+    case SYS_mmap:
+      /* fd and the aligned 64-bit offset are on the user stack */
+      err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+      if (err) break;
+      err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset, sizeof(offset));
+      if (err) break;
+      err = sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2,
+                     (int)tf->tf_a3, fd, offset, &retval);
+      break;
+
+    case SYS_munmap:
+      err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+      break;
+#endif /* OPT_SYS_VM */
+
+#if OPT_MMAPFILE
+    case SYS_msync:
+      err = sys_msync((userptr_t)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2);
+      break;
+#endif /* OPT_MMAPFILE */
+
+#if OPT_AFFINITY
+    case SYS_sched_setaffinity:
+      err = sys_sched_setaffinity((pid_t)tf->tf_a0, (uint32_t)tf->tf_a1);
+      break;
+#endif /* OPT_AFFINITY */
+
 	    /* Add stuff here */
 
 	    default:
@@ -33,15 +33,23 @@
 #include <spl.h>
 #include <cpu.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <opt-data_struct.h>
-#if OPT_DATA_STRUCT
+#include <opt-buddy.h>
+#include <opt-pfcache.h>
+#if OPT_BUDDY
+#include <buddy.h>
+#elif OPT_DATA_STRUCT
 #include <bitmap.h>
 #endif
+#if OPT_PFCACHE
+#include <pfcache.h>
+#endif
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -69,7 +77,9 @@
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 #if OPT_VM_ALLOC
-#if OPT_DATA_STRUCT
+#if OPT_BUDDY
+/* Free frames are kept by the buddy allocator (see buddy.c) */
+#elif OPT_DATA_STRUCT
 static struct bitmap* free_ram_frames;
 #else
 typedef enum {
@@ -79,7 +89,7 @@ typedef enum {
  * RAM parallel array which stores the status of each page (PAGE_FREE, PAGE_ALLOC).
  */
 static page_status* free_ram_frames;
-#endif /* OPT_DATA_STRUCT */
+#endif /* OPT_BUDDY */
 /**
  * Support array for multi-page allocation. It stores the number of contiguous
  * allocated pages at the first block index, while the other blocks have zero values
@@ -100,7 +110,10 @@ needed_npages(size_t free_space)
   n_pages = n_pages_old = free_space / PAGE_SIZE;
 
   /* Remove space needed from the data structures themselves */
-#if OPT_DATA_STRUCT
+#if OPT_BUDDY
+  /* The buddy metadata is left out, so we never underestimate the pages */
+  free_space -= n_pages * sizeof(*count_allocated);
+#elif OPT_DATA_STRUCT
   free_space -= n_pages * sizeof(*count_allocated) + DIVROUNDUP(n_pages, BITS_PER_WORD);
 #else
   free_space -= n_pages * (sizeof(bool) + sizeof(*count_allocated));
@@ -134,7 +147,9 @@ vm_bootstrap(void)
   KASSERT((free_space & PAGE_FRAME) == free_space);
   n_pages = needed_npages(free_space);
 
-#if OPT_DATA_STRUCT
+#if OPT_BUDDY
+  buddy_bootstrap(ram_getsize() / PAGE_SIZE);
+#elif OPT_DATA_STRUCT
   free_ram_frames = bitmap_create(n_pages);
 #else
   free_ram_frames = kmalloc(sizeof(page_status) * n_pages);
@@ -156,7 +171,9 @@ vm_bootstrap(void)
   KASSERT((first_vm_paddr & PAGE_FRAME) == first_vm_paddr);
   KASSERT((last_vm_paddr & PAGE_FRAME) == last_vm_paddr);
 
-#if !OPT_DATA_STRUCT
+#if OPT_BUDDY
+  buddy_addrange(first_vm_paddr / PAGE_SIZE, last_vm_paddr / PAGE_SIZE);
+#elif !OPT_DATA_STRUCT
   bzero((void*)free_ram_frames, sizeof(page_status) * n_pages);
 #endif
   bzero((void*)count_allocated, sizeof(*count_allocated) * n_pages);
@@ -183,14 +200,96 @@ dumbvm_can_sleep(void)
 	}
 }
 
+#if OPT_VM_ALLOC
+/*
+ * Take NPAGES contiguous frames from the free pool. stealmem_lock must be
+ * held and the VM must be active. Returns 0 if there is no such block.
+ */
 static
 paddr_t
-getppages(unsigned long npages)
+allocppages(unsigned long npages)
 {
-#if OPT_VM_ALLOC
   bool found = 0;
   unsigned pos, start;
+
+#if OPT_BUDDY
+  (void)pos;
+  start = buddy_alloc((unsigned)npages);
+  found = start != 0;
+  /* count_allocated is indexed from the first managed frame */
+  start -= first_vm_paddr / PAGE_SIZE;
+#elif OPT_DATA_STRUCT
+  (void)pos;
+  found = bitmap_n_alloc(free_ram_frames, (unsigned)npages, &start) == 0;
+#else
+  for (pos = 0; pos < (unsigned)n_ram_frames; pos++) {
+    if (free_ram_frames[pos] == PAGE_FREE) {
+      if (pos == 0 || free_ram_frames[pos - 1] == PAGE_ALLOC) {
+        start = pos;
+      }
+      if (pos - start + 1 >= (unsigned)npages) {
+        found = true;
+        break;
+      }
+    }
+  }
+#endif /* OPT_BUDDY */
+
+  /* We have the valid 'start' variable if 'found' is true */
+
+  if (!found) {
+    return 0;
+  }
+
+  /* Mark blocks as allocated */
+#if OPT_BUDDY
+  /* Already done by buddy_alloc */
+#elif OPT_DATA_STRUCT
+  bitmap_n_mark(free_ram_frames, (unsigned) npages, start);
+#else
+  for (pos = start; pos < start + npages; pos++) {
+    free_ram_frames[pos] = PAGE_ALLOC;
+  }
+#endif /* OPT_BUDDY */
+  /* Keep track of allocated blocks number */
+  count_allocated[start] = (unsigned) npages;
+  n_ram_frames_alloc += npages;
+  /* Compute starting address */
+  return first_vm_paddr + (paddr_t) start * PAGE_SIZE;
+}
+
+/*
+ * Give back to the free pool the block starting at frame index POS.
+ * stealmem_lock must be held.
+ */
+static
+void
+releaseppages(unsigned pos)
+{
+  unsigned npages, i;
+
+  npages = count_allocated[pos];
+  KASSERT(npages > 0);
+
+#if OPT_BUDDY
+  (void)i;
+  buddy_free(pos + first_vm_paddr / PAGE_SIZE, npages);
+#elif OPT_DATA_STRUCT
+  (void)i;
+  bitmap_n_unmark(free_ram_frames, npages, pos);
+#else
+  for (i = pos; i < pos + npages; i++)
+    free_ram_frames[i] = PAGE_FREE;
+#endif /* OPT_BUDDY */
+  count_allocated[pos] = 0;
+  n_ram_frames_alloc -= npages;
+}
 #endif /* OPT_VM_ALLOC */
+
+static
+paddr_t
+getppages(unsigned long npages)
+{
 	paddr_t addr;
 
 	spinlock_acquire(&stealmem_lock);
@@ -201,43 +300,8 @@ getppages(unsigned long npages)
 	   */
   	addr = ram_stealmem(npages);
 	} else {
-#if OPT_DATA_STRUCT
-    (void)pos;
-	  found = bitmap_n_alloc(free_ram_frames, (unsigned)npages, &start) == 0;
-#else
-    for (pos = 0; pos < (unsigned)n_ram_frames; pos++) {
-      if (free_ram_frames[pos] == PAGE_FREE) {
-        if (pos == 0 || free_ram_frames[pos - 1] == PAGE_ALLOC) {
-          start = pos;
-        }
-        if (pos - start + 1 >= (unsigned)npages) {
-          found = true;
-          break;
-        }
-      }
-    }
-#endif /* OPT_DATA_STRUCT */
-
-    /* We have the valid 'start' variable if 'found' is true */
-
-    if (found) {
-      /* Mark blocks as allocated */
-#if OPT_DATA_STRUCT
-      bitmap_n_mark(free_ram_frames, (unsigned) npages, start);
-#else
-      for (pos = start; pos < start + npages; pos++) {
-        free_ram_frames[pos] = PAGE_ALLOC;
-      }
-#endif /* OPT_DATA_STRUCT */
-      /* Keep track of allocated blocks number */
-      count_allocated[start] = (unsigned) npages;
-      n_ram_frames_alloc += npages;
-      /* Compute starting address */
-      addr = first_vm_paddr + (paddr_t) start * PAGE_SIZE;
-    } else {
-      addr = 0;
-    }
-  }
+	  addr = allocppages(npages);
+	}
 #else  /* Dumbier method */
   addr = ram_stealmem(npages);
 #endif /* OPT_VM_ALLOC */
@@ -253,7 +317,15 @@ alloc_kpages(unsigned npages)
 	paddr_t pa;
 
 	dumbvm_can_sleep();
+#if OPT_PFCACHE
+	/* Single pages come from the cache of this CPU, if possible */
+	pa = npages == 1 ? pfcache_get() : 0;
+	if (pa == 0) {
+		pa = getppages(npages);
+	}
+#else
 	pa = getppages(npages);
+#endif /* OPT_PFCACHE */
 	if (pa==0) {
 		return 0;
 	}
@@ -265,7 +337,7 @@ static
 void
 freeppages(paddr_t addr)
 {
-  unsigned npages, pos, i;
+  unsigned pos;
 
   /* Cannot recycle memory before VM initialization */
   if (!VM_ACTIVE) return;
@@ -278,20 +350,58 @@ freeppages(paddr_t addr)
 
   /* Retrieve index of first block */
   pos = (addr - first_vm_paddr)/PAGE_SIZE;
-  npages = count_allocated[pos];
 
-  KASSERT(npages > 0);
+#if OPT_PFCACHE
+  /* The block is still ours, so its length can be read without locking */
+  if (count_allocated[pos] == 1 && pfcache_put(addr)) return;
+#endif /* OPT_PFCACHE */
 
-#if OPT_DATA_STRUCT
-  (void)i;
-  bitmap_n_unmark(free_ram_frames, npages, pos);
-#else
-  for (i = pos; i < pos + npages; i++)
-    free_ram_frames[i] = PAGE_FREE;
-#endif /* OPT_DATA_STRUCT */
-  count_allocated[pos] = 0;
-  n_ram_frames_alloc -= npages;
+  spinlock_acquire(&stealmem_lock);
+  releaseppages(pos);
+  spinlock_release(&stealmem_lock);
+}
+
+#if OPT_PFCACHE
+/**
+ * Refill a per-CPU frame cache
+ * @param frames    Where to store the frames
+ * @param n         Number of frames wanted
+ * @return          Number of frames obtained
+ */
+unsigned
+vm_getframes(paddr_t *frames, unsigned n)
+{
+  unsigned i;
+
+  if (!VM_ACTIVE) return 0;
+
+  spinlock_acquire(&stealmem_lock);
+  for (i = 0; i < n; i++) {
+    frames[i] = allocppages(1);
+    if (frames[i] == 0) break;
+  }
+  spinlock_release(&stealmem_lock);
+
+  return i;
+}
+
+/**
+ * Drain a per-CPU frame cache
+ * @param frames    Frames to release
+ * @param n         Number of frames
+ */
+void
+vm_putframes(const paddr_t *frames, unsigned n)
+{
+  unsigned i;
+
+  spinlock_acquire(&stealmem_lock);
+  for (i = 0; i < n; i++) {
+    releaseppages((frames[i] - first_vm_paddr) / PAGE_SIZE);
+  }
+  spinlock_release(&stealmem_lock);
 }
+#endif /* OPT_PFCACHE */
 #endif /* OPT_VM_ALLOC */
 
 void
@@ -310,11 +420,24 @@ free_kpages(vaddr_t addr)
 #endif /* OPT_VM_ALLOC */
 }
 
+/*
+ * dumbvm keeps no record of what is in the TLB: just drop everything,
+ * as as_activate does.
+ */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+
+	if (ts->ts_done != NULL) {
+		V(ts->ts_done);
+	}
 }
 
 int
@@ -659,7 +782,55 @@ ram_gettotalpages(void)
 unsigned
 ram_getallocatedpages(void)
 {
+#if OPT_PFCACHE
+  /* Frames in the per-CPU caches are free, actually */
+  return n_ram_frames_alloc - pfcache_ncached();
+#else
   return n_ram_frames_alloc;
+#endif
+}
+
+/**
+ * Count the runs of contiguous free frames by length
+ * @param runs      For each I, receives the number of runs of 2^I to
+ *                  2^(I+1)-1 frames. The last entry counts the longer too
+ * @param nbuckets  Number of entries of RUNS
+ * @return          Length of the longest run
+ */
+unsigned
+ram_getfreeruns(unsigned *runs, unsigned nbuckets)
+{
+  unsigned pos, b, len, longest, npages;
+
+  KASSERT(nbuckets > 0);
+  bzero(runs, nbuckets * sizeof(*runs));
+
+  spinlock_acquire(&stealmem_lock);
+  for (pos = 0, len = longest = 0; pos <= (unsigned)n_ram_frames; pos++) {
+    npages = pos < (unsigned)n_ram_frames ? count_allocated[pos] : 0;
+    if (pos < (unsigned)n_ram_frames && npages == 0) {
+      len++;
+      continue;
+    }
+    if (len > 0) {
+      for (b = 0; b + 1 < nbuckets && (len >> (b + 1)) != 0; b++);
+      runs[b]++;
+      if (len > longest) longest = len;
+      len = 0;
+    }
+    if (npages > 0) {
+#if OPT_BUDDY
+      /* The buddy allocator hands out whole power-of-two blocks */
+      for (b = 1; b < npages; b <<= 1);
+      npages = b;
+#endif
+      /* Skip the rest of the allocated block */
+      pos += npages - 1;
+    }
+  }
+  spinlock_release(&stealmem_lock);
+
+  return longest;
 }
 
 /**
@@ -674,7 +845,7 @@ unsigned ram_leaked(void)
    * return directly the number of already allocated pages, that will hopefully
    * be zero
    */
-  return n_ram_frames_alloc;
+  return ram_getallocatedpages();
 }
 
 #endif /* OPT_VM_ALLOC */
\ No newline at end of file
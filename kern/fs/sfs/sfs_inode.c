@@ -38,6 +38,24 @@
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
+#include <opt-slab.h>
+#if OPT_SLAB
+#include <slab.h>
+
+/*
+ * The in-memory inodes come from an object cache. There's nothing
+ * worth keeping constructed, but they're allocated and freed all the
+ * time and are too big for the subpage allocator to pack well.
+ */
+static struct slab_cache sfs_vnode_cache =
+	SLAB_INITIALIZER("sfs_vnode", sizeof(struct sfs_vnode), NULL, NULL);
+
+#define sfs_vnode_alloc()	slab_alloc(&sfs_vnode_cache)
+#define sfs_vnode_free(sv)	slab_free(&sfs_vnode_cache, (sv))
+#else
+#define sfs_vnode_alloc()	kmalloc(sizeof(struct sfs_vnode))
+#define sfs_vnode_free(sv)	kfree(sv)
+#endif
 
 
 /*
@@ -136,7 +154,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	sfs_vnode_free(sv);
 
 	/* Done */
 	return 0;
@@ -184,7 +202,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = sfs_vnode_alloc();
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,7 +216,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		sfs_vnode_free(sv);
 		return result;
 	}
 
@@ -235,7 +253,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		sfs_vnode_free(sv);
 		return result;
 	}
 
@@ -246,7 +264,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
+		sfs_vnode_free(sv);
 		return result;
 	}
 
@@ -36,10 +36,49 @@
 
 
 #include <vm.h>
+#include <kern/time.h>
 #include "opt-dumbvm.h"
+#include "opt-asid.h"
+#include "opt-demandload.h"
+#include "opt-sys_vm.h"
+#include "opt-mmapfile.h"
+#include "opt-swap.h"
 
 struct vnode;
+struct pagetable;
+struct lock;
 
+#if !OPT_DUMBVM
+/* Region permissions (same values as the ELF PF_* flags) */
+#define VR_EXEC   0x1
+#define VR_WRITE  0x2
+#define VR_READ   0x4
+
+/* Maximum size of the user stack region; pages are allocated on demand */
+#define VM_STACKPAGES 1024
+
+/*
+ * Contiguous range of virtual pages with the same permissions.
+ */
+struct vm_region {
+        vaddr_t vr_base;              /* First virtual address (page aligned) */
+        size_t vr_npages;             /* Region length in pages */
+        int vr_perm;                  /* VR_READ | VR_WRITE | VR_EXEC */
+#if OPT_DEMANDLOAD
+        struct vnode *vr_vnode;       /* File backing the region, or NULL */
+        off_t vr_offset;              /* File offset of vr_filebase */
+        vaddr_t vr_filebase;          /* First address read from the file */
+        size_t vr_filesize;           /* Bytes read from the file */
+#endif
+#if OPT_SYS_VM
+        bool vr_mapped;               /* Created by mmap, can be unmapped */
+#endif
+#if OPT_MMAPFILE
+        bool vr_shared;               /* File mapped with MAP_SHARED */
+#endif
+        struct vm_region *vr_next;    /* Next region of the address space */
+};
+#endif /* !OPT_DUMBVM */
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -58,7 +97,24 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        struct vm_region *as_regions;   /* List of defined regions */
+        struct pagetable *as_pt;        /* Virtual to physical mapping */
+        struct lock *as_lock;           /* Protects regions and page table */
+        bool as_loading;                /* Between prepare and complete load */
+        uint32_t as_cpus;               /* CPUs that may cache translations */
+        unsigned as_faults;             /* Calls to vm_fault */
+        unsigned as_pageins;            /* Faults reading from swap or file */
+        struct timespec as_start;       /* Creation time, for fault rates */
+#if OPT_ASID
+        unsigned as_asid;               /* Generation and TLB tag, 0 if none */
+#endif
+#if OPT_SYS_VM
+        struct vm_region *as_heap;      /* Region grown by sbrk */
+        vaddr_t as_heapend;             /* Current break, in as_heap */
+#endif
+#if OPT_SWAP
+        struct addrspace *as_next;      /* All the address spaces */
+#endif
 #endif
 };
 
@@ -99,6 +155,30 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - with OPT_DEMANDLOAD, make FILESIZE bytes from
+ *                VADDR backed by the file V at OFFSET. The range must
+ *                lie in a region already defined. The pages are read
+ *                by vm_fault when first touched.
+ *
+ *    as_sbrk   - with OPT_SYS_VM, move the end of the heap region, that
+ *                as_complete_load places right above the executable.
+ *                Pages given back are freed at once.
+ *
+ *    as_mmap   - with OPT_SYS_VM, define a new region of anonymous
+ *                zero-filled pages in the free space between the heap
+ *                and the stack.
+ *
+ *    as_munmap - with OPT_SYS_VM, remove pages of regions created by
+ *                as_mmap.
+ *
+ *    as_mmapfile - with OPT_MMAPFILE, like as_mmap but for the pages of
+ *                a file, read on demand. With SHARED set the written
+ *                pages go back to the file on as_msync, as_munmap and
+ *                as_destroy.
+ *
+ *    as_msync  - with OPT_MMAPFILE, write back the written pages of a
+ *                shared file mapping.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,6 +197,61 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_DEMANDLOAD
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 size_t filesize, struct vnode *v,
+                                 off_t offset);
+#endif
+#if OPT_SYS_VM
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, size_t npages, int perm,
+                          vaddr_t *vaddr);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                            size_t npages);
+#endif
+#if OPT_MMAPFILE
+int               as_mmapfile(struct addrspace *as, size_t npages, int perm,
+                              bool shared, struct vnode *v, off_t offset,
+                              size_t filesize, vaddr_t *vaddr);
+int               as_msync(struct addrspace *as, vaddr_t vaddr,
+                           size_t npages);
+#endif
+
+#if !OPT_DUMBVM
+/* Find the region containing VADDR, NULL if it lies outside any region */
+struct vm_region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+
+/* Resident set size and fault counters of an address space */
+struct as_stats {
+        unsigned st_resident;           /* Pages in memory */
+        unsigned st_swapped;            /* Pages in the swap area */
+        unsigned st_faults;             /* Calls to vm_fault */
+        unsigned st_pageins;            /* Faults reading from swap or file */
+        unsigned st_ms;                 /* Age of the address space */
+};
+
+void              as_getstats(struct addrspace *as, struct as_stats *st);
+void              as_printstats(const struct as_stats *st);
+#endif /* !OPT_DUMBVM */
+
+#if OPT_SWAP
+/*
+ * Every address space is kept in a list, so that the pages of a frame
+ * shared by several of them can be paged out (see vm_pageout_shared):
+ *
+ *    as_bootstrap - create the lock of the list, before the first
+ *                as_create.
+ *
+ *    as_foreach - call FUNC(AS, ARG) for each address space, with the
+ *                list locked so that none is created or destroyed
+ *                meanwhile. FUNC may take the lock of AS, never the other
+ *                way round.
+ */
+void              as_bootstrap(void);
+void              as_foreach(void (*func)(struct addrspace *as, void *arg),
+                             void *arg);
+#endif /* OPT_SWAP */
 
 
 /*
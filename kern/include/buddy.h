@@ -0,0 +1,42 @@
+#ifndef _BUDDY_H_
+#define _BUDDY_H_
+
+#include <opt-buddy.h>
+#include <types.h>
+
+/*
+ * Buddy allocator for physical frames.
+ *
+ * Free memory is kept in blocks of 2^order frames, aligned to their own
+ * size, with one free list for each order. An allocation takes a block
+ * of the smallest order that fits (splitting a larger one if needed) and
+ * a release merges the block with its buddy as long as the buddy is free
+ * too, so both take O(log n).
+ *
+ * The list links are stored in the free frames themselves; the only
+ * metadata is one byte per frame, stolen from RAM at bootstrap. Frames
+ * are identified by their physical frame number (paddr / PAGE_SIZE).
+ *
+ * The allocator does no locking: callers serialize with their own lock.
+ *
+ * Functions:
+ *      buddy_bootstrap - steal the metadata for NFRAMES frames. Must be
+ *                        called before ram_getfirstfree
+ *      buddy_addrange  - add the frames [FIRST, LAST) to the free lists
+ *      buddy_alloc     - allocate a block of at least NPAGES frames.
+ *                        Returns its first frame, 0 if there is none
+ *      buddy_free      - release a block allocated with the same NPAGES
+ *      buddy_nfree     - number of free blocks of a given order
+ */
+
+#define BUDDY_NORDERS 11      /* Blocks from 1 to 1024 frames */
+
+void            buddy_bootstrap(unsigned nframes);
+void            buddy_addrange(unsigned first, unsigned last);
+
+unsigned        buddy_alloc(unsigned npages);
+void            buddy_free(unsigned frame, unsigned npages);
+
+unsigned        buddy_nfree(unsigned order);
+
+#endif /* _BUDDY_H_ */
@@ -0,0 +1,142 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+#include <opt-paging.h>
+#include <opt-swap.h>
+#include <opt-zeropool.h>
+#include <opt-sharetext.h>
+#include <opt-mmapfile.h>
+#include <opt-compact.h>
+#include <types.h>
+
+/*
+ * Physical memory manager for the paging VM system.
+ *
+ * The coremap has one entry for each physical frame of RAM. Frames
+ * below the first free address at VM bootstrap (exception handlers,
+ * kernel image, early ram_stealmem allocations and the coremap itself)
+ * are marked as fixed and never handed out.
+ *
+ * Functions:
+ *      coremap_bootstrap  - allocate and initialize the coremap. After this
+ *                           call ram_stealmem() won't be used anymore
+ *      coremap_getkpages  - allocate NPAGES physically contiguous frames for
+ *                           the kernel. Returns 0 if there is no such block
+ *      coremap_getupage   - allocate one frame for the user page at VADDR in
+ *                           address space AS, paging out another page if
+ *                           needed, zero-filled if ZERO is set. Returns 0
+ *                           if out of memory. The frame is returned pinned
+ *      coremap_unpin      - make a frame returned by coremap_getupage
+ *                           eligible for page-out, once it's mapped
+ *      coremap_touch      - mark a user frame as recently used
+ *      coremap_share      - add a reference to the user frame at PADDR, which
+ *                           is now mapped copy-on-write by one more page table
+ *      coremap_unshare    - make AS the owner of a copy-on-write frame, if it
+ *                           is the only one left mapping it
+ *      coremap_freepages  - release a block obtained by coremap_getkpages
+ *      coremap_freeupage  - drop a reference to a user frame, releasing it
+ *                           with the last one. Returns false (after waiting)
+ *                           if the frame was being paged out, in which case
+ *                           the caller must read its page table entry again.
+ *                           Shared frames being paged out are not waited
+ *                           for
+ *
+ * With OPT_BUDDY free frames are handed out by the buddy allocator,
+ * otherwise the coremap itself is scanned.
+ *
+ * With OPT_SWAP, when no frame is free a victim is chosen with the clock
+ * (second-chance) algorithm and written to the swap area by vm_pageout,
+ * or just dropped if it's clean. Frames shared copy-on-write are paged out
+ * from every address space mapping them (vm_pageout_shared), into one
+ * swap slot they share. The reference bit is emulated by dropping
+ * TLB entries (see coremap_clock), the dirty bit by vm_fault, that maps
+ * clean frames read-only:
+ *      coremap_dirty      - mark a user frame written since it was filled
+ *      coremap_isdirty    - check if a user frame must be saved before
+ *                           reusing it
+ *      coremap_clockstats - print evictions and reference bits cleared
+ *
+ * User pages never take the last few free frames, so that the kernel can
+ * still allocate page tables, stacks and kmalloc pages once RAM is full
+ * of them. With OPT_SWAP the next user allocation pages out user pages
+ * until the reserve is whole again, and with OPT_WORKQUEUE a kernel
+ * allocation that dips into the reserve has a worker refill it.
+ *
+ * With OPT_ZEROPOOL the idle CPUs keep a pool of zero-filled free frames
+ * (coremap_zerofill), so that zero-fill faults don't pay for the bzero.
+ * The pool is given back to the free lists when memory is exhausted.
+ *
+ * With OPT_SHARETEXT the frames holding read-only pages of a file are
+ * kept in a page cache indexed by vnode and offset, so that every process
+ * running the same executable maps the same text frames:
+ *      coremap_lookupfile - get the frame caching a page, with one more
+ *                           reference. Returns 0 if not cached
+ *      coremap_cachefile  - add a frame to the cache. Returns the frame
+ *                           to map, another one if the page was added
+ *                           meanwhile
+ * With OPT_SWAP cached frames are reclaimed by the clock like the others:
+ * they're dropped from every address space that maps them, written back
+ * to the file if dirty, and read again on the next fault. The pages of
+ * executables and the pages of file mappings (MAPPED) are cached
+ * separately, since the former are zero-filled outside their segment.
+ *
+ * With OPT_MMAPFILE the processes mapping a file with MAP_SHARED write
+ * to the cached frames directly, and the dirty ones go back to the file:
+ *      coremap_clean      - mark a frame written back. Returns false if
+ *                           it stays dirty because others map it too.
+ *                           While the clock reclaims it, nobody may map it
+ *
+ * With OPT_COMPACT a multi-page kernel allocation that finds free memory
+ * too fragmented moves user pages out of the way (see vm_relocate) and
+ * tries again. Frames that are pinned, being paged out, shared or cached
+ * can't be moved, and neither can kernel memory. For this reason multi-page
+ * allocations must not be made holding the lock of an address space:
+ *      coremap_compact    - empty a block of NPAGES contiguous frames.
+ *                           Returns false if no block can be emptied
+ *      coremap_compactstats - print compactions and pages moved
+ */
+
+struct addrspace;
+struct vnode;
+
+void            coremap_bootstrap(void);
+
+paddr_t         coremap_getkpages(unsigned npages);
+paddr_t         coremap_getupage(struct addrspace *as, vaddr_t vaddr,
+                                 bool zero);
+void            coremap_unpin(paddr_t paddr);
+void            coremap_touch(paddr_t paddr);
+void            coremap_share(paddr_t paddr);
+bool            coremap_unshare(paddr_t paddr, struct addrspace *as,
+                                vaddr_t vaddr);
+void            coremap_freepages(paddr_t paddr);
+bool            coremap_freeupage(paddr_t paddr);
+void            coremap_dirty(paddr_t paddr);
+bool            coremap_isdirty(paddr_t paddr);
+#if OPT_SWAP
+void            coremap_clockstats(void);
+#endif
+
+#if OPT_SHARETEXT
+paddr_t         coremap_lookupfile(struct vnode *v, off_t offset,
+                                   bool mapped);
+paddr_t         coremap_cachefile(paddr_t paddr, struct vnode *v,
+                                  off_t offset, bool mapped);
+void            coremap_filestats(void);
+#endif
+
+#if OPT_MMAPFILE
+bool            coremap_clean(paddr_t paddr);
+#endif
+
+#if OPT_COMPACT
+bool            coremap_compact(unsigned npages);
+void            coremap_compactstats(void);
+#endif
+
+#if OPT_ZEROPOOL
+bool            coremap_zerofill(void);
+void            coremap_zerostats(void);
+#endif
+
+#endif /* _COREMAP_H_ */
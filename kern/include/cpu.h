@@ -34,7 +34,28 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
-
+#include <opt-pfcache.h>
+#include <opt-asid.h>
+#include <opt-kmcache.h>
+#include <opt-mlfq.h>
+#include <opt-affinity.h>
+#include <opt-threadcache.h>
+#include <opt-workqueue.h>
+#if OPT_PFCACHE
+#include <pfcache.h>
+#endif
+#if OPT_KMCACHE
+#include <kmcache.h>
+#endif
+#if OPT_WORKQUEUE
+#include <workqueue.h>
+#endif
+
+
+#if OPT_MLFQ
+/* Priority levels of the multilevel feedback queue; 0 is the highest */
+#define MLFQ_NLEVELS 4
+#endif
 
 /*
  * Per-cpu structure
@@ -61,15 +82,47 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+#if OPT_PFCACHE
+	struct pfcache c_pfcache;	/* Free frames (interrupts off) */
+#endif
+#if OPT_KMCACHE
+	struct kmcache c_kmcache;	/* Free kmalloc blocks (ditto) */
+#endif
+#if OPT_THREADCACHE
+	struct threadlist c_threadcache; /* Dead threads with stacks (ditto) */
+	unsigned c_tc_hits;		/* Threads created from the cache */
+	unsigned c_tc_misses;		/* Threads created from scratch */
+	unsigned c_tc_drops;		/* Dead threads freed, cache full */
+#endif
+#if OPT_AFFINITY
+	struct thread *c_migrating;	/* Switched out, must go elsewhere */
+#endif
+#if OPT_ASID
+	unsigned c_asid;		/* ASID loaded in the MMU */
+	unsigned c_asidgen;		/* ASID generation of the TLB */
+#endif
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
+#if OPT_MLFQ
+	struct threadlist c_runqueue[MLFQ_NLEVELS]; /* Highest level first */
+	unsigned c_runcount;		/* Threads on all the levels */
+#else
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
+#endif
 	struct spinlock c_runqueue_lock;
 
+#if OPT_WORKQUEUE
+	/*
+	 * Accessed by other cpus.
+	 * Protected by the workqueue lock.
+	 */
+	struct workqueue c_workqueue;	/* Deferred work and its worker */
+#endif
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -155,6 +208,11 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast is like ipi_broadcast but carries TLB shootdown
+ * data; it returns the number of CPUs signalled.
+ * ipi_tlbshootdown_mask sends TLB shootdown data to the CPUs whose number
+ * is set in a bitmask, such as the ones that ran an address space; it
+ * returns the number of CPUs signalled.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -165,10 +223,14 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_PFFLUSH		4	/* Free frames cached are needed back */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_mask(uint32_t cpus,
+			       const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -94,6 +94,7 @@ struct openfile {
   struct vnode* v;
   unsigned reference_count;
   unsigned offset;
+  int accmode;       /* O_RDONLY, O_WRONLY or O_RDWR */
 };
 #endif /* OPT_FILE */
 
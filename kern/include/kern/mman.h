@@ -0,0 +1,27 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap() and munmap().
+ */
+
+
+/* Page protection, for the prot argument of mmap(). */
+#define PROT_NONE    0
+#define PROT_READ    1
+#define PROT_WRITE   2
+#define PROT_EXEC    4
+
+/* Flags for mmap(). */
+#define MAP_SHARED   0x1	/* Changes are seen by every mapping */
+#define MAP_PRIVATE  0x2	/* Changes are private to the process */
+#define MAP_FIXED    0x10	/* Map exactly at the given address */
+#define MAP_ANON     0x1000	/* Zero-filled memory, no file */
+
+/* Flags for msync(). */
+#define MS_ASYNC     0x1	/* Schedule the writes */
+#define MS_SYNC      0x2	/* Write before returning */
+#define MS_INVALIDATE 0x4	/* Drop cached copies */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -40,6 +40,9 @@
  * or might not. Check your own course materials to find out what's
  * specifically required of you.
  *
+ * Calls outside this list go in the local additions at the end, so that
+ * the numbers reserved above stay what they are.
+ *
  * Caution: this file is parsed by a shell script to generate the assembly
  * language system call stubs. Don't add weird stuff between the markers.
  */
@@ -197,6 +200,12 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- Local additions --
+//                              (virtual memory)
+#define SYS_msync        121
+//                              (process priority control)
+#define SYS_sched_setaffinity 122
+
 /*CALLEND*/
 
 
@@ -0,0 +1,37 @@
+#ifndef _KMCACHE_H_
+#define _KMCACHE_H_
+
+#include <opt-kmcache.h>
+#include <types.h>
+
+/*
+ * Per-CPU caches of free kmalloc blocks.
+ *
+ * Each struct cpu holds a small stack of free blocks for each size class
+ * of the subpage allocator, so that kmalloc and kfree are usually served
+ * with interrupts disabled and without taking kmalloc_spinlock. Empty
+ * and full stacks are refilled and drained in batches against the heap
+ * pages (see kmalloc.c).
+ *
+ * Functions:
+ *      kmcache_init    - initialize the caches of a new CPU
+ *
+ * The hit rate of every CPU is printed by kheap_printstats.
+ */
+
+#define KMCACHE_NSIZES  8       /* Size classes of the subpage allocator */
+#define KMCACHE_SIZE    16      /* Maximum blocks of each size per CPU   */
+
+struct kmcache {
+  void*             kc_blocks[KMCACHE_NSIZES][KMCACHE_SIZE];
+  unsigned          kc_count[KMCACHE_NSIZES]; /* Blocks cached per size */
+  unsigned          kc_hits;        /* Allocations served by the cache  */
+  unsigned          kc_misses;      /* Allocations needing a refill     */
+  unsigned          kc_flushes;     /* Releases needing a drain         */
+  unsigned          kc_cpu;         /* Number of the owner CPU          */
+  struct kmcache*   kc_next;        /* All the caches, for statistics   */
+};
+
+void            kmcache_init(struct kmcache *kc, unsigned cpunum);
+
+#endif /* _KMCACHE_H_ */
@@ -0,0 +1,42 @@
+#ifndef _KMPROF_H_
+#define _KMPROF_H_
+
+#include <opt-kmprof.h>
+#include <types.h>
+
+/*
+ * kmalloc profiler.
+ *
+ * While started, every kmalloc is charged to its call site, that is the
+ * return address in the caller (to be looked up with nm or addr2line on
+ * the kernel image). Each site counts allocations, failures, frees and
+ * bytes, keeps a histogram of the requested sizes and the total and
+ * longest lifetime of the blocks freed, in microseconds. Blocks allocated
+ * while stopped, or beyond the capacity of the table of live blocks, are
+ * not followed to their kfree.
+ *
+ * Functions:
+ *      kmprof_start      - start profiling, allocating the tables the first
+ *                          time. Returns ENOMEM if they can't be allocated
+ *      kmprof_stop       - stop profiling, keeping what was recorded
+ *      kmprof_reset      - forget what was recorded
+ *      kmprof_alloc      - called by kmalloc with the call site SITE, the
+ *                          block PTR (NULL on failure) and the size SZ
+ *      kmprof_free       - called by kfree with the block PTR
+ *      kmprof_print      - print the N sites that allocated the most bytes
+ */
+
+#define KMPROF_NSITES     128     /* Call sites tracked             */
+#define KMPROF_NLIVE      2048    /* Live blocks tracked (power of 2) */
+#define KMPROF_NBUCKETS   12      /* Sizes up to 16K, then the rest */
+
+int             kmprof_start(void);
+void            kmprof_stop(void);
+void            kmprof_reset(void);
+
+void            kmprof_alloc(vaddr_t site, void *ptr, size_t sz);
+void            kmprof_free(void *ptr);
+
+void            kmprof_print(unsigned n);
+
+#endif /* _KMPROF_H_ */
@@ -0,0 +1,41 @@
+#ifndef _KVMAP_H_
+#define _KVMAP_H_
+
+#include <opt-kvmap.h>
+#include <types.h>
+#include <vm.h>
+
+/*
+ * Kernel virtual window for large allocations.
+ *
+ * Large kmalloc blocks that can't be found physically contiguous are
+ * made of single frames mapped through the TLB on consecutive pages of
+ * kseg2. The mappings are global, so that they're valid in every
+ * address space, and are loaded on demand by vm_fault.
+ *
+ * Freed pages can still be in the TLB of some CPU: they're not reused
+ * until the whole window is shot down at once, when it's full.
+ *
+ * Functions:
+ *      kvmap_alloc       - map NPAGES new frames. Returns the address of
+ *                          the first page, 0 if out of memory or out of
+ *                          window
+ *      kvmap_free        - release the pages from kvmap_alloc at VADDR
+ *      kvmap_owns        - true if VADDR is in the window
+ *      kvmap_fault       - load the mapping of VADDR in the TLB. Returns
+ *                          EFAULT if VADDR is not mapped
+ *      kvmap_printstats  - print the usage of the window
+ */
+
+#define KVMAP_BASE      MIPS_KSEG2
+#define KVMAP_NPAGES    1024            /* 4M of window */
+
+vaddr_t         kvmap_alloc(unsigned npages);
+void            kvmap_free(vaddr_t vaddr);
+bool            kvmap_owns(vaddr_t vaddr);
+
+int             kvmap_fault(vaddr_t vaddr);
+
+void            kvmap_printstats(void);
+
+#endif /* _KVMAP_H_ */
@@ -0,0 +1,60 @@
+#ifndef _PFCACHE_H_
+#define _PFCACHE_H_
+
+#include <opt-pfcache.h>
+#include <types.h>
+
+/*
+ * Per-CPU caches of free page frames.
+ *
+ * Single-page kernel allocations (kmalloc pages, thread stacks, page
+ * tables...) are served by a small stack of free frames kept in each
+ * struct cpu, with interrupts disabled and without taking the global
+ * lock of the VM system. When the cache is empty it's refilled with
+ * PFCACHE_BATCH frames at once through vm_getframes; when it's full
+ * PFCACHE_BATCH frames go back through vm_putframes.
+ *
+ * Frames held by a cache are allocated as far as the VM system is
+ * concerned.
+ *
+ * Functions:
+ *      pfcache_init        - initialize the cache of a new CPU
+ *      pfcache_get         - take a frame. Returns 0 if the global pool
+ *                            is empty too
+ *      pfcache_put         - give back a frame. Returns false if it
+ *                            couldn't be cached (no CPU yet)
+ *      pfcache_flush       - give back every frame of the current CPU
+ *      pfcache_flushall    - give back every frame of every CPU, before
+ *                            an allocation fails or a page is evicted.
+ *                            The other CPUs are asked by IPI_PFFLUSH, and
+ *                            waited for unless interrupts are off
+ *      pfcache_ncached     - number of frames held by all the caches
+ *      pfcache_printstats  - print the hit rate of each CPU
+ */
+
+#define PFCACHE_SIZE    16      /* Frames held by each CPU */
+#define PFCACHE_BATCH   8       /* Frames moved at once to/from the pool */
+
+struct pfcache {
+  paddr_t           pc_frames[PFCACHE_SIZE];
+  unsigned          pc_count;       /* Frames currently cached          */
+  unsigned          pc_hits;        /* Allocations served by the cache  */
+  unsigned          pc_misses;      /* Allocations needing a refill     */
+  unsigned          pc_drains;      /* Releases needing a drain         */
+  unsigned          pc_flushes;     /* Flushes of the whole cache       */
+  unsigned          pc_flushgen;    /* Last pfcache_flushall served     */
+  unsigned          pc_cpu;         /* Number of the owner CPU          */
+  struct pfcache*   pc_next;        /* All the caches, for statistics   */
+};
+
+void            pfcache_init(struct pfcache *pc, unsigned cpunum);
+
+paddr_t         pfcache_get(void);
+bool            pfcache_put(paddr_t paddr);
+void            pfcache_flush(void);
+void            pfcache_flushall(void);
+
+unsigned        pfcache_ncached(void);
+void            pfcache_printstats(void);
+
+#endif /* _PFCACHE_H_ */
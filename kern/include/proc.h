@@ -39,6 +39,7 @@
 #include <opt-wait.h>
 #include <opt-fork.h>
 #include <opt-file.h>
+#include <opt-paging.h>
 #include <spinlock.h>
 
 #if OPT_WAIT
@@ -131,6 +132,10 @@ struct addrspace *proc_setas(struct addrspace *);
 int proc_wait(struct proc *);
 void proc_signal(struct proc *);
 struct proc* proc_from_pid(pid_t pid);
+#if OPT_PAGING
+/* Print the working set of the live and of the exited user processes */
+void proc_printvmstats(void);
+#endif /* OPT_PAGING */
 #endif /* OPT_WAIT */
 
 #if OPT_FORK
@@ -0,0 +1,77 @@
+#ifndef _PT_H_
+#define _PT_H_
+
+#include <opt-paging.h>
+#include <opt-swap.h>
+#include <types.h>
+#include <vm.h>
+
+/*
+ * Two-level page table, one for each address space.
+ *
+ * A user virtual address is split in 10 bits of first-level index, 10
+ * bits of second-level index and 12 bits of page offset. Only the lower
+ * half of the first-level table is needed, since user space ends at
+ * USERSPACETOP. Second-level tables are exactly one page long and they're
+ * allocated only when a page in their 4M range is touched.
+ *
+ * Functions:
+ *      pt_create   - allocate an empty page table. Returns NULL on error
+ *      pt_destroy  - release the page table, every frame it maps and every
+ *                    swap slot it refers to
+ *      pt_unmap    - release the frames and swap slots of NPAGES pages from
+ *                    VADDR, clearing their entries
+ *      pt_lookup   - return a pointer to the entry of VADDR. If CREATE is set
+ *                    the second-level table is allocated when missing,
+ *                    otherwise NULL is returned. Returns NULL on error too
+ *      pt_count    - count the pages in memory (resident set) and the
+ *                    swapped out ones
+ *      pt_copy     - share the mappings of OLD with NEW, marking the pages of
+ *                    both tables copy-on-write. No frame is copied here,
+ *                    and swapped out pages share their slot, which is
+ *                    reference counted (swap_share)
+ *
+ * pt_destroy and pt_unmap may wait for a page-out to complete, so they
+ * must not be called with the address space lock held.
+ */
+
+typedef uint32_t pte_t;
+
+#define PTE_VALID       0x00000001    /* Frame present in memory */
+#define PTE_COW         0x00000002    /* Frame shared, copy before writing */
+#define PTE_SWAP        0x00000004    /* Page in the swap area           */
+
+/*
+ * A valid entry holds the physical frame in the upper bits, a swapped out
+ * one holds its swap slot instead.
+ */
+#define PTE_SLOT_SHIFT  12
+
+#define PTE_PADDR(pte)  ((paddr_t)((pte) & PAGE_FRAME))
+#define PTE_MKVALID(pa) (((pa) & PAGE_FRAME) | PTE_VALID)
+#define PTE_SLOT(pte)   ((unsigned)((pte) >> PTE_SLOT_SHIFT))
+#define PTE_MKSWAP(s)   ((pte_t)(s) << PTE_SLOT_SHIFT | PTE_SWAP)
+
+#define PT_L1_SHIFT     22
+#define PT_L2_SHIFT     12
+#define PT_L2_ENTRIES   (PAGE_SIZE / sizeof(pte_t))
+#define PT_L1_ENTRIES   (USERSPACETOP >> PT_L1_SHIFT)
+
+#define PT_L1_INDEX(va) ((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va) (((va) >> PT_L2_SHIFT) & (PT_L2_ENTRIES - 1))
+#define PT_VADDR(i, j)  ((vaddr_t)(i) << PT_L1_SHIFT | (vaddr_t)(j) << PT_L2_SHIFT)
+
+struct pagetable {
+  pte_t*    pt_l2[PT_L1_ENTRIES];   /* Second-level tables, NULL if unused */
+};
+
+struct pagetable   *pt_create(void);
+void                pt_destroy(struct pagetable *pt);
+void                pt_unmap(struct pagetable *pt, vaddr_t vaddr,
+                             size_t npages);
+pte_t              *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+void                pt_count(struct pagetable *pt, unsigned *resident,
+                             unsigned *swapped);
+int                 pt_copy(struct pagetable *old, struct pagetable *new);
+
+#endif /* _PT_H_ */
@@ -0,0 +1,73 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <opt-slab.h>
+#include <types.h>
+#include <spinlock.h>
+
+/*
+ * Object caches (slab allocator).
+ *
+ * A cache hands out objects of a single type, carved out of one-page
+ * slabs. The constructor of the type runs on every object when its slab
+ * is made, and the destructor when the slab is given back to the VM
+ * system: in between, a freed object is kept in its constructed state
+ * (wait channels created, spinlocks initialized, lists empty...), so
+ * that the next allocation only needs to set up what changes from one
+ * use to the next. Whoever frees an object must leave it as the
+ * constructor did.
+ *
+ * Objects must fit in a page together with the slab header. A slab is
+ * released when it becomes empty, unless the cache would be left with
+ * less than a slab worth of free objects.
+ *
+ * Caches can be defined statically with SLAB_INITIALIZER, so that they
+ * can be used before kmalloc is, or made with slab_create.
+ *
+ * Functions:
+ *      slab_create     - make a cache of objects of SIZE bytes. CTOR may
+ *                        be NULL, and returns 0 or an error code; DTOR
+ *                        may be NULL. Returns NULL if out of memory
+ *      slab_destroy    - release a cache, whose objects must all be free
+ *      slab_alloc      - get a constructed object. Returns NULL if out of
+ *                        memory
+ *      slab_free       - give back an object, in its constructed state
+ *      slab_printstats - print the usage of every cache
+ */
+
+typedef int (*slab_ctor_t)(void *obj);
+typedef void (*slab_dtor_t)(void *obj);
+
+struct slab;
+
+struct slab_cache {
+  const char*         sc_name;
+  size_t              sc_size;        /* Object size (aligned)            */
+  slab_ctor_t         sc_ctor;
+  slab_dtor_t         sc_dtor;
+  struct spinlock     sc_lock;
+  unsigned            sc_perslab;     /* Objects in a slab, 0 until set up */
+  unsigned            sc_offset;      /* First object from the slab start */
+  struct slab*        sc_partial;     /* Slabs with free objects          */
+  unsigned            sc_nslabs;      /* Slabs of the cache               */
+  unsigned            sc_nfree;       /* Free objects in all the slabs    */
+  unsigned            sc_allocs;      /* Objects handed out so far        */
+  unsigned            sc_ctors;       /* Objects constructed so far       */
+  bool                sc_listed;      /* In the list of all the caches    */
+  struct slab_cache*  sc_next;        /* All the caches, for statistics   */
+};
+
+#define SLAB_INITIALIZER(name, size, ctor, dtor) \
+  { (name), (size), (ctor), (dtor), SPINLOCK_INITIALIZER, \
+    0, 0, NULL, 0, 0, 0, 0, false, NULL }
+
+struct slab_cache *slab_create(const char *name, size_t size,
+                               slab_ctor_t ctor, slab_dtor_t dtor);
+void            slab_destroy(struct slab_cache *sc);
+
+void           *slab_alloc(struct slab_cache *sc);
+void            slab_free(struct slab_cache *sc, void *obj);
+
+void            slab_printstats(void);
+
+#endif /* _SLAB_H_ */
@@ -0,0 +1,40 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include <opt-swap.h>
+#include <types.h>
+
+/*
+ * Swap area for the paging VM system.
+ *
+ * The whole raw disk SWAP_DEVICE is divided in page-sized slots, whose
+ * allocation is tracked by a bitmap. If the disk is missing the swap
+ * area is empty and every allocation fails, so the system behaves as
+ * if paging out was not supported.
+ *
+ * A slot may be shared by several page tables, after a fork or when a
+ * frame shared copy-on-write is paged out: it's reference counted, and
+ * each one reads its own copy back on the next fault.
+ *
+ * Functions:
+ *      swap_bootstrap  - open the swap device and build the slot bitmap
+ *      swap_alloc      - reserve a free slot. Returns ENOSPC if full
+ *      swap_share      - add a reference to SLOT
+ *      swap_free       - drop a reference to SLOT, releasing it with the
+ *                        last one
+ *      swap_out        - write the frame PADDR to SLOT
+ *      swap_in         - read SLOT in the frame PADDR
+ */
+
+#define SWAP_DEVICE "lhd1raw:"
+
+void            swap_bootstrap(void);
+
+int             swap_alloc(unsigned *slot);
+void            swap_share(unsigned slot);
+void            swap_free(unsigned slot);
+
+int             swap_out(paddr_t paddr, unsigned slot);
+int             swap_in(paddr_t paddr, unsigned slot);
+
+#endif /* _SWAP_H_ */
@@ -35,6 +35,10 @@
 #include <opt-wait.h>
 #include <opt-fork.h>
 #include <opt-file.h>
+#include <opt-sys_vm.h>
+#include <opt-mmapfile.h>
+#include <opt-affinity.h>
+#include <opt-timer.h>
 #include <types.h>
 #include <cdefs.h> /* for __DEAD */
 struct trapframe; /* from <machine/trapframe.h> */
@@ -64,6 +68,9 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+#if OPT_TIMER
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
+#endif /* OPT_TIMER */
 
 #if OPT_SYS_IO
 ssize_t sys_write(int fd, userptr_t buf, size_t nbyte);
@@ -90,4 +97,19 @@ int sys_remove(const char *path);
 off_t sys_lseek(int fd, off_t offset, int whence);
 #endif /* OPT_FILE */
 
+#if OPT_SYS_VM
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int32_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+#endif /* OPT_SYS_VM */
+
+#if OPT_MMAPFILE
+int sys_msync(userptr_t addr, size_t len, int flags);
+#endif /* OPT_MMAPFILE */
+
+#if OPT_AFFINITY
+int sys_sched_setaffinity(pid_t pid, uint32_t mask);
+#endif /* OPT_AFFINITY */
+
 #endif /* _SYSCALL_H_ */
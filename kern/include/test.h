@@ -37,6 +37,10 @@
 
 #include <opt-vm_alloc.h>
 #include <opt-data_struct.h>
+#include <opt-paging.h>
+#include <opt-wait.h>
+#include <opt-compact.h>
+#include <opt-affinity.h>
 
 /*
  * Test code.
@@ -59,6 +63,9 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+#if OPT_AFFINITY
+int affinitytest(int, char **);
+#endif
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -103,6 +110,12 @@ int nettest(int, char **);
 #if OPT_VM_ALLOC
 /* virtual memory tests */
 int memstats(int nargs, char **args);
+#if OPT_PAGING && OPT_WAIT
+int vmstats(int nargs, char **args);
+#endif
+#if OPT_COMPACT
+int compactmem(int nargs, char **args);
+#endif
 #endif /* OPT_VM_ALLOC */
 
 /* Routine for running a user-level program. */
@@ -39,6 +39,9 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <opt-mlfq.h>
+#include <opt-affinity.h>
+#include <opt-threadcache.h>
 
 struct cpu;
 
@@ -84,6 +87,15 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
+#if OPT_MLFQ
+	unsigned t_priority;		/* Scheduling level, 0 is the highest */
+	unsigned t_ticks;		/* Hardclocks used of the quantum */
+	unsigned t_readysince;		/* Hardclock count when last queued */
+#endif
+#if OPT_AFFINITY
+	uint32_t t_affinity;		/* CPUs it may run on, bit N for cpu N */
+	unsigned t_migrations;		/* Times it was moved to another CPU */
+#endif
 
 	/*
 	 * Interrupt state fields.
@@ -145,6 +157,19 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+#if OPT_AFFINITY
+/* Affinity mask of every cpu; threads start with it */
+#define THREAD_ALLCPUS 0xffffffff
+
+/*
+ * Restrict the current thread to the CPUs in MASK (bit N for cpu N),
+ * moving it at once if the current CPU is not one of them. Threads
+ * forked afterwards inherit the mask. Returns EINVAL if MASK has no
+ * existing CPU.
+ */
+int thread_setaffinity(uint32_t mask);
+#endif
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -163,6 +188,21 @@ void thread_yield(void);
  */
 void schedule(void);
 
+#if OPT_MLFQ
+/*
+ * Charge a hardclock to the current thread. Returns true if it should
+ * yield the cpu. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+#endif
+
+#if OPT_THREADCACHE
+/*
+ * Print the reuse of dead threads and stacks by each cpu.
+ */
+void thread_printstats(void);
+#endif
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
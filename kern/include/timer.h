@@ -0,0 +1,55 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <opt-timer.h>
+#include <types.h>
+
+/*
+ * Timer wheel.
+ *
+ * Timers fire after a number of hardclock ticks (1/HZ second). They're
+ * hashed by expiry tick on the TIMER_NSLOTS slots of a wheel, each slot
+ * kept sorted by expiry, and the hardclock of cpu 0 advances the wheel
+ * by one slot per tick. A tick then only looks at the timers that
+ * expire at that tick, whatever the number of pending ones.
+ *
+ * The callback of a timer is called from the timer interrupt, without
+ * any lock held: it must not sleep, but may wake threads up. A timer
+ * can be started again once it fired.
+ *
+ * Functions:
+ *      timer_init        - set up TM to call FUNC(ARG) when it fires
+ *      timer_start       - fire TM in TICKS ticks (at least one). TM must
+ *                          not be pending
+ *      timer_cancel      - stop TM. Returns false if it was not pending:
+ *                          it fired already, or its callback is running
+ *      timer_tick        - advance the wheel by one tick, called by
+ *                          hardclock on one cpu
+ *      timer_sleep       - put the current thread to sleep for at least
+ *                          TICKS whole ticks, the current one not
+ *                          counted. Returns ENOMEM if out of memory
+ *      timer_printstats  - print the counters of the wheel
+ */
+
+#define TIMER_NSLOTS    256     /* Slots of the wheel (power of 2) */
+
+struct timer {
+  struct timer*   tm_next;                /* Timers of the slot, by expiry */
+  struct timer*   tm_prev;
+  uint64_t        tm_expire;              /* Tick it fires at            */
+  void          (*tm_func)(void *arg);    /* Callback                    */
+  void*           tm_arg;
+  bool            tm_pending;             /* On the wheel                */
+};
+
+void            timer_init(struct timer *tm, void (*func)(void *), void *arg);
+void            timer_start(struct timer *tm, unsigned ticks);
+bool            timer_cancel(struct timer *tm);
+
+void            timer_tick(void);
+
+int             timer_sleep(unsigned ticks);
+
+void            timer_printstats(void);
+
+#endif /* _TIMER_H_ */
@@ -38,6 +38,14 @@
 
 
 #include <machine/vm.h>
+#include <opt-paging.h>
+#include <opt-swap.h>
+#include <opt-pfcache.h>
+#include <opt-asid.h>
+#include <opt-sharetext.h>
+#include <opt-mmapfile.h>
+#include <opt-compact.h>
+#include <opt-kvmap.h>
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -58,5 +66,87 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+#if OPT_PFCACHE
+/*
+ * Move single frames between the global pool and the per-CPU caches
+ * (pfcache.c). vm_getframes returns the number of frames obtained, up
+ * to N. Both may be called with interrupts off.
+ */
+unsigned vm_getframes(paddr_t *frames, unsigned n);
+void vm_putframes(const paddr_t *frames, unsigned n);
+#endif /* OPT_PFCACHE */
+
+#if OPT_PAGING
+/*
+ * TLB management for the paging VM system (vmtlb.c).
+ *
+ *    vm_tlb_load       - map VADDR of the current address space on the
+ *                        frame PADDR, read-only unless WRITEABLE is set.
+ *                        Replaces a previous mapping of the same page
+ *    vm_tlb_loadglobal - map VADDR of the kernel window (OPT_KVMAP) on the
+ *                        frame PADDR, in every address space
+ *    vm_tlb_invalidate - drop the mapping of VADDR of AS, if any, from the
+ *                        TLB of the current CPU
+ *    vm_tlb_invalidate_range - same for NPAGES pages from VADDR
+ *    vm_tlb_shootdown  - drop the mappings of NPAGES pages from VADDR of AS
+ *                        on every CPU that ran AS, waiting for the others.
+ *                        A null AS is the kernel window, dropped on every
+ *                        CPU. Returns ENOMEM if it couldn't wait for them
+ *    vm_tlb_flush      - drop every mapping
+ *    vm_tlb_activate   - switch the current CPU to AS. With OPT_ASID the
+ *                        translations of the other address spaces are kept
+ *    vm_tlb_drop       - drop every mapping of AS, on every CPU
+ *    vm_tlb_printstats - print TLB misses and flushes of each CPU
+ */
+struct addrspace;
+
+void vm_tlb_load(vaddr_t vaddr, paddr_t paddr, bool writeable);
+#if OPT_KVMAP
+void vm_tlb_loadglobal(vaddr_t vaddr, paddr_t paddr);
+#endif
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+void vm_tlb_invalidate_range(struct addrspace *as, vaddr_t vaddr,
+                             unsigned npages);
+int vm_tlb_shootdown(struct addrspace *as, vaddr_t vaddr, unsigned npages);
+void vm_tlb_flush(void);
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_drop(struct addrspace *as);
+void vm_tlb_printstats(void);
+#endif /* OPT_PAGING */
+
+#if OPT_SWAP
+struct addrspace;
+
+/* Write the page VADDR of AS, mapped on PADDR, to the swap area */
+int vm_pageout(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+
+/* Same for a frame shared copy-on-write, at VADDR in every address space */
+int vm_pageout_shared(vaddr_t vaddr, paddr_t paddr);
+
+#if OPT_SHARETEXT
+struct vnode;
+
+/* Drop the page OFFSET of V, cached in PADDR, from every address space */
+int vm_pageout_cached(struct vnode *v, off_t offset, bool mapped,
+                      paddr_t paddr);
+#endif
+#endif /* OPT_SWAP */
+
+#if OPT_MMAPFILE
+struct addrspace;
+struct vm_region;
+
+/* Write back the dirty pages of a shared file mapping (as_lock held) */
+int vm_msync(struct addrspace *as, struct vm_region *r, vaddr_t vaddr,
+             size_t npages);
+#endif /* OPT_MMAPFILE */
+
+#if OPT_COMPACT
+struct addrspace;
+
+/* Move the page VADDR of AS from the frame FROM to the frame TO */
+int vm_relocate(struct addrspace *as, vaddr_t vaddr, paddr_t from, paddr_t to);
+#endif /* OPT_COMPACT */
+
 
 #endif /* _VM_H_ */
@@ -45,6 +45,12 @@ struct wchan; /* Opaque */
  */
 struct wchan *wchan_create(const char *name);
 
+/*
+ * Change the symbolic name of a wait channel, with the same rules as
+ * for wchan_create. Must be unlocked.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  */
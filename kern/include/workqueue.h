@@ -0,0 +1,79 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+#include <opt-workqueue.h>
+#include <types.h>
+#include <timer.h>
+
+/*
+ * Workqueues for deferred work.
+ *
+ * Each CPU has a queue of work items and a kernel thread, its worker,
+ * that runs them in order, without any lock held, and sleeps when the
+ * queue is empty. An item can be queued from any context, interrupts
+ * included, and goes to the queue of the current CPU; with OPT_AFFINITY
+ * the worker is pinned to that CPU. The function of an item may sleep,
+ * and may queue or free the item again.
+ *
+ * An item is queued at most once: queueing it again while it's pending
+ * does nothing, so that a burst of requests is served by one run. It's
+ * no longer pending once its function starts, so a request made while
+ * it runs gets another run.
+ *
+ * Delayed items wait on a timer before being queued, on the CPU that
+ * queued them.
+ *
+ * Functions:
+ *      workqueue_init        - initialize the queue of a new CPU
+ *      workqueue_bootstrap   - start the workers, once every CPU runs.
+ *                              Items queued earlier run then
+ *      work_init             - set up WK to call FUNC(ARG)
+ *      work_queue            - queue WK. Returns false if it was pending
+ *      work_queue_delayed    - queue WK in TICKS ticks. Returns false if
+ *                              it was pending
+ *      work_cancel           - take WK off its queue or timer. Returns
+ *                              false if it was not pending, or about to
+ *                              run
+ *      workqueue_printstats  - print the counters of each CPU
+ */
+
+struct work {
+  struct work*        wk_next;          /* Queue of the worker          */
+  void              (*wk_func)(void *arg);
+  void*               wk_arg;
+  struct workqueue*   wk_wq;            /* Queue it goes to, if pending */
+  bool                wk_pending;       /* Queued or delayed, not run   */
+  bool                wk_delayed;       /* Waiting on its timer         */
+  struct timer        wk_timer;
+};
+
+/* Static item, same as work_init */
+#define WORK_INITIALIZER(func, arg) \
+  { NULL, (func), (arg), NULL, false, false, \
+    { NULL, NULL, 0, NULL, NULL, false } }
+
+struct workqueue {
+  struct work*        wq_head;          /* Items to run, in order       */
+  struct work*        wq_tail;
+  struct wchan*       wq_wchan;         /* Worker waits here, NULL if   */
+                                        /* not started yet              */
+  unsigned            wq_count;         /* Items queued                 */
+  unsigned            wq_peak;          /* Highest wq_count             */
+  unsigned            wq_queued;        /* Items queued in total        */
+  unsigned            wq_coalesced;     /* Requests for pending items   */
+  unsigned            wq_run;           /* Items run                    */
+  unsigned            wq_cpu;           /* Number of the owner CPU      */
+  struct workqueue*   wq_next;          /* All the queues               */
+};
+
+void            workqueue_init(struct workqueue *wq, unsigned cpunum);
+void            workqueue_bootstrap(void);
+
+void            work_init(struct work *wk, void (*func)(void *), void *arg);
+bool            work_queue(struct work *wk);
+bool            work_queue_delayed(struct work *wk, unsigned ticks);
+bool            work_cancel(struct work *wk);
+
+void            workqueue_printstats(void);
+
+#endif /* _WORKQUEUE_H_ */
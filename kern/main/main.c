@@ -54,6 +54,10 @@
 #include <opt-data_struct.h>
 #include "autoconf.h"  // for pseudoconfig
 #include <history.h>
+#include <opt-workqueue.h>
+#if OPT_WORKQUEUE
+#include <workqueue.h>
+#endif
 
 
 /*
@@ -135,6 +139,9 @@ boot(void)
 	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+#if OPT_WORKQUEUE
+	workqueue_bootstrap();
+#endif
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -45,6 +45,19 @@
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-kmprof.h"
+#include "opt-timer.h"
+#include "opt-threadcache.h"
+#include "opt-workqueue.h"
+#if OPT_KMPROF
+#include <kmprof.h>
+#endif
+#if OPT_TIMER
+#include <timer.h>
+#endif
+#if OPT_WORKQUEUE
+#include <workqueue.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -497,6 +510,76 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_KMPROF
+static
+int
+cmd_kheapprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kmprof_print(10);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "start")) {
+		return kmprof_start();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		kmprof_stop();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kmprof_reset();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		kmprof_print(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: khprof [start | stop | reset | nsites]\n");
+	}
+
+	return 0;
+}
+#endif /* OPT_KMPROF */
+
+#if OPT_TIMER
+static
+int
+cmd_timerstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	timer_printstats();
+
+	return 0;
+}
+#endif /* OPT_TIMER */
+
+#if OPT_THREADCACHE
+static
+int
+cmd_threadstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+#endif /* OPT_THREADCACHE */
+
+#if OPT_WORKQUEUE
+static
+int
+cmd_workqueuestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	workqueue_printstats();
+
+	return 0;
+}
+#endif /* OPT_WORKQUEUE */
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -569,6 +652,9 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+#if OPT_AFFINITY
+	"[aff] Affinity test                 ",
+#endif
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -585,6 +671,12 @@ static const char *testmenu[] = {
 	"[fs6] FS create stress              ",
 #if OPT_VM_ALLOC
   "[memstats] VM test                  ",
+#if OPT_PAGING && OPT_WAIT
+  "[vmstats] Working set of processes  ",
+#endif
+#if OPT_COMPACT
+  "[compact] Compact physical memory   ",
+#endif
 #endif /* OPT_VM_ALLOC */
 	NULL
 };
@@ -610,6 +702,18 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+#if OPT_KMPROF
+	"[khprof] Top kmalloc call sites     ",
+#endif
+#if OPT_TIMER
+	"[tm] Timer wheel stats              ",
+#endif
+#if OPT_THREADCACHE
+	"[ts] Thread cache stats             ",
+#endif
+#if OPT_WORKQUEUE
+	"[wq] Workqueue stats                ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -661,6 +765,18 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+#if OPT_KMPROF
+	{ "khprof",     cmd_kheapprof },
+#endif
+#if OPT_TIMER
+	{ "tm",         cmd_timerstats },
+#endif
+#if OPT_THREADCACHE
+	{ "ts",         cmd_threadstats },
+#endif
+#if OPT_WORKQUEUE
+	{ "wq",         cmd_workqueuestats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -680,6 +796,9 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+#if OPT_AFFINITY
+	{ "aff",	affinitytest },
+#endif
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
@@ -722,6 +841,12 @@ static struct {
 #if OPT_VM_ALLOC
 	/* virtual memory tests */
   {"memstats", memstats},
+#if OPT_PAGING && OPT_WAIT
+  {"vmstats", vmstats},
+#endif
+#if OPT_COMPACT
+  {"compact", compactmem},
+#endif
 #endif /* OPT_VM_ALLOC */
 
 	{ NULL, NULL }
@@ -48,6 +48,13 @@
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <kern/fcntl.h>
+#include <opt-slab.h>
+#include <opt-paging.h>
+#if OPT_SLAB
+#include <kern/errno.h>
+#include <slab.h>
+#endif
 
 #if OPT_WAIT
 #include <limits.h>
@@ -57,6 +64,24 @@
 #define TABLE_IDX_TO_PID(idx) ((idx) + PID_MIN)
 
 static struct proc* pid_table[PROC_MAX] = { NULL };
+
+/*
+ * Held by whoever walks the table from another process (see
+ * proc_printvmstats): a process can't leave the table, nor lose its
+ * address space, while the walk is under way.
+ */
+static struct lock *pid_lock;
+
+#if OPT_PAGING
+/* Counters of the last process that exited with each pid */
+struct pid_exitstats {
+  bool pe_valid;
+  char pe_name[16];
+  struct as_stats pe_stats;
+};
+
+static struct pid_exitstats pid_exited[PROC_MAX];
+#endif /* OPT_PAGING */
 #endif /* OPT_WAIT */
 
 /*
@@ -78,9 +103,11 @@ pid_table_get(struct proc* proc)
   if (kproc == NULL)
     return 1;
 
+  lock_acquire(pid_lock);
   for (i = 0; i < PROC_MAX; i++) {
     if (pid_table[i] == NULL) {
       pid_table[i] = proc;
+      lock_release(pid_lock);
       return TABLE_IDX_TO_PID(i);
     }
   }
@@ -95,10 +122,56 @@ pid_table_remove(struct proc* proc)
   KASSERT(proc->p_pid > 0);
   KASSERT(proc->p_pid < TABLE_IDX_TO_PID(PROC_MAX));
 
+  lock_acquire(pid_lock);
   pid_table[PID_TO_TABLE_IDX(proc->p_pid)] = NULL;
+  lock_release(pid_lock);
+}
+
+#endif /* OPT_WAIT */
+
+#if OPT_SLAB
+/*
+ * Free process structures keep their spinlock and the synchronization
+ * objects used to wait for them.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+  struct proc *proc = obj;
+
+#if OPT_WAIT
+  proc->p_waitcv = cv_create("proc");
+  if (proc->p_waitcv == NULL) {
+    return ENOMEM;
+  }
+  proc->p_waitlk = lock_create("proc");
+  if (proc->p_waitlk == NULL) {
+    cv_destroy(proc->p_waitcv);
+    return ENOMEM;
+  }
+#endif /* OPT_WAIT */
+  spinlock_init(&proc->p_lock);
+
+  return 0;
 }
 
+static
+void
+proc_dtor(void *obj)
+{
+  struct proc *proc = obj;
+
+  spinlock_cleanup(&proc->p_lock);
+#if OPT_WAIT
+  cv_destroy(proc->p_waitcv);
+  lock_destroy(proc->p_waitlk);
 #endif /* OPT_WAIT */
+}
+
+static struct slab_cache proc_cache =
+  SLAB_INITIALIZER("proc", sizeof(struct proc), proc_ctor, proc_dtor);
+#endif /* OPT_SLAB */
 
 /*
  * Create a proc structure.
@@ -110,18 +183,28 @@ proc_create(const char *name)
 	struct proc *proc;
 	int i;
 
+#if OPT_SLAB
+	proc = slab_alloc(&proc_cache);
+#else
 	proc = kmalloc(sizeof(*proc));
+#endif
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
+#if OPT_SLAB
+		slab_free(&proc_cache, proc);
+#else
 		kfree(proc);
+#endif
 		return NULL;
 	}
 
 	proc->p_numthreads = 0;
+#if !OPT_SLAB
 	spinlock_init(&proc->p_lock);
+#endif
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -130,8 +213,10 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 
 #if OPT_WAIT
+#if !OPT_SLAB
   proc->p_waitcv = cv_create(name);
   proc->p_waitlk = lock_create(name);
+#endif
   proc->p_ended = false;
 
   proc->p_pid = pid_table_get(proc);
@@ -142,6 +227,7 @@ proc_create(const char *name)
     proc->openfiles[i].v = NULL;
     proc->openfiles[i].offset = 0;
     proc->openfiles[i].reference_count = 0;
+    proc->openfiles[i].accmode = O_RDONLY;
   }
 #else
     (void)i;
@@ -188,6 +274,9 @@ proc_destroy_as(struct proc *proc)
 		 */
   struct addrspace *as;
 
+#if OPT_WAIT
+  lock_acquire(pid_lock);
+#endif
   if (proc == curproc) {
     as = proc_setas(NULL);
     as_deactivate();
@@ -196,7 +285,20 @@ proc_destroy_as(struct proc *proc)
     as = proc->p_addrspace;
     proc->p_addrspace = NULL;
   }
+#if OPT_WAIT && OPT_PAGING
+  /* Keep the counters of the process, for proc_printvmstats */
+  if (as != NULL && proc->p_pid > 1) {
+    struct pid_exitstats *pe = &pid_exited[PID_TO_TABLE_IDX(proc->p_pid)];
+
+    pe->pe_valid = true;
+    snprintf(pe->pe_name, sizeof(pe->pe_name), "%s", proc->p_name);
+    as_getstats(as, &pe->pe_stats);
+  }
+#endif
   as_destroy(as);
+#if OPT_WAIT
+  lock_release(pid_lock);
+#endif
 }
 
 /*
@@ -237,17 +339,26 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
+#if !OPT_SLAB
 	spinlock_cleanup(&proc->p_lock);
+#endif
 
 #if OPT_WAIT
+#if !OPT_SLAB
   cv_destroy(proc->p_waitcv);
   lock_destroy(proc->p_waitlk);
+#endif
 
   pid_table_remove(proc);
 #endif /* OPT_WAIT */
 
 	kfree(proc->p_name);
+#if OPT_SLAB
+	/* Spinlock, cv and lock are kept for the next process */
+	slab_free(&proc_cache, proc);
+#else
 	kfree(proc);
+#endif
 }
 
 /*
@@ -260,6 +371,12 @@ proc_bootstrap(void)
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
 	}
+#if OPT_WAIT
+  pid_lock = lock_create("pid_table");
+  if (pid_lock == NULL) {
+    panic("lock_create for the pid table failed\n");
+  }
+#endif /* OPT_WAIT */
 }
 
 /*
@@ -438,5 +555,48 @@ proc_from_pid(pid_t pid)
   return pid_table[PID_TO_TABLE_IDX(pid)];
 }
 
+#if OPT_PAGING
+/**
+ * Print the resident set size and the fault counters of every user
+ * process, then the ones kept when the last process with each pid exited
+ */
+void
+proc_printvmstats(void)
+{
+  struct proc *proc;
+  struct addrspace *as;
+  struct as_stats st;
+  int i;
+
+  lock_acquire(pid_lock);
+
+  kprintf("Working set of the user processes:\n\n");
+  for (i = 0; i < PROC_MAX; i++) {
+    proc = pid_table[i];
+    if (proc == NULL) continue;
+
+    spinlock_acquire(&proc->p_lock);
+    as = proc->p_addrspace;
+    spinlock_release(&proc->p_lock);
+    if (as == NULL) continue;
+
+    as_getstats(as, &st);
+    kprintf("%5d %-16s ", TABLE_IDX_TO_PID(i), proc->p_name);
+    as_printstats(&st);
+  }
+
+  kprintf("\nExited processes:\n\n");
+  for (i = 0; i < PROC_MAX; i++) {
+    if (!pid_exited[i].pe_valid) continue;
+
+    kprintf("%5d %-16s ", TABLE_IDX_TO_PID(i), pid_exited[i].pe_name);
+    as_printstats(&pid_exited[i].pe_stats);
+  }
+  kprintf("\n");
+
+  lock_release(pid_lock);
+}
+#endif /* OPT_PAGING */
+
 #endif /* OPT_WAIT */
 
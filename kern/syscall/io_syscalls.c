@@ -11,6 +11,7 @@
 #include <current.h>
 #include <proc.h>
 #include <kern/seek.h>
+#include <kern/fcntl.h>
 
 #define IO_WRITE 0U
 #define IO_READ  1U
@@ -178,6 +179,7 @@ sys_open(const char *path, int oflag)
   for (i = STDERR_FILENO + 1; i < OPEN_MAX; i++) {
     if (p->openfiles[i].v == NULL) {
       p->openfiles[i].v = v;
+      p->openfiles[i].accmode = oflag & O_ACCMODE;
       return i;
     }
   }
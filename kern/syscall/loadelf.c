@@ -73,6 +73,9 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * With OPT_DEMANDLOAD the segment is only recorded as file-backed: the
+ * region was already checked against kernel space by as_define_region.
  */
 static
 int
@@ -81,15 +84,25 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if !OPT_DEMANDLOAD
 	struct iovec iov;
 	struct uio u;
 	int result;
+#endif
 
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
 		filesize = memsize;
 	}
 
+#if OPT_DEMANDLOAD
+	/* Nothing is read now: vm_fault reads each page when first touched */
+	(void)is_executable;
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes to 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_file(as, vaddr, filesize, v, offset);
+#else
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -143,6 +156,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 
 	return result;
+#endif /* OPT_DEMANDLOAD */
 }
 
 /*
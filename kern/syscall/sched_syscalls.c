@@ -0,0 +1,36 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <proc.h>
+#include <thread.h>
+#include <current.h>
+#include <syscall.h>
+
+/*
+ * Scheduling system calls.
+ */
+
+/**
+ * Restrict a process to some CPUs. User processes have a single thread,
+ * and a process can't find its threads, so only the calling process can
+ * be changed. Its children inherit the mask.
+ * @param pid     0 or the pid of the calling process
+ * @param mask    Bit N allows cpu N
+ * @return        0 on success, ESRCH for another process, EINVAL if the
+ *                mask has no existing CPU
+ */
+int
+sys_sched_setaffinity(pid_t pid, uint32_t mask)
+{
+#if OPT_WAIT
+  if (pid != 0 && pid != curproc->p_pid) {
+    return ESRCH;
+  }
+#else
+  if (pid != 0) {
+    return ESRCH;
+  }
+#endif
+
+  return thread_setaffinity(mask);
+}
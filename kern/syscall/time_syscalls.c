@@ -28,9 +28,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
+#if OPT_TIMER
+#include <timer.h>
+#endif
 
 /*
  * Example system call: get the time of day.
@@ -56,3 +61,50 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+#if OPT_TIMER
+/*
+ * Sleep for the time in USER_REQ, rounded up to whole hardclock ticks.
+ * Sleeps can't be interrupted, so the time left, if asked for, is
+ * always zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec req;
+	uint64_t ticks;
+	unsigned step;
+	int result;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	ticks = (uint64_t)req.tv_sec * HZ +
+		DIVROUNDUP((unsigned)req.tv_nsec, 1000000000 / HZ);
+	while (ticks > 0) {
+		/* Very long sleeps go in several steps */
+		step = ticks > 0x7fffffff ? 0x7fffffff : (unsigned)ticks;
+		result = timer_sleep(step);
+		if (result) {
+			return result;
+		}
+		ticks -= step;
+	}
+
+	if (user_rem != NULL) {
+		req.tv_sec = 0;
+		req.tv_nsec = 0;
+		result = copyout(&req, user_rem, sizeof(req));
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
+#endif /* OPT_TIMER */
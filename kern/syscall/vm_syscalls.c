@@ -0,0 +1,231 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <syscall.h>
+#if OPT_MMAPFILE
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <vnode.h>
+#endif
+
+/*
+ * Memory management system calls. The address space does the work, here
+ * the arguments are only checked and translated.
+ */
+
+/**
+ * Grow or shrink the heap of the current process
+ * @param amount    Bytes to add, negative to release memory
+ * @param retval    Where to store the previous break
+ * @return          0 on success, error code otherwise
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+  struct addrspace *as;
+  vaddr_t oldbreak;
+  int result;
+
+  as = proc_getas();
+  KASSERT(as != NULL);
+
+  result = as_sbrk(as, amount, &oldbreak);
+  if (result) {
+    return result;
+  }
+
+  *retval = (int32_t)oldbreak;
+  return 0;
+}
+
+#if OPT_MMAPFILE
+/*
+ * Map LEN bytes of the open file FD from OFFSET, for sys_mmap.
+ */
+static
+int
+sys_mmapfile(size_t len, int perm, bool shared, int fd, off_t offset,
+             vaddr_t *vaddr)
+{
+  struct vnode *v;
+  struct stat st;
+  size_t filesize;
+  int accmode, result;
+
+  if (fd < 0 || fd >= OPEN_MAX || curproc->openfiles[fd].v == NULL) {
+    return EBADF;
+  }
+  v = curproc->openfiles[fd].v;
+
+  /*
+   * Pages are always read in, and writes through a shared mapping reach
+   * the file, so the mapping can't give more than the open mode
+   */
+  accmode = curproc->openfiles[fd].accmode;
+  if (accmode == O_WRONLY) {
+    return EACCES;
+  }
+  if (shared && (perm & VR_WRITE) && accmode != O_RDWR) {
+    return EACCES;
+  }
+
+  if (offset < 0 || offset % PAGE_SIZE != 0) {
+    return EINVAL;
+  }
+
+  /* Let the file system refuse (directories, devices) */
+  result = VOP_MMAP(v);
+  if (result) {
+    return result;
+  }
+
+  result = VOP_STAT(v, &st);
+  if (result) {
+    return result;
+  }
+
+  /* Pages past the end of the file are zero-filled */
+  filesize = 0;
+  if (st.st_size > offset) {
+    filesize = st.st_size - offset < (off_t)len ?
+               (size_t)(st.st_size - offset) : len;
+  }
+
+  return as_mmapfile(proc_getas(), DIVROUNDUP(len, PAGE_SIZE), perm, shared,
+                     v, offset, filesize, vaddr);
+}
+#endif /* OPT_MMAPFILE */
+
+/**
+ * Map memory in the current process, anonymous or backed by a file (with
+ * OPT_MMAPFILE). The kernel always picks the address, as allowed without
+ * MAP_FIXED.
+ * @param addr      Address hint, ignored
+ * @param len       Length in bytes, rounded up to whole pages
+ * @param prot      PROT_READ | PROT_WRITE | PROT_EXEC, or PROT_NONE
+ * @param flags     MAP_SHARED or MAP_PRIVATE, and MAP_ANON
+ * @param fd        File to map, unused for anonymous mappings
+ * @param offset    Offset in the file (page aligned), unused for
+ *                  anonymous mappings
+ * @param retval    Where to store the address of the mapping
+ * @return          0 on success, EACCES if FD wasn't opened for the
+ *                  access asked, error code otherwise
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+         off_t offset, int32_t *retval)
+{
+  struct addrspace *as;
+  vaddr_t vaddr;
+  int perm, result;
+
+  (void)addr;
+
+  if (len == 0 || len > USERSPACETOP) {
+    return EINVAL;
+  }
+  if ((flags & MAP_SHARED) != 0 && (flags & MAP_PRIVATE) != 0) {
+    return EINVAL;
+  }
+  if ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0) {
+    return EINVAL;
+  }
+  if (flags & MAP_FIXED) {
+    return EINVAL;
+  }
+
+  perm = 0;
+  if (prot & PROT_READ) perm |= VR_READ;
+  if (prot & PROT_WRITE) perm |= VR_WRITE;
+  if (prot & PROT_EXEC) perm |= VR_EXEC;
+
+  as = proc_getas();
+  KASSERT(as != NULL);
+
+  if (flags & MAP_ANON) {
+    if (flags & MAP_SHARED) {
+      /* Shared anonymous memory needs a shared backing object */
+      return EINVAL;
+    }
+    (void)fd;
+    (void)offset;
+    result = as_mmap(as, DIVROUNDUP(len, PAGE_SIZE), perm, &vaddr);
+  } else {
+#if OPT_MMAPFILE
+    result = sys_mmapfile(len, perm, (flags & MAP_SHARED) != 0, fd, offset,
+                          &vaddr);
+#else
+    (void)fd;
+    (void)offset;
+    result = ENODEV;
+#endif
+  }
+  if (result) {
+    return result;
+  }
+
+  *retval = (int32_t)vaddr;
+  return 0;
+}
+
+/**
+ * Remove a mapping made by mmap, or part of it
+ * @param addr      First address, page aligned
+ * @param len       Length in bytes, rounded up to whole pages
+ * @return          0 on success, error code otherwise
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+  struct addrspace *as;
+  vaddr_t vaddr;
+
+  vaddr = (vaddr_t)addr;
+  if (len == 0 || vaddr % PAGE_SIZE != 0 || vaddr >= USERSPACETOP ||
+      len > USERSPACETOP - vaddr) {
+    return EINVAL;
+  }
+
+  as = proc_getas();
+  KASSERT(as != NULL);
+
+  return as_munmap(as, vaddr, DIVROUNDUP(len, PAGE_SIZE));
+}
+
+#if OPT_MMAPFILE
+/**
+ * Write back the modified pages of a shared file mapping. The writes are
+ * always synchronous.
+ * @param addr      First address, page aligned
+ * @param len       Length in bytes, rounded up to whole pages
+ * @param flags     MS_SYNC or MS_ASYNC, optionally MS_INVALIDATE
+ * @return          0 on success, error code otherwise
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+  struct addrspace *as;
+  vaddr_t vaddr;
+
+  vaddr = (vaddr_t)addr;
+  if (vaddr % PAGE_SIZE != 0 || vaddr >= USERSPACETOP ||
+      len > USERSPACETOP - vaddr) {
+    return EINVAL;
+  }
+  if ((flags & MS_SYNC) && (flags & MS_ASYNC)) {
+    return EINVAL;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  as = proc_getas();
+  KASSERT(as != NULL);
+
+  return as_msync(as, vaddr, DIVROUNDUP(len, PAGE_SIZE));
+}
+#endif /* OPT_MMAPFILE */
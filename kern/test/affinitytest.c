@@ -0,0 +1,132 @@
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+/*
+ * Affinity test. Threads pinned to cpu0 yield over and over, so that the
+ * other CPUs, left idle, try to steal them: none of them may ever be
+ * moved. The same threads are then run without a mask, for comparison.
+ * The migrations of every thread are listed.
+ */
+
+#define AFF_NTHREADS  8       /* Threads of each run                 */
+#define AFF_NYIELDS   200     /* Yields of each thread               */
+#define AFF_NLOOPS    20000   /* Busy loop between two yields        */
+
+static struct semaphore *aff_sem;
+static uint32_t aff_mask;                   /* Mask of the current run */
+static unsigned aff_migrations[AFF_NTHREADS];
+static bool aff_strayed[AFF_NTHREADS];      /* Seen off the mask */
+static volatile unsigned aff_spin;
+
+/**
+ * Pin the thread, then spin and yield, checking the cpu it runs on
+ * @param junk      Unused
+ * @param num       Index of the thread
+ */
+static
+void
+aff_thread(void *junk, unsigned long num)
+{
+  unsigned before, i, j;
+  int result;
+
+  (void)junk;
+
+  aff_strayed[num] = false;
+  result = thread_setaffinity(aff_mask);
+  if (result) {
+    panic("affinitytest: thread_setaffinity failed (%s)\n",
+          strerror(result));
+  }
+  /* Getting onto the mask may take a move */
+  before = curthread->t_migrations;
+
+  for (i = 0; i < AFF_NYIELDS; i++) {
+    for (j = 0; j < AFF_NLOOPS; j++) {
+      aff_spin++;
+    }
+    thread_yield();
+    if (((aff_mask >> curcpu->c_number) & 1) == 0) {
+      aff_strayed[num] = true;
+    }
+  }
+
+  aff_migrations[num] = curthread->t_migrations - before;
+  V(aff_sem);
+}
+
+/**
+ * Run AFF_NTHREADS threads restricted to MASK and list their migrations
+ * @param mask      CPUs the threads may run on
+ * @param pinned    The threads must never move
+ * @return          Threads that moved although pinned
+ */
+static
+unsigned
+aff_run(uint32_t mask, bool pinned)
+{
+  char name[16];
+  unsigned i, failed;
+  int result;
+
+  aff_mask = mask;
+  for (i = 0; i < AFF_NTHREADS; i++) {
+    snprintf(name, sizeof(name), "affinitytest%u", i);
+    result = thread_fork(name, NULL, aff_thread, NULL, i);
+    if (result) {
+      panic("affinitytest: thread_fork failed (%s)\n", strerror(result));
+    }
+  }
+  for (i = 0; i < AFF_NTHREADS; i++) {
+    P(aff_sem);
+  }
+
+  failed = 0;
+  for (i = 0; i < AFF_NTHREADS; i++) {
+    kprintf("  thread %u, mask 0x%x: %u migrations%s\n", i, mask,
+            aff_migrations[i], aff_strayed[i] ? ", ran off its mask" : "");
+    if (aff_strayed[i] || (pinned && aff_migrations[i] != 0)) {
+      failed++;
+    }
+  }
+  return failed;
+}
+
+/**
+ * Check that threads pinned to a cpu are never migrated
+ * @return          0
+ */
+int
+affinitytest(int nargs, char **args)
+{
+  unsigned failed;
+
+  (void)nargs;
+  (void)args;
+
+  aff_sem = sem_create("affinitytest", 0);
+  if (aff_sem == NULL) {
+    panic("affinitytest: sem_create failed\n");
+  }
+
+  kprintf("Starting affinity test...\n");
+  kprintf("Pinned to cpu0:\n");
+  failed = aff_run(0x1, true);
+  kprintf("Unpinned:\n");
+  failed += aff_run(THREAD_ALLCPUS, false);
+
+  sem_destroy(aff_sem);
+  aff_sem = NULL;
+
+  if (failed > 0) {
+    kprintf("Affinity test failed: %u threads moved\n", failed);
+  } else {
+    kprintf("Affinity test done.\n");
+  }
+  return 0;
+}
@@ -1,6 +1,31 @@
 #include <test.h>
+#include <kern/errno.h>
 #include <vm.h>
 #include <lib.h>
+#include <opt-buddy.h>
+#include <opt-pfcache.h>
+#include <opt-paging.h>
+#include <opt-zeropool.h>
+#include <opt-sharetext.h>
+#include <opt-swap.h>
+#include <opt-wait.h>
+#include <opt-compact.h>
+#include <opt-slab.h>
+#if OPT_BUDDY
+#include <buddy.h>
+#endif
+#if OPT_PFCACHE
+#include <pfcache.h>
+#endif
+#if OPT_SLAB
+#include <slab.h>
+#endif
+#if OPT_ZEROPOOL || OPT_SHARETEXT || OPT_SWAP || OPT_COMPACT
+#include <coremap.h>
+#endif
+#if OPT_PAGING && OPT_WAIT
+#include <proc.h>
+#endif
 
 /**
  * Integer percentage calculation
@@ -15,6 +40,46 @@ perc(unsigned a, unsigned b)
   return (100*a + b/2)/b;
 }
 
+/* Buckets of the free run histogram: 1, 2-3, 4-7, ..., 1024+ pages */
+#define FRAG_BUCKETS 11
+
+/**
+ * Print the histogram of the lengths of the free runs and the largest
+ * block that a multi-page allocation can get right now
+ */
+static
+void
+fragstats(void)
+{
+  unsigned runs[FRAG_BUCKETS];
+  unsigned i, longest, largest;
+#if OPT_BUDDY
+  unsigned order;
+#endif
+
+  longest = ram_getfreeruns(runs, FRAG_BUCKETS);
+#if OPT_BUDDY
+  /* Blocks are only handed out whole and aligned */
+  for (order = BUDDY_NORDERS; order > 0 && buddy_nfree(order - 1) == 0;
+       order--);
+  largest = order == 0 ? 0 : 1U << (order - 1);
+#else
+  largest = longest;
+#endif
+
+  kprintf("Free runs by length:\n");
+  for (i = 0; i < FRAG_BUCKETS; i++) {
+    if (i + 1 < FRAG_BUCKETS) {
+      kprintf("  %4u-%4u pages:           %u\n",
+              1U << i, (2U << i) - 1, runs[i]);
+    } else {
+      kprintf("  %4u+     pages:           %u\n", 1U << i, runs[i]);
+    }
+  }
+  kprintf("Largest free run:           %u pages\n", longest);
+  kprintf("Largest allocatable block:  %u pages\n", largest);
+}
+
 /**
  * Provides statistics about RAM usage and contiguous block of pages allocatable
  * @param nargs     Unused
@@ -30,6 +95,9 @@ memstats(int nargs, char **args)
   unsigned total_ram, kernel_ram;
   unsigned total_pages, alloc_pages;
   unsigned leaked_pages;
+#if OPT_BUDDY
+  unsigned order;
+#endif
   
   total_ram = ram_gettotal();
   kernel_ram = ram_getkernel();
@@ -51,6 +119,51 @@ memstats(int nargs, char **args)
           alloc_pages,
           perc(alloc_pages, total_pages));
   kprintf("\n");
+#if OPT_BUDDY
+  kprintf("Free blocks per order:\n");
+  for (order = 0; order < BUDDY_NORDERS; order++) {
+  kprintf("  Order %2u (%4u pages):     %u\n",
+          order, 1U << order, buddy_nfree(order));
+  }
+  kprintf("\n");
+#endif
+  fragstats();
+  kprintf("\n");
+#if OPT_COMPACT
+  kprintf("Compaction:\n");
+  coremap_compactstats();
+  kprintf("\n");
+#endif
+#if OPT_PAGING
+  kprintf("TLB:\n");
+  vm_tlb_printstats();
+  kprintf("\n");
+#endif
+#if OPT_SWAP
+  kprintf("Page replacement:\n");
+  coremap_clockstats();
+  kprintf("\n");
+#endif
+#if OPT_SHARETEXT
+  kprintf("Page cache:\n");
+  coremap_filestats();
+  kprintf("\n");
+#endif
+#if OPT_ZEROPOOL
+  kprintf("Zero pool:\n");
+  coremap_zerostats();
+  kprintf("\n");
+#endif
+#if OPT_PFCACHE
+  kprintf("Per-CPU frame caches:\n");
+  pfcache_printstats();
+  kprintf("\n");
+#endif
+#if OPT_SLAB
+  kprintf("Object caches:\n");
+  slab_printstats();
+  kprintf("\n");
+#endif
   if (leaked_pages > 0) {
   kprintf("Leakage detected:           %u pages\n", leaked_pages);
   } else {
@@ -62,4 +175,69 @@ memstats(int nargs, char **args)
   kprintf("\n");
 
   return 0;
-}
\ No newline at end of file
+}
+
+#if OPT_PAGING && OPT_WAIT
+/**
+ * Print the resident set size and the fault counters of every user
+ * process, including the ones that already exited
+ * @param nargs     Unused
+ * @param args      Unused
+ * @return          Success value
+ */
+int
+vmstats(int nargs, char **args)
+{
+  (void)nargs;
+  (void)args;
+
+  proc_printvmstats();
+
+  return 0;
+}
+#endif /* OPT_PAGING && OPT_WAIT */
+
+#if OPT_COMPACT
+/**
+ * Rebuild a free block of contiguous pages moving user pages away, and
+ * show the fragmentation before and after
+ * @param nargs     Number of arguments
+ * @param args      Optional size of the block in pages (default 16)
+ * @return          Success value
+ */
+int
+compactmem(int nargs, char **args)
+{
+  unsigned npages;
+
+  npages = 16;
+  if (nargs > 2) {
+    kprintf("Usage: compact [npages]\n");
+    return EINVAL;
+  }
+  if (nargs == 2) {
+    npages = atoi(args[1]);
+    if (npages < 2) {
+      kprintf("compact: a block needs at least 2 pages\n");
+      return EINVAL;
+    }
+  }
+
+  kprintf("Before compaction:\n");
+  fragstats();
+  kprintf("\n");
+
+  if (coremap_compact(npages)) {
+    kprintf("Block of %u pages rebuilt\n", npages);
+  } else {
+    kprintf("No block of %u pages can be rebuilt\n", npages);
+  }
+  coremap_compactstats();
+  kprintf("\n");
+
+  kprintf("After compaction:\n");
+  fragstats();
+
+  return 0;
+}
+#endif /* OPT_COMPACT */
@@ -34,6 +34,10 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <opt-timer.h>
+#if OPT_TIMER
+#include <timer.h>
+#endif
 
 /*
  * Time handling.
@@ -97,12 +101,24 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+#if OPT_TIMER
+	/* One cpu is enough to drive the timer wheel */
+	if (curcpu->c_number == 0) {
+		timer_tick();
+	}
+#endif
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
+#if OPT_MLFQ
+	/* Threads keep the cpu for the quantum of their level */
+	if (!thread_tick()) {
+		return;
+	}
+#endif
 	thread_yield();
 }
 
@@ -112,6 +128,12 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
+#if OPT_TIMER
+	/* On the timer wheel, unless there's no memory for it */
+	if (num_secs <= 0 || timer_sleep(num_secs * HZ) == 0) {
+		return;
+	}
+#endif
 	spinlock_acquire(&lbolt_lock);
 	while (num_secs > 0) {
 		wchan_sleep(lbolt, &lbolt_lock);
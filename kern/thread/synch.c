@@ -39,11 +39,79 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <opt-slab.h>
+#if OPT_SLAB
+#include <kern/errno.h>
+#include <slab.h>
+#endif
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+#if OPT_SLAB
+/*
+ * Free semaphores keep their wait channel and spinlock: only the name
+ * and the count are set by sem_create.
+ */
+static int sem_ctor(void *obj)
+{
+  struct semaphore *sem = obj;
+
+  sem->sem_wchan = wchan_create("sem");
+  if (sem->sem_wchan == NULL) {
+    return ENOMEM;
+  }
+  spinlock_init(&sem->sem_lock);
+  return 0;
+}
+
+static void sem_dtor(void *obj)
+{
+  struct semaphore *sem = obj;
+
+  spinlock_cleanup(&sem->sem_lock);
+  wchan_destroy(sem->sem_wchan);
+}
+
+static struct slab_cache sem_cache =
+  SLAB_INITIALIZER("semaphore", sizeof(struct semaphore), sem_ctor, sem_dtor);
+
+struct semaphore *sem_create(const char *name, unsigned initial_count)
+{
+  struct semaphore *sem;
+
+  sem = slab_alloc(&sem_cache);
+  if (sem == NULL) {
+    return NULL;
+  }
+
+  sem->sem_name = kstrdup(name);
+  if (sem->sem_name == NULL) {
+    slab_free(&sem_cache, sem);
+    return NULL;
+  }
+
+  wchan_setname(sem->sem_wchan, sem->sem_name);
+  sem->sem_count = initial_count;
+
+  return sem;
+}
+
+void sem_destroy(struct semaphore *sem)
+{
+  KASSERT(sem != NULL);
+
+  /* Nobody may be waiting, since the wait channel is reused */
+  spinlock_acquire(&sem->sem_lock);
+  KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+  spinlock_release(&sem->sem_lock);
+
+  wchan_setname(sem->sem_wchan, "sem");
+  kfree(sem->sem_name);
+  slab_free(&sem_cache, sem);
+}
+#else
 struct semaphore *sem_create(const char *name, unsigned initial_count)
 {
   struct semaphore *sem;
@@ -82,6 +150,7 @@ void sem_destroy(struct semaphore *sem)
   kfree(sem->sem_name);
   kfree(sem);
 }
+#endif /* OPT_SLAB */
 
 void P(struct semaphore *sem)
 {
@@ -134,24 +203,81 @@ void V(struct semaphore *sem)
 //
 // Lock.
 
+#if OPT_SLAB
+/*
+ * Free locks keep what they wait on, and are left unheld.
+ */
+static int lock_ctor(void *obj)
+{
+  struct lock *lock = obj;
+
+#if OPT_LOCK
+  lock->lk_wchan = wchan_create("lock");
+  if (lock->lk_wchan == NULL) {
+    return ENOMEM;
+  }
+  spinlock_init(&lock->lk_splk);
+#elif OPT_LOCK_SEM
+  lock->lk_sem = sem_create("lock", 1);
+  if (lock->lk_sem == NULL) {
+    return ENOMEM;
+  }
+#endif
+  (void)lock;
+  return 0;
+}
+
+static void lock_dtor(void *obj)
+{
+  struct lock *lock = obj;
+
+#if OPT_LOCK
+  spinlock_cleanup(&lock->lk_splk);
+  wchan_destroy(lock->lk_wchan);
+#elif OPT_LOCK_SEM
+  sem_destroy(lock->lk_sem);
+#endif
+  (void)lock;
+}
+
+static struct slab_cache lock_cache =
+  SLAB_INITIALIZER("lock", sizeof(struct lock), lock_ctor, lock_dtor);
+#endif /* OPT_SLAB */
+
 struct lock *lock_create(const char *name)
 {
   struct lock *lock;
 
+#if OPT_SLAB
+  lock = slab_alloc(&lock_cache);
+#else
   lock = kmalloc(sizeof(*lock));
+#endif
   if (lock == NULL) {
     return NULL;
   }
 
   lock->lk_name = kstrdup(name);
   if (lock->lk_name == NULL) {
+#if OPT_SLAB
+    slab_free(&lock_cache, lock);
+#else
     kfree(lock);
+#endif
     return NULL;
   }
 
   HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
 
+#if OPT_SLAB
+  /* Wait channel and spinlock (or semaphore) made by lock_ctor */
 #if OPT_LOCK
+  wchan_setname(lock->lk_wchan, lock->lk_name);
+#endif
+#if OPT_LOCK || OPT_LOCK_SEM
+  lock->lk_holder = NULL;
+#endif
+#elif OPT_LOCK
   lock->lk_wchan = wchan_create(lock->lk_name);
   spinlock_init(&lock->lk_splk);
   lock->lk_holder = NULL;
@@ -171,7 +297,14 @@ void lock_destroy(struct lock *lock)
 {
   KASSERT(lock != NULL);
 
+#if OPT_SLAB
 #if OPT_LOCK
+  KASSERT(lock->lk_holder == NULL);
+  wchan_setname(lock->lk_wchan, "lock");
+#elif OPT_LOCK_SEM
+  KASSERT(lock->lk_holder == NULL);
+#endif
+#elif OPT_LOCK
   spinlock_cleanup(&lock->lk_splk);
   wchan_destroy(lock->lk_wchan);
 #elif OPT_LOCK_SEM
@@ -180,7 +313,11 @@ void lock_destroy(struct lock *lock)
 #endif
 
   kfree(lock->lk_name);
+#if OPT_SLAB
+  slab_free(&lock_cache, lock);
+#else
   kfree(lock);
+#endif
 }
 
 void lock_acquire(struct lock *lock)
@@ -244,23 +381,66 @@ bool lock_do_i_hold(struct lock *lock)
 //
 // CV
 
+#if OPT_SLAB
+/*
+ * Free condition variables keep their wait channel and spinlock.
+ */
+static int cv_ctor(void *obj)
+{
+  struct cv *cv = obj;
+
+#if OPT_CV
+  cv->cv_wchan = wchan_create("cv");
+  if (cv->cv_wchan == NULL) {
+    return ENOMEM;
+  }
+  spinlock_init(&cv->cv_splk);
+#endif
+  (void)cv;
+  return 0;
+}
+
+static void cv_dtor(void *obj)
+{
+  struct cv *cv = obj;
+
+#if OPT_CV
+  wchan_destroy(cv->cv_wchan);
+  spinlock_cleanup(&cv->cv_splk);
+#endif
+  (void)cv;
+}
+
+static struct slab_cache cv_cache =
+  SLAB_INITIALIZER("cv", sizeof(struct cv), cv_ctor, cv_dtor);
+#endif /* OPT_SLAB */
 
 struct cv *cv_create(const char *name)
 {
   struct cv *cv;
 
+#if OPT_SLAB
+  cv = slab_alloc(&cv_cache);
+#else
   cv = kmalloc(sizeof(*cv));
+#endif
   if (cv == NULL) {
     return NULL;
   }
 
   cv->cv_name = kstrdup(name);
   if (cv->cv_name == NULL) {
+#if OPT_SLAB
+    slab_free(&cv_cache, cv);
+#else
     kfree(cv);
+#endif
     return NULL;
   }
 
-#if OPT_CV
+#if OPT_SLAB && OPT_CV
+  wchan_setname(cv->cv_wchan, cv->cv_name);
+#elif OPT_CV
   cv->cv_wchan = wchan_create(cv->cv_name);
   spinlock_init(&cv->cv_splk);
 
@@ -275,13 +455,19 @@ void cv_destroy(struct cv *cv)
 {
   KASSERT(cv != NULL);
 
-#if OPT_CV
+#if OPT_SLAB && OPT_CV
+  wchan_setname(cv->cv_wchan, "cv");
+#elif OPT_CV
   wchan_destroy(cv->cv_wchan);
   spinlock_cleanup(&cv->cv_splk);
 #endif
 
   kfree(cv->cv_name);
+#if OPT_SLAB
+  slab_free(&cv_cache, cv);
+#else
   kfree(cv);
+#endif
 }
 
 void cv_wait(struct cv *cv, struct lock *lock)
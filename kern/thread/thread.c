@@ -50,6 +50,16 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <opt-zeropool.h>
+#include <opt-slab.h>
+#include <opt-steal.h>
+#include <opt-threadcache.h>
+#if OPT_ZEROPOOL
+#include <coremap.h>
+#endif
+#if OPT_SLAB
+#include <slab.h>
+#endif
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -61,6 +71,60 @@ struct wchan {
 	struct threadlist wc_threads;	/* list of waiting threads */
 };
 
+#if OPT_SLAB
+/*
+ * Threads and wait channels come from object caches. A free thread
+ * keeps its list node and machine-dependent state initialized, a free
+ * wait channel its (empty) list of threads.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+static struct slab_cache thread_cache =
+	SLAB_INITIALIZER("thread", sizeof(struct thread),
+			 thread_ctor, thread_dtor);
+static struct slab_cache wchan_cache =
+	SLAB_INITIALIZER("wchan", sizeof(struct wchan),
+			 wchan_ctor, wchan_dtor);
+#endif /* OPT_SLAB */
+
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
@@ -108,6 +172,442 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Run queues.
+ *
+ * With the multilevel feedback queue each cpu has one list per
+ * priority level, and a ready thread waits on the list of its level;
+ * otherwise there's a single list. The runqueue lock of the cpu must
+ * be held, except during setup and panic.
+ */
+
+#if OPT_AFFINITY
+/* True if thread T may run on cpu C */
+#define THREAD_CANRUN(t, c)	((((t)->t_affinity >> (c)->c_number) & 1) != 0)
+#else
+#define THREAD_CANRUN(t, c)	true
+#endif
+
+#if OPT_MLFQ
+/* Quantum of each level, in hardclocks: 2, 4, 8, 16 */
+#define MLFQ_QUANTUM(level)	(2U << (level))
+/* Time a ready thread waits on a level before aging up one level */
+#define MLFQ_AGE_HARDCLOCKS	20
+#endif
+
+static
+void
+runqueue_init(struct cpu *c)
+{
+#if OPT_MLFQ
+	unsigned i;
+
+	for (i=0; i<MLFQ_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+#else
+	threadlist_init(&c->c_runqueue);
+#endif
+}
+
+/*
+ * Blat the list structures by hand, for thread_panic.
+ */
+static
+void
+runqueue_drop(struct cpu *c)
+{
+	struct threadlist *tl;
+#if OPT_MLFQ
+	unsigned i;
+
+	for (i=0; i<MLFQ_NLEVELS; i++) {
+		tl = &c->c_runqueue[i];
+		tl->tl_count = 0;
+		tl->tl_head.tln_next = &tl->tl_tail;
+		tl->tl_tail.tln_prev = &tl->tl_head;
+	}
+	c->c_runcount = 0;
+#else
+	tl = &c->c_runqueue;
+	tl->tl_count = 0;
+	tl->tl_head.tln_next = &tl->tl_tail;
+	tl->tl_tail.tln_prev = &tl->tl_head;
+#endif
+}
+
+/*
+ * Number of threads waiting to run on C.
+ */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+#if OPT_MLFQ
+	return c->c_runcount;
+#else
+	return c->c_runqueue.tl_count;
+#endif
+}
+
+/*
+ * Queue T at the end of (the list of its level of) C's run queue.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+#if OPT_MLFQ
+	KASSERT(t->t_priority < MLFQ_NLEVELS);
+	t->t_readysince = c->c_hardclocks;
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+#else
+	threadlist_addtail(&c->c_runqueue, t);
+#endif
+}
+
+/*
+ * Take the next thread to run: the first one of the highest level.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+#if OPT_MLFQ
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<MLFQ_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+#else
+	return threadlist_remhead(&c->c_runqueue);
+#endif
+}
+
+#if !OPT_STEAL
+/*
+ * Take the thread that would run last: the last one of the lowest
+ * level. Used to pick threads to move to other cpus.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+#if OPT_MLFQ
+	struct thread *t;
+	unsigned i;
+
+	for (i=MLFQ_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+#else
+	return threadlist_remtail(&c->c_runqueue);
+#endif
+}
+#endif
+
+#if OPT_AFFINITY
+/*
+ * Choose a cpu for T among the ones of its mask: an idle one, or else
+ * the one with the fewest threads waiting. The counts are read without
+ * the locks, as hints. Returns T's current cpu if the mask has none.
+ */
+static
+struct cpu *
+thread_pickcpu(struct thread *t)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus, count, bestcount;
+
+	best = NULL;
+	bestcount = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!THREAD_CANRUN(t, c)) {
+			continue;
+		}
+		if (c->c_isidle) {
+			return c;
+		}
+		count = runqueue_count(c);
+		if (best == NULL || count < bestcount) {
+			best = c;
+			bestcount = count;
+		}
+	}
+	return best != NULL ? best : t->t_cpu;
+}
+#endif
+
+#if OPT_STEAL
+/*
+ * Work stealing.
+ *
+ * A cpu that runs out of threads takes some from the tail of the run
+ * queue of its busiest sibling before idling, and every cpu
+ * periodically pulls from the busiest one if that's well ahead (see
+ * thread_consider_migration). The counts are read without the locks,
+ * as hints, and the threads are moved holding one runqueue lock at a
+ * time.
+ */
+
+/*
+ * Find the sibling of the current cpu with the most threads waiting,
+ * and their number. Returns NULL if none has any.
+ */
+static
+struct cpu *
+runqueue_busiest(unsigned *countp)
+{
+	struct cpu *c, *busiest;
+	unsigned i, numcpus, count;
+
+	busiest = NULL;
+	*countp = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		count = runqueue_count(c);
+		if (count > *countp) {
+			busiest = c;
+			*countp = count;
+		}
+	}
+	return busiest;
+}
+
+/*
+ * Take the thread that would run last on C among the ones that may go
+ * to DEST. A thread can be on the run queue while still curthread of
+ * C: it went to sleep and was woken up while C was idling. It must not
+ * move (see the notes in thread_consider_migration), so it's skipped,
+ * and so are the ones whose mask doesn't allow DEST.
+ */
+static
+struct thread *
+runqueue_remmovable(struct cpu *c, struct cpu *dest)
+{
+	struct thread *t;
+#if OPT_MLFQ
+	unsigned i;
+
+	for (i=MLFQ_NLEVELS; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			if (t != c->c_curthread && THREAD_CANRUN(t, dest)) {
+				threadlist_remove(&c->c_runqueue[i], t);
+				c->c_runcount--;
+				return t;
+			}
+		}
+	}
+#else
+	THREADLIST_FORALL_REV(t, c->c_runqueue) {
+		if (t != c->c_curthread && THREAD_CANRUN(t, dest)) {
+			threadlist_remove(&c->c_runqueue, t);
+			return t;
+		}
+	}
+#endif
+	return NULL;
+}
+
+/*
+ * Move up to N threads from the tail of VICTIM's run queue to the
+ * current cpu's. The caller must not hold any runqueue lock. Returns
+ * the number of threads moved.
+ */
+static
+unsigned
+thread_steal(struct cpu *victim, unsigned n)
+{
+	struct threadlist stolen;
+	struct thread *t;
+	unsigned moved;
+
+	threadlist_init(&stolen);
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	for (moved = 0; moved < n; moved++) {
+		t = runqueue_remmovable(victim, curcpu->c_self);
+		if (t == NULL) {
+			break;
+		}
+		threadlist_addtail(&stolen, t);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (moved > 0) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		while ((t = threadlist_remhead(&stolen)) != NULL) {
+			t->t_cpu = curcpu->c_self;
+#if OPT_AFFINITY
+			t->t_migrations++;
+#endif
+			runqueue_add(curcpu->c_self, t);
+			DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+			      t->t_name, victim->c_number, curcpu->c_number);
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+
+	threadlist_cleanup(&stolen);
+	return moved;
+}
+
+/*
+ * Called by a cpu that has nothing to run, without its runqueue lock:
+ * take half the threads waiting on the busiest sibling. Returns the
+ * number of threads taken.
+ */
+static
+unsigned
+thread_steal_idle(void)
+{
+	struct cpu *victim;
+	unsigned count;
+
+	victim = runqueue_busiest(&count);
+	if (victim == NULL) {
+		return 0;
+	}
+	return thread_steal(victim, DIVROUNDUP(count, 2));
+}
+
+/*
+ * Threads are piling up on BUSY: wake up an idle sibling, if any, so
+ * that it steals some of them now rather than at its next hardclock.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+#endif /* OPT_STEAL */
+
+////////////////////////////////////////////////////////////
+
+#if OPT_THREADCACHE
+/* Dead threads kept by each cpu, with their stacks */
+#define THREADCACHE_SIZE 8
+#endif
+
+/*
+ * Get the memory for a thread. With OPT_THREADCACHE this is the last
+ * thread that died on this cpu, if any, and its stack is still in
+ * t_stack; otherwise t_stack is NULL.
+ */
+static
+struct thread *
+thread_alloc(void)
+{
+	struct thread *thread;
+#if OPT_THREADCACHE
+	int spl;
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		thread = threadlist_remhead(&curcpu->c_threadcache);
+		if (thread != NULL) {
+			curcpu->c_tc_hits++;
+		}
+		else {
+			curcpu->c_tc_misses++;
+		}
+		splx(spl);
+		if (thread != NULL) {
+			return thread;
+		}
+	}
+#endif
+
+#if OPT_SLAB
+	thread = slab_alloc(&thread_cache);
+#else
+	thread = kmalloc(sizeof(*thread));
+#endif
+	if (thread != NULL) {
+		thread->t_stack = NULL;
+	}
+	return thread;
+}
+
+/*
+ * Release the memory of a thread and of its stack. With OPT_THREADCACHE
+ * they're kept together by this cpu for the next thread_alloc, unless
+ * it has enough already.
+ */
+static
+void
+thread_free(struct thread *thread)
+{
+#if OPT_THREADCACHE
+	bool kept = false;
+	int spl;
+
+	if (thread->t_stack != NULL && CURCPU_EXISTS()) {
+		/* Don't hand on a stack that overflowed */
+		thread_checkstack(thread);
+
+		spl = splhigh();
+		if (curcpu->c_threadcache.tl_count < THREADCACHE_SIZE) {
+			/* Last in, first out: the stack may still be cached */
+			threadlist_addhead(&curcpu->c_threadcache, thread);
+			kept = true;
+		}
+		else {
+			curcpu->c_tc_drops++;
+		}
+		splx(spl);
+		if (kept) {
+			return;
+		}
+	}
+#endif
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+#if OPT_SLAB
+	/* Left as thread_ctor made it, for the next thread */
+	KASSERT(thread->t_listnode.tln_next == NULL);
+	KASSERT(thread->t_listnode.tln_prev == NULL);
+	KASSERT(thread->t_machdep.tm_badfaultfunc == NULL);
+	slab_free(&thread_cache, thread);
+#else
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+	kfree(thread);
+#endif
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -120,27 +620,40 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = thread_alloc();
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		thread_free(thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
+#if !OPT_SLAB
+	/* Otherwise done once by thread_ctor */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+#endif
+	/* t_stack was set by thread_alloc */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+#if OPT_MLFQ
+	/* New threads start at the top with a full quantum */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_readysince = 0;
+#endif
+#if OPT_AFFINITY
+	thread->t_affinity = THREAD_ALLCPUS;
+	thread->t_migrations = 0;
+#endif
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -179,9 +692,12 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+#if OPT_AFFINITY
+	c->c_migrating = NULL;
+#endif
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	runqueue_init(c);
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -193,6 +709,27 @@ cpu_create(unsigned hardware_number)
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
 
+#if OPT_PFCACHE
+	pfcache_init(&c->c_pfcache, c->c_number);
+#endif
+#if OPT_KMCACHE
+	kmcache_init(&c->c_kmcache, c->c_number);
+#endif
+#if OPT_THREADCACHE
+	threadlist_init(&c->c_threadcache);
+	c->c_tc_hits = 0;
+	c->c_tc_misses = 0;
+	c->c_tc_drops = 0;
+#endif
+#if OPT_WORKQUEUE
+	workqueue_init(&c->c_workqueue, c->c_number);
+#endif
+#if OPT_ASID
+	/* Generation 0 is never used: the first activation flushes */
+	c->c_asid = 0;
+	c->c_asidgen = 0;
+#endif
+
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
 	if (c->c_curthread == NULL) {
@@ -210,7 +747,9 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		if (c->c_curthread->t_stack == NULL) {
+			c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		}
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -274,17 +813,15 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	thread->t_name = NULL;
+
+	/* The stack goes with it */
+	thread_free(thread);
 }
 
 /*
@@ -306,6 +843,30 @@ exorcise(void)
 	}
 }
 
+#if OPT_THREADCACHE
+/*
+ * Print how often each cpu recycled dead threads and their stacks.
+ * The counters are read without stopping the cpus.
+ */
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus, created;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		created = c->c_tc_hits + c->c_tc_misses;
+		kprintf("cpu%u: %u threads created, %u recycled (%u%%), "
+			"%u cached, %u freed with the cache full\n",
+			c->c_number, created, c->c_tc_hits,
+			created == 0 ? 0 : c->c_tc_hits * 100 / created,
+			c->c_threadcache.tl_count, c->c_tc_drops);
+	}
+}
+#endif
+
 /*
  * On panic, stop the thread system (as much as is reasonably
  * possible) to make sure we don't end up letting any other threads
@@ -328,9 +889,7 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	runqueue_drop(curcpu);
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -462,11 +1021,26 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+#if OPT_AFFINITY
+		/*
+		 * If its mask doesn't allow this cpu, wake it up on one
+		 * that it does, unless it's still on this cpu's stack.
+		 * Then it moves when it next yields.
+		 */
+		if (!THREAD_CANRUN(target, targetcpu) &&
+		    target != targetcpu->c_curthread) {
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			targetcpu = thread_pickcpu(target);
+			target->t_cpu = targetcpu;
+			target->t_migrations++;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+		}
+#endif
 	}
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -475,12 +1049,44 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+#if OPT_STEAL
+	else if (!targetcpu->c_isidle && runqueue_count(targetcpu) > 1) {
+		thread_kick_idle(targetcpu);
+	}
+#endif
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
+#if OPT_AFFINITY
+/*
+ * Called after a context switch, with interrupts off: if the thread
+ * switched from wasn't allowed on this cpu any more, make it runnable
+ * on one of its own. Until the switch it was still running here, so it
+ * couldn't be put on another run queue.
+ */
+static
+void
+thread_migrate_pending(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_migrating;
+	if (t == NULL) {
+		return;
+	}
+	curcpu->c_migrating = NULL;
+
+	t->t_cpu = thread_pickcpu(t);
+	t->t_migrations++;
+	DEBUG(DB_THREADS, "Moved thread %s: cpu %u -> %u",
+	      t->t_name, curcpu->c_number, t->t_cpu->c_number);
+	thread_make_runnable(t, false);
+}
+#endif
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -505,12 +1111,15 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless it came with a recycled thread */
+	if (newthread->t_stack == NULL) {
+		newthread->t_stack = kmalloc(STACK_SIZE);
+	}
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
 	}
+	/* Fresh canaries, a recycled stack has the old ones */
 	thread_checkstack_init(newthread);
 
 	/*
@@ -519,6 +1128,12 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+#if OPT_AFFINITY
+	newthread->t_affinity = curthread->t_affinity;
+	if (!THREAD_CANRUN(newthread, newthread->t_cpu)) {
+		newthread->t_cpu = thread_pickcpu(newthread);
+	}
+#endif
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -588,7 +1203,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -599,10 +1214,37 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
+#if OPT_AFFINITY
+		if (!THREAD_CANRUN(cur, curcpu)) {
+			/*
+			 * Not allowed here any more. Another cpu can't
+			 * have it while we're on its stack: the next
+			 * thread moves it, after the switch.
+			 */
+			KASSERT(curcpu->c_migrating == NULL);
+			curcpu->c_migrating = cur;
+			break;
+		}
+#endif
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+#if OPT_MLFQ
+		/*
+		 * A thread that blocks before using half its quantum
+		 * is interactive: it wakes up one level higher, with
+		 * a fresh quantum. Otherwise it keeps what it used,
+		 * so that sleeping just before the end of the quantum
+		 * doesn't dodge the demotion.
+		 */
+		if (cur->t_ticks * 2 < MLFQ_QUANTUM(cur->t_priority)) {
+			if (cur->t_priority > 0) {
+				cur->t_priority--;
+			}
+			cur->t_ticks = 0;
+		}
+#endif
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -641,10 +1283,37 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_STEAL
+			/* Take work from a busy sibling rather than idling */
+			if (thread_steal_idle() > 0) {
+				spinlock_acquire(&curcpu->c_runqueue_lock);
+				continue;
+			}
+#endif
+#if OPT_AFFINITY
+			if (curcpu->c_migrating != NULL) {
+				/* Nothing else to run: keep it for now */
+				spinlock_acquire(&curcpu->c_runqueue_lock);
+				next = curcpu->c_migrating;
+				curcpu->c_migrating = NULL;
+				continue;
+			}
+#endif
+#if OPT_ZEROPOOL
+			/* Zero a free frame for vm_fault instead of idling */
+			if (coremap_zerofill()) {
+				/* Take pending interrupts before the next one */
+				spl0();
+				splhigh();
+			} else {
+				cpu_idle();
+			}
+#else
 			cpu_idle();
+#endif
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -717,6 +1386,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+#if OPT_AFFINITY
+	/* Send away the thread we came from, if it had to leave. */
+	thread_migrate_pending();
+#endif
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -750,6 +1424,11 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+#if OPT_AFFINITY
+	/* Send away the thread we came from, if it had to leave. */
+	thread_migrate_pending();
+#endif
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -797,6 +1476,11 @@ thread_exit(void)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+#if OPT_AFFINITY
+	DEBUG(DB_THREADS, "Thread %s exits after %u migrations",
+	      cur->t_name, cur->t_migrations);
+#endif
+
 	/* Interrupts off on this processor */
         splhigh();
 	thread_switch(S_ZOMBIE, NULL, NULL);
@@ -812,6 +1496,60 @@ thread_yield(void)
 	thread_switch(S_READY, NULL, NULL);
 }
 
+#if OPT_AFFINITY
+/*
+ * Does nothing. Forked by thread_setaffinity to give the cpu another
+ * thread to switch to, so that the current one can leave.
+ */
+static
+void
+thread_migrate_stub(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+}
+
+/*
+ * Restrict the current thread to the cpus in MASK.
+ */
+int
+thread_setaffinity(uint32_t mask)
+{
+	struct cpu *c;
+	uint32_t existing;
+	unsigned i, numcpus;
+	int result;
+
+	existing = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		existing |= 1U << c->c_number;
+	}
+	if ((mask & existing) == 0) {
+		return EINVAL;
+	}
+
+	while (((mask >> curcpu->c_number) & 1) == 0) {
+		/*
+		 * The stub is forked without restrictions so that it
+		 * stays here; yielding to it moves us. If it gets
+		 * stolen first, we stay and try again.
+		 */
+		curthread->t_affinity = THREAD_ALLCPUS;
+		result = thread_fork("migrate", kproc,
+				     thread_migrate_stub, NULL, 0);
+		curthread->t_affinity = mask;
+		if (result) {
+			return result;
+		}
+		thread_yield();
+	}
+	curthread->t_affinity = mask;
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -819,16 +1557,88 @@ thread_yield(void)
  *
  * This is called periodically from hardclock(). It should reshuffle
  * the current CPU's run queue by job priority.
+ *
+ * With the multilevel feedback queue, threads start at the top level
+ * and go down one level each time they use up their quantum, which
+ * doubles at every level: CPU hogs sink and run in longer slices,
+ * while threads that block early (see thread_switch) float back up
+ * and preempt them. Aging here keeps the low levels from starving:
+ * a thread that waited MLFQ_AGE_HARDCLOCKS on its level moves up one.
  */
 
 void
 schedule(void)
 {
+#if OPT_MLFQ
+	struct threadlist *tl;
+	struct thread *t;
+	unsigned i, now;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	now = curcpu->c_hardclocks;
+	for (i=1; i<MLFQ_NLEVELS; i++) {
+		/* Each list is in queueing order, the oldest first */
+		tl = &curcpu->c_runqueue[i];
+		while (!threadlist_isempty(tl)) {
+			t = tl->tl_head.tln_next->tln_self;
+			if (now - t->t_readysince < MLFQ_AGE_HARDCLOCKS) {
+				break;
+			}
+			threadlist_remhead(tl);
+			t->t_priority = i - 1;
+			t->t_ticks = 0;
+			t->t_readysince = now;
+			threadlist_addtail(&curcpu->c_runqueue[i - 1], t);
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+#else
 	/*
 	 * You can write this. If we do nothing, threads will run in
 	 * round-robin fashion.
 	 */
+#endif
+}
+
+#if OPT_MLFQ
+/*
+ * Charge the current hardclock to the current thread, demoting it if
+ * that uses up its quantum. It should then yield, and also if a thread
+ * of a higher level is ready; otherwise it keeps running.
+ */
+bool
+thread_tick(void)
+{
+	struct thread *cur;
+	bool yield;
+	unsigned i;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* Nothing to charge; a wakeup unidles us anyway */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return false;
+	}
+
+	yield = false;
+	cur->t_ticks++;
+	if (cur->t_ticks >= MLFQ_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < MLFQ_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		yield = true;
+	}
+	for (i=0; i<cur->t_priority && !yield; i++) {
+		yield = !threadlist_isempty(&curcpu->c_runqueue[i]);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return yield;
 }
+#endif
 
 /*
  * Thread migration.
@@ -846,7 +1656,27 @@ schedule(void)
  * For here and now, because we know we're running on System/161 and
  * System/161 does not (yet) model such cache effects, we'll be very
  * aggressive.
+ *
+ * With work stealing the current CPU pulls instead: if its busiest
+ * sibling has at least two more threads waiting, it takes half the
+ * difference from the tail of that one's run queue. Idle CPUs steal
+ * on their own in thread_switch, so this only evens out busy ones.
  */
+#if OPT_STEAL
+void
+thread_consider_migration(void)
+{
+	struct cpu *victim;
+	unsigned mine, theirs;
+
+	victim = runqueue_busiest(&theirs);
+	mine = runqueue_count(curcpu->c_self);
+	if (victim == NULL || theirs < mine + 2) {
+		return;
+	}
+	thread_steal(victim, (theirs - mine) / 2);
+}
+#else
 void
 thread_consider_migration(void)
 {
@@ -861,9 +1691,9 @@ thread_consider_migration(void)
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += runqueue_count(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = runqueue_count(c);
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -877,7 +1707,7 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remtail(curcpu);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -888,7 +1718,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (runqueue_count(c) < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -912,14 +1742,17 @@ thread_consider_migration(void)
 			 * skip it. Then it goes back on our own run
 			 * queue below.
 			 */
-			if (t == curthread) {
+			if (t == curthread || !THREAD_CANRUN(t, c)) {
 				threadlist_addtail(&victims, t);
 				to_send--;
 				continue;
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+#if OPT_AFFINITY
+			t->t_migrations++;
+#endif
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -943,7 +1776,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -951,6 +1784,7 @@ thread_consider_migration(void)
 	KASSERT(threadlist_isempty(&victims));
 	threadlist_cleanup(&victims);
 }
+#endif /* OPT_STEAL */
 
 ////////////////////////////////////////////////////////////
 
@@ -971,16 +1805,33 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
+#if OPT_SLAB
+	wc = slab_alloc(&wchan_cache);
+	if (wc == NULL) {
+		return NULL;
+	}
+#else
 	wc = kmalloc(sizeof(*wc));
 	if (wc == NULL) {
 		return NULL;
 	}
 	threadlist_init(&wc->wc_threads);
+#endif
 	wc->wc_name = name;
 
 	return wc;
 }
 
+/*
+ * Change the name of a wait channel, for objects that keep their
+ * channel while their own name changes. Must be unlocked.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  * (The corresponding cleanup functions require this.)
@@ -988,8 +1839,13 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
+#if OPT_SLAB
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	slab_free(&wchan_cache, wc);
+#else
 	threadlist_cleanup(&wc->wc_threads);
 	kfree(wc);
+#endif
 }
 
 /*
@@ -1139,30 +1995,69 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	/*
+	 * Every requester waits for its shootdowns to complete, so the
+	 * queue fills up only when many threads unmap pages at once.
+	 * Wait for the target to drain it: the lock is dropped meanwhile,
+	 * so this CPU can take the shootdowns sent to it too.
+	 */
+	while (target->c_numshootdown == TLBSHOOTDOWN_MAX) {
+		spinlock_release(&target->c_ipi_lock);
+		spinlock_acquire(&target->c_ipi_lock);
 	}
 
+	n = target->c_numshootdown;
+	target->c_shootdown[n] = *mapping;
+	target->c_numshootdown = n+1;
+
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to all CPUs except the current one. Returns
+ * the number of CPUs signalled.
+ */
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Send a TLB shootdown IPI to the CPUs whose number is set in CPUS, the
+ * current one included. Returns the number of CPUs signalled.
+ */
+unsigned
+ipi_tlbshootdown_mask(uint32_t cpus, const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (cpus & ((uint32_t)1 << c->c_number)) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -1212,4 +2107,11 @@ interprocessor_interrupt(void)
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+#if OPT_PFCACHE
+	if (bits & (1U << IPI_PFFLUSH)) {
+		/* Not under the ipi lock: it takes the coremap lock */
+		pfcache_flush();
+	}
+#endif
 }
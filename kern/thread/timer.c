@@ -0,0 +1,233 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <current.h>
+#include <thread.h>
+#include <timer.h>
+
+#define TIMER_SLOT(tick)  ((unsigned)(tick) & (TIMER_NSLOTS - 1))
+
+/*
+ * The wheel. timer_now is the last tick done.
+ */
+static struct spinlock timer_lock = SPINLOCK_INITIALIZER;
+static struct timer *timer_wheel[TIMER_NSLOTS];
+static uint64_t timer_now = 0;
+
+static unsigned timer_npending = 0;       /* Timers on the wheel      */
+static unsigned timer_peak = 0;           /* Highest timer_npending   */
+static unsigned timer_nstarted = 0;       /* timer_start calls        */
+static unsigned timer_nfired = 0;         /* Callbacks called         */
+static unsigned timer_ncanceled = 0;      /* Timers stopped in time   */
+
+/*
+ * A thread in timer_sleep.
+ */
+struct timer_sleeper {
+  struct wchan*     ts_wchan;
+  struct spinlock   ts_lock;
+  bool              ts_done;
+};
+
+/*
+ * Take a timer off its slot. The lock must be held.
+ */
+static
+void
+timer_unlink(struct timer *tm)
+{
+  KASSERT(tm->tm_pending);
+
+  if (tm->tm_prev != NULL) {
+    tm->tm_prev->tm_next = tm->tm_next;
+  } else {
+    timer_wheel[TIMER_SLOT(tm->tm_expire)] = tm->tm_next;
+  }
+  if (tm->tm_next != NULL) {
+    tm->tm_next->tm_prev = tm->tm_prev;
+  }
+  tm->tm_next = tm->tm_prev = NULL;
+  tm->tm_pending = false;
+  timer_npending--;
+}
+
+/**
+ * Set up a timer
+ * @param tm      Timer
+ * @param func    Called with ARG when the timer fires
+ * @param arg     Argument of FUNC
+ */
+void
+timer_init(struct timer *tm, void (*func)(void *), void *arg)
+{
+  tm->tm_next = tm->tm_prev = NULL;
+  tm->tm_expire = 0;
+  tm->tm_func = func;
+  tm->tm_arg = arg;
+  tm->tm_pending = false;
+}
+
+/**
+ * Start a timer
+ * @param tm      Timer, not pending
+ * @param ticks   Hardclock ticks before it fires, 0 is taken as 1
+ */
+void
+timer_start(struct timer *tm, unsigned ticks)
+{
+  struct timer *prev, *next;
+  unsigned slot;
+
+  if (ticks == 0) {
+    ticks = 1;
+  }
+
+  spinlock_acquire(&timer_lock);
+  KASSERT(!tm->tm_pending);
+
+  tm->tm_expire = timer_now + ticks;
+  slot = TIMER_SLOT(tm->tm_expire);
+
+  /* Sorted, so that a tick stops at the first timer of a later turn */
+  for (prev = NULL, next = timer_wheel[slot];
+       next != NULL && next->tm_expire <= tm->tm_expire;
+       prev = next, next = next->tm_next);
+  tm->tm_prev = prev;
+  tm->tm_next = next;
+  if (prev != NULL) {
+    prev->tm_next = tm;
+  } else {
+    timer_wheel[slot] = tm;
+  }
+  if (next != NULL) {
+    next->tm_prev = tm;
+  }
+  tm->tm_pending = true;
+
+  timer_nstarted++;
+  if (++timer_npending > timer_peak) {
+    timer_peak = timer_npending;
+  }
+  spinlock_release(&timer_lock);
+}
+
+/**
+ * Stop a timer
+ * @param tm      Timer
+ * @return        true if it was pending, false if it fired already. Its
+ *                callback may then still be running on another cpu
+ */
+bool
+timer_cancel(struct timer *tm)
+{
+  bool pending;
+
+  spinlock_acquire(&timer_lock);
+  pending = tm->tm_pending;
+  if (pending) {
+    timer_unlink(tm);
+    timer_ncanceled++;
+  }
+  spinlock_release(&timer_lock);
+
+  return pending;
+}
+
+/**
+ * Advance the wheel by one tick, firing the timers that expire. The
+ * lock is dropped around each callback, so that it may start timers.
+ */
+void
+timer_tick(void)
+{
+  struct timer *tm;
+  void (*func)(void *);
+  void *arg;
+  uint64_t now;
+  unsigned slot;
+
+  spinlock_acquire(&timer_lock);
+  now = ++timer_now;
+  slot = TIMER_SLOT(now);
+  while ((tm = timer_wheel[slot]) != NULL && tm->tm_expire <= now) {
+    timer_unlink(tm);
+    timer_nfired++;
+    /* Once unlocked, TM belongs to its owner again */
+    func = tm->tm_func;
+    arg = tm->tm_arg;
+    spinlock_release(&timer_lock);
+
+    func(arg);
+
+    spinlock_acquire(&timer_lock);
+  }
+  spinlock_release(&timer_lock);
+}
+
+/*
+ * Callback of the timers of timer_sleep.
+ */
+static
+void
+timer_wakeup(void *arg)
+{
+  struct timer_sleeper *ts = arg;
+
+  spinlock_acquire(&ts->ts_lock);
+  ts->ts_done = true;
+  wchan_wakeone(ts->ts_wchan, &ts->ts_lock);
+  spinlock_release(&ts->ts_lock);
+}
+
+/**
+ * Sleep for at least a number of ticks. Only this thread is woken up when
+ * the time is over. The current tick is already partly over, so it's not
+ * counted: the timer fires one tick later.
+ * @param ticks   Hardclock ticks, 0 is taken as 1
+ * @return        0 on success, ENOMEM if out of memory
+ */
+int
+timer_sleep(unsigned ticks)
+{
+  struct timer_sleeper ts;
+  struct timer tm;
+
+  KASSERT(!curthread->t_in_interrupt);
+
+  ts.ts_wchan = wchan_create("timer");
+  if (ts.ts_wchan == NULL) {
+    return ENOMEM;
+  }
+  spinlock_init(&ts.ts_lock);
+  ts.ts_done = false;
+
+  timer_init(&tm, timer_wakeup, &ts);
+  timer_start(&tm, ticks + 1 != 0 ? ticks + 1 : ticks);
+
+  spinlock_acquire(&ts.ts_lock);
+  while (!ts.ts_done) {
+    wchan_sleep(ts.ts_wchan, &ts.ts_lock);
+  }
+  /* timer_wakeup is done with TS once it released the lock */
+  spinlock_release(&ts.ts_lock);
+
+  spinlock_cleanup(&ts.ts_lock);
+  wchan_destroy(ts.ts_wchan);
+  return 0;
+}
+
+/**
+ * Print the counters of the wheel
+ */
+void
+timer_printstats(void)
+{
+  spinlock_acquire(&timer_lock);
+  kprintf("Timers: %u pending (peak %u), %u started, %u fired, "
+          "%u canceled, tick %llu\n",
+          timer_npending, timer_peak, timer_nstarted, timer_nfired,
+          timer_ncanceled, (unsigned long long)timer_now);
+  spinlock_release(&timer_lock);
+}
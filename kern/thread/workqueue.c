@@ -0,0 +1,321 @@
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <current.h>
+#include <thread.h>
+#include <timer.h>
+#include <workqueue.h>
+#include <opt-timer.h>
+#include <opt-affinity.h>
+
+#if !OPT_TIMER
+#error "Delayed work items need the timer wheel (options timer)"
+#endif
+
+/*
+ * One lock covers every queue and every item, so that an item can't be
+ * made pending twice from two CPUs. It also protects the list of the
+ * queues.
+ */
+static struct spinlock workqueue_lock = SPINLOCK_INITIALIZER;
+static struct workqueue *workqueue_list = NULL;
+
+/*
+ * Append a pending item to its queue and wake up the worker. The lock
+ * must be held.
+ */
+static
+void
+workqueue_append(struct work *wk)
+{
+  struct workqueue *wq = wk->wk_wq;
+
+  wk->wk_next = NULL;
+  if (wq->wq_tail != NULL) {
+    wq->wq_tail->wk_next = wk;
+  } else {
+    wq->wq_head = wk;
+  }
+  wq->wq_tail = wk;
+
+  wq->wq_queued++;
+  if (++wq->wq_count > wq->wq_peak) {
+    wq->wq_peak = wq->wq_count;
+  }
+
+  if (wq->wq_wchan != NULL) {
+    wchan_wakeone(wq->wq_wchan, &workqueue_lock);
+  }
+}
+
+/*
+ * Take a queued item off its queue. The lock must be held.
+ */
+static
+void
+workqueue_unlink(struct work *wk)
+{
+  struct workqueue *wq = wk->wk_wq;
+  struct work **p, *prev;
+
+  for (p = &wq->wq_head, prev = NULL; *p != wk; p = &(*p)->wk_next) {
+    KASSERT(*p != NULL);
+    prev = *p;
+  }
+  *p = wk->wk_next;
+  if (wq->wq_tail == wk) {
+    wq->wq_tail = prev;
+  }
+  wk->wk_next = NULL;
+  wq->wq_count--;
+}
+
+/*
+ * Queue of the current CPU.
+ */
+static
+struct workqueue *
+workqueue_current(void)
+{
+  KASSERT(CURCPU_EXISTS());
+  return &curcpu->c_workqueue;
+}
+
+/*
+ * Callback of the timers of delayed items, in the timer interrupt.
+ */
+static
+void
+work_timeout(void *arg)
+{
+  struct work *wk = arg;
+
+  spinlock_acquire(&workqueue_lock);
+  KASSERT(wk->wk_pending && wk->wk_delayed);
+  wk->wk_delayed = false;
+  workqueue_append(wk);
+  spinlock_release(&workqueue_lock);
+}
+
+/*
+ * Worker of a CPU: run the items of its queue, forever.
+ */
+static
+void
+workqueue_worker(void *p, unsigned long cpunum)
+{
+  struct workqueue *wq = p;
+  struct work *wk;
+  void (*func)(void *);
+  void *arg;
+
+#if OPT_AFFINITY
+  /* If it fails the worker runs anywhere, which is slower but right */
+  (void)thread_setaffinity(1U << cpunum);
+#else
+  (void)cpunum;
+#endif
+
+  spinlock_acquire(&workqueue_lock);
+  while (true) {
+    wk = wq->wq_head;
+    if (wk == NULL) {
+      wchan_sleep(wq->wq_wchan, &workqueue_lock);
+      continue;
+    }
+    wq->wq_head = wk->wk_next;
+    if (wq->wq_head == NULL) {
+      wq->wq_tail = NULL;
+    }
+    wk->wk_next = NULL;
+    wk->wk_pending = false;
+    wq->wq_count--;
+    /* Once unlocked, WK may be queued again or freed */
+    func = wk->wk_func;
+    arg = wk->wk_arg;
+    spinlock_release(&workqueue_lock);
+
+    func(arg);
+
+    spinlock_acquire(&workqueue_lock);
+    wq->wq_run++;
+  }
+}
+
+/**
+ * Initialize an empty queue, without its worker
+ * @param wq      Queue, in the struct cpu of its owner
+ * @param cpunum  Number of the owner CPU
+ */
+void
+workqueue_init(struct workqueue *wq, unsigned cpunum)
+{
+  wq->wq_head = wq->wq_tail = NULL;
+  wq->wq_wchan = NULL;
+  wq->wq_count = 0;
+  wq->wq_peak = 0;
+  wq->wq_queued = 0;
+  wq->wq_coalesced = 0;
+  wq->wq_run = 0;
+  wq->wq_cpu = cpunum;
+
+  spinlock_acquire(&workqueue_lock);
+  wq->wq_next = workqueue_list;
+  workqueue_list = wq;
+  spinlock_release(&workqueue_lock);
+}
+
+/**
+ * Start the worker of every CPU. Called once all of them run.
+ */
+void
+workqueue_bootstrap(void)
+{
+  struct workqueue *wq;
+  struct wchan *wc;
+  char name[16];
+  int result;
+
+  spinlock_acquire(&workqueue_lock);
+  wq = workqueue_list;
+  spinlock_release(&workqueue_lock);
+
+  /* The list only grows at the head, no need to hold the lock */
+  for (; wq != NULL; wq = wq->wq_next) {
+    snprintf(name, sizeof(name), "worker%u", wq->wq_cpu);
+    wc = wchan_create(name);
+    if (wc == NULL) {
+      panic("workqueue_bootstrap: Out of memory\n");
+    }
+
+    spinlock_acquire(&workqueue_lock);
+    wq->wq_wchan = wc;
+    spinlock_release(&workqueue_lock);
+
+    result = thread_fork(name, NULL, workqueue_worker, wq, wq->wq_cpu);
+    if (result) {
+      panic("workqueue_bootstrap: thread_fork: %s\n", strerror(result));
+    }
+  }
+}
+
+/**
+ * Set up a work item
+ * @param wk      Item, not pending
+ * @param func    Function to run
+ * @param arg     Argument of the function
+ */
+void
+work_init(struct work *wk, void (*func)(void *), void *arg)
+{
+  wk->wk_next = NULL;
+  wk->wk_func = func;
+  wk->wk_arg = arg;
+  wk->wk_wq = NULL;
+  wk->wk_pending = false;
+  wk->wk_delayed = false;
+  timer_init(&wk->wk_timer, work_timeout, wk);
+}
+
+/**
+ * Queue an item on the current CPU
+ * @param wk      Item
+ * @return        true if queued, false if it was pending already
+ */
+bool
+work_queue(struct work *wk)
+{
+  struct workqueue *wq = workqueue_current();
+
+  spinlock_acquire(&workqueue_lock);
+  if (wk->wk_pending) {
+    wk->wk_wq->wq_coalesced++;
+    spinlock_release(&workqueue_lock);
+    return false;
+  }
+  wk->wk_pending = true;
+  wk->wk_wq = wq;
+  workqueue_append(wk);
+  spinlock_release(&workqueue_lock);
+
+  return true;
+}
+
+/**
+ * Queue an item on the current CPU after a delay
+ * @param wk      Item
+ * @param ticks   Hardclock ticks to wait, 0 is taken as 1
+ * @return        true if started, false if it was pending already
+ */
+bool
+work_queue_delayed(struct work *wk, unsigned ticks)
+{
+  struct workqueue *wq = workqueue_current();
+
+  spinlock_acquire(&workqueue_lock);
+  if (wk->wk_pending) {
+    wk->wk_wq->wq_coalesced++;
+    spinlock_release(&workqueue_lock);
+    return false;
+  }
+  wk->wk_pending = true;
+  wk->wk_delayed = true;
+  wk->wk_wq = wq;
+  /* Not pending, so the timer is ours (and static items have none yet) */
+  timer_init(&wk->wk_timer, work_timeout, wk);
+  timer_start(&wk->wk_timer, ticks);
+  spinlock_release(&workqueue_lock);
+
+  return true;
+}
+
+/**
+ * Stop an item before it runs
+ * @param wk      Item
+ * @return        true if it was pending and won't run, false if it was
+ *                not pending or is being queued by its timer
+ */
+bool
+work_cancel(struct work *wk)
+{
+  spinlock_acquire(&workqueue_lock);
+  if (!wk->wk_pending) {
+    spinlock_release(&workqueue_lock);
+    return false;
+  }
+  if (wk->wk_delayed) {
+    /* A timer that fired is waiting for the lock in work_timeout */
+    if (!timer_cancel(&wk->wk_timer)) {
+      spinlock_release(&workqueue_lock);
+      return false;
+    }
+    wk->wk_delayed = false;
+  } else {
+    workqueue_unlink(wk);
+  }
+  wk->wk_pending = false;
+  spinlock_release(&workqueue_lock);
+
+  return true;
+}
+
+/**
+ * Print the counters of each CPU
+ */
+void
+workqueue_printstats(void)
+{
+  struct workqueue *wq;
+
+  spinlock_acquire(&workqueue_lock);
+  for (wq = workqueue_list; wq != NULL; wq = wq->wq_next) {
+    kprintf("cpu%u: %u items queued, %u coalesced, %u run, "
+            "%u waiting (peak %u)%s\n",
+            wq->wq_cpu, wq->wq_queued, wq->wq_coalesced, wq->wq_run,
+            wq->wq_count, wq->wq_peak,
+            wq->wq_wchan == NULL ? ", no worker yet" : "");
+  }
+  spinlock_release(&workqueue_lock);
+}
@@ -237,15 +237,16 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. The VM system maps files only, through VOP_READ and
+ * VOP_WRITE; character devices can't be read a page at a time at
+ * arbitrary offsets, so no device can be mapped for now.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
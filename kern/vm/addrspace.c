@@ -27,93 +27,345 @@
  * SUCH DAMAGE.
  */
 
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
+#include <clock.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <pt.h>
+#if OPT_DEMANDLOAD
+#include <vnode.h>
+#endif
 
 /*
- * Note! If OPT_DUMBVM is set, as is the case until you start the VM
- * assignment, this file is not compiled or linked or in any way
- * used. The cheesy hack versions in dumbvm.c are used instead.
+ * Note! This file is only compiled with OPT_PAGING. With OPT_DUMBVM the
+ * cheesy hack versions in dumbvm.c are used instead.
+ *
+ * The address space is a list of regions plus a two-level page table. No
+ * frame is allocated here: pages are brought in by vm_fault the first
+ * time they're touched.
+ */
+
+#if OPT_SWAP
+static struct lock *as_listlock;
+static struct addrspace *as_list = NULL;
+
+/**
+ * Create the lock of the list of address spaces
  */
+void
+as_bootstrap(void)
+{
+  as_listlock = lock_create("as_list");
+  if (as_listlock == NULL) {
+    panic("as_bootstrap: Out of memory\n");
+  }
+}
+
+/**
+ * Call a function on every address space
+ * @param func    Function, called with the list locked
+ * @param arg     Second argument of FUNC
+ */
+void
+as_foreach(void (*func)(struct addrspace *as, void *arg), void *arg)
+{
+  struct addrspace *as;
+
+  lock_acquire(as_listlock);
+  for (as = as_list; as != NULL; as = as->as_next) {
+    func(as, arg);
+  }
+  lock_release(as_listlock);
+}
+#endif /* OPT_SWAP */
 
 struct addrspace *
 as_create(void)
 {
-	struct addrspace *as;
+  struct addrspace *as;
+
+  as = kmalloc(sizeof(struct addrspace));
+  if (as == NULL) {
+    return NULL;
+  }
+
+  as->as_regions = NULL;
+  as->as_loading = false;
+  as->as_cpus = 0;
+  as->as_faults = 0;
+  as->as_pageins = 0;
+  gettime(&as->as_start);
+#if OPT_SYS_VM
+  as->as_heap = NULL;
+  as->as_heapend = 0;
+#endif
+#if OPT_ASID
+  as->as_asid = 0;
+#endif
+
+  as->as_pt = pt_create();
+  if (as->as_pt == NULL) {
+    kfree(as);
+    return NULL;
+  }
+
+  as->as_lock = lock_create("as_lock");
+  if (as->as_lock == NULL) {
+    pt_destroy(as->as_pt);
+    kfree(as);
+    return NULL;
+  }
+
+#if OPT_SWAP
+  lock_acquire(as_listlock);
+  as->as_next = as_list;
+  as_list = as;
+  lock_release(as_listlock);
+#endif
+
+  return as;
+}
+
+/*
+ * Append a region to the address space. Returns NULL if out of memory.
+ */
+static
+struct vm_region *
+as_add_region(struct addrspace *as, vaddr_t base, size_t npages, int perm)
+{
+  struct vm_region *r, **tail;
+
+  r = kmalloc(sizeof(struct vm_region));
+  if (r == NULL) {
+    return NULL;
+  }
 
-	as = kmalloc(sizeof(struct addrspace));
-	if (as == NULL) {
-		return NULL;
-	}
+  r->vr_base = base;
+  r->vr_npages = npages;
+  r->vr_perm = perm;
+#if OPT_SYS_VM
+  r->vr_mapped = false;
+#endif
+#if OPT_MMAPFILE
+  r->vr_shared = false;
+#endif
+#if OPT_DEMANDLOAD
+  r->vr_vnode = NULL;
+  r->vr_offset = 0;
+  r->vr_filebase = 0;
+  r->vr_filesize = 0;
+#endif
+  r->vr_next = NULL;
 
-	/*
-	 * Initialize as needed.
-	 */
+  for (tail = &as->as_regions; *tail != NULL; tail = &(*tail)->vr_next);
+  *tail = r;
 
-	return as;
+  return r;
 }
 
+#if OPT_DEMANDLOAD
+/*
+ * Make a region backed by the same file as another one.
+ */
+static
+void
+as_copy_backing(struct vm_region *dst, const struct vm_region *src)
+{
+  if (src->vr_vnode != NULL) {
+    VOP_INCREF(src->vr_vnode);
+  }
+  dst->vr_vnode = src->vr_vnode;
+  dst->vr_offset = src->vr_offset;
+  dst->vr_filebase = src->vr_filebase;
+  dst->vr_filesize = src->vr_filesize;
+}
+#endif
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
-	struct addrspace *newas;
+  struct addrspace *newas;
+  struct vm_region *r, *nr;
+  int result;
+
+  newas = as_create();
+  if (newas==NULL) {
+    return ENOMEM;
+  }
+
+  lock_acquire(old->as_lock);
 
-	newas = as_create();
-	if (newas==NULL) {
-		return ENOMEM;
-	}
+  for (r = old->as_regions; r != NULL; r = r->vr_next) {
+    nr = as_add_region(newas, r->vr_base, r->vr_npages, r->vr_perm);
+    if (nr == NULL) {
+      lock_release(old->as_lock);
+      as_destroy(newas);
+      return ENOMEM;
+    }
+#if OPT_MMAPFILE
+    nr->vr_shared = r->vr_shared;
+#endif
+#if OPT_SYS_VM
+    nr->vr_mapped = r->vr_mapped;
+    if (r == old->as_heap) {
+      newas->as_heap = nr;
+      newas->as_heapend = old->as_heapend;
+    }
+#endif
+#if OPT_DEMANDLOAD
+    as_copy_backing(nr, r);
+#endif
+  }
 
-	/*
-	 * Write this.
-	 */
+  result = pt_copy(old->as_pt, newas->as_pt);
 
-	(void)old;
+  /*
+   * The pages of OLD are now copy-on-write: drop the writeable
+   * translations still in the TLB, so the next write faults
+   */
+  vm_tlb_drop(old);
 
-	*ret = newas;
-	return 0;
+  lock_release(old->as_lock);
+
+  if (result) {
+    as_destroy(newas);
+    return result;
+  }
+
+  *ret = newas;
+  return 0;
 }
 
 void
 as_destroy(struct addrspace *as)
 {
-	/*
-	 * Clean up as needed.
-	 */
+  struct vm_region *r;
+#if OPT_SWAP
+  struct addrspace **link;
+
+  /* Nobody pages out through AS once it's off the list */
+  lock_acquire(as_listlock);
+  for (link = &as_list; *link != as; link = &(*link)->as_next) {
+    KASSERT(*link != NULL);
+  }
+  *link = as->as_next;
+  lock_release(as_listlock);
+#endif
+
+#if OPT_MMAPFILE
+  /* Implicit munmap of the shared file mappings */
+  lock_acquire(as->as_lock);
+  for (r = as->as_regions; r != NULL; r = r->vr_next) {
+    if (r->vr_shared) {
+      vm_msync(as, r, r->vr_base, r->vr_npages);
+    }
+  }
+  lock_release(as->as_lock);
+#endif
 
-	kfree(as);
+  while ((r = as->as_regions) != NULL) {
+    as->as_regions = r->vr_next;
+#if OPT_DEMANDLOAD
+    if (r->vr_vnode != NULL) {
+      VOP_DECREF(r->vr_vnode);
+    }
+#endif
+    kfree(r);
+  }
+
+  pt_destroy(as->as_pt);
+  lock_destroy(as->as_lock);
+
+  kfree(as);
 }
 
 void
 as_activate(void)
 {
-	struct addrspace *as;
+  struct addrspace *as;
 
-	as = proc_getas();
-	if (as == NULL) {
-		/*
-		 * Kernel thread without an address space; leave the
-		 * prior address space in place.
-		 */
-		return;
-	}
+  as = proc_getas();
+  if (as == NULL) {
+    /*
+     * Kernel thread without an address space; leave the
+     * prior address space in place.
+     */
+    return;
+  }
 
-	/*
-	 * Write this.
-	 */
+  vm_tlb_activate(as);
 }
 
 void
 as_deactivate(void)
 {
-	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
-	 */
+  /*
+   * Nothing to do: the TLB is flushed by the next as_activate
+   * anyway, and kernel threads never touch user addresses.
+   */
+}
+
+/**
+ * Find the region of an address space containing a given address
+ * @param as      Address space
+ * @param vaddr   Virtual address
+ * @return        The region, NULL if VADDR is not mapped
+ */
+struct vm_region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+  struct vm_region *r;
+
+  for (r = as->as_regions; r != NULL; r = r->vr_next) {
+    if (vaddr >= r->vr_base && vaddr < r->vr_base + r->vr_npages * PAGE_SIZE) {
+      return r;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Gather the working set statistics of an address space: the pages in
+ * memory and in the swap area, and the faults since it was created
+ * @param as      Address space
+ * @param st      Filled with the statistics
+ */
+void
+as_getstats(struct addrspace *as, struct as_stats *st)
+{
+  struct timespec now, elapsed;
+
+  lock_acquire(as->as_lock);
+  pt_count(as->as_pt, &st->st_resident, &st->st_swapped);
+  st->st_faults = as->as_faults;
+  st->st_pageins = as->as_pageins;
+  lock_release(as->as_lock);
+
+  gettime(&now);
+  timespec_sub(&now, &as->as_start, &elapsed);
+  st->st_ms = elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000;
+}
+
+/**
+ * Print statistics gathered by as_getstats on one line
+ * @param st      Statistics
+ */
+void
+as_printstats(const struct as_stats *st)
+{
+  kprintf("%6u KiB resident %6u KiB swapped %8u faults (%u page-ins) "
+          "%u faults/s\n",
+          st->st_resident * PAGE_SIZE / 1024,
+          st->st_swapped * PAGE_SIZE / 1024,
+          st->st_faults, st->st_pageins,
+          st->st_ms == 0 ? 0 :
+          (unsigned)((uint64_t)st->st_faults * 1000 / st->st_ms));
 }
 
 /*
@@ -122,61 +374,441 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Writes
+ * to a segment without WRITEABLE fail once the program is loaded.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
-		 int readable, int writeable, int executable)
+                 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+  size_t npages;
+  int perm;
+
+  /* Align the region. First, the base... */
+  memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+  vaddr &= PAGE_FRAME;
+
+  /* ...and now the length. */
+  memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+
+  npages = memsize / PAGE_SIZE;
+
+  if (vaddr + memsize > USERSTACK - VM_STACKPAGES * PAGE_SIZE) {
+    return EFAULT;
+  }
 
-	(void)as;
-	(void)vaddr;
-	(void)memsize;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	return ENOSYS;
+  perm = (readable ? VR_READ : 0) |
+         (writeable ? VR_WRITE : 0) |
+         (executable ? VR_EXEC : 0);
+
+  if (as_add_region(as, vaddr, npages, perm) == NULL) {
+    return ENOMEM;
+  }
+  return 0;
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
-	return 0;
+  /*
+   * Nothing to allocate. Just let the loader write read-only segments
+   * until as_complete_load
+   */
+  as->as_loading = true;
+  return 0;
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
+#if OPT_SYS_VM
+  struct vm_region *r;
+  vaddr_t top;
+
+  /* The heap starts empty, right after the highest segment */
+  for (top = 0, r = as->as_regions; r != NULL; r = r->vr_next) {
+    if (r->vr_base + r->vr_npages * PAGE_SIZE > top) {
+      top = r->vr_base + r->vr_npages * PAGE_SIZE;
+    }
+  }
+  as->as_heap = as_add_region(as, top, 0, VR_READ | VR_WRITE);
+  if (as->as_heap == NULL) {
+    return ENOMEM;
+  }
+  as->as_heapend = top;
+#endif
 
-	(void)as;
-	return 0;
+  as->as_loading = false;
+
+  /* Forget writeable translations of read-only pages set up by the loader */
+  vm_tlb_drop(as);
+  return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+  if (as_add_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+                    VM_STACKPAGES, VR_READ | VR_WRITE) == NULL) {
+    return ENOMEM;
+  }
 
-	(void)as;
+  /* Initial user-level stack pointer */
+  *stackptr = USERSTACK;
 
-	/* Initial user-level stack pointer */
-	*stackptr = USERSTACK;
+  return 0;
+}
 
-	return 0;
+#if OPT_DEMANDLOAD
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+               struct vnode *v, off_t offset)
+{
+  struct vm_region *r;
+
+  r = as_find_region(as, vaddr);
+  if (r == NULL || r->vr_vnode != NULL ||
+      vaddr + filesize > r->vr_base + r->vr_npages * PAGE_SIZE) {
+    return EINVAL;
+  }
+
+  if (filesize == 0) {
+    /* Nothing to read: plain zero-filled pages */
+    return 0;
+  }
+
+  VOP_INCREF(v);
+  r->vr_vnode = v;
+  r->vr_offset = offset;
+  r->vr_filebase = vaddr;
+  r->vr_filesize = filesize;
+
+  return 0;
 }
+#endif /* OPT_DEMANDLOAD */
 
+#if OPT_SYS_VM
+/*
+ * Check if the pages [BASE, BASE + NPAGES) overlap a region other than
+ * EXCEPT. The address space lock must be held.
+ */
+static
+bool
+as_overlaps(struct addrspace *as, vaddr_t base, size_t npages,
+            struct vm_region *except)
+{
+  struct vm_region *r;
+
+  for (r = as->as_regions; r != NULL; r = r->vr_next) {
+    if (r != except && base < r->vr_base + r->vr_npages * PAGE_SIZE &&
+        r->vr_base < base + npages * PAGE_SIZE) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Forget the pages [VADDR, VADDR + NPAGES) of the current address space,
+ * already removed from its regions. Called with the address space lock
+ * held, which is released.
+ */
+static
+void
+as_release_pages(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+  /* Out of every TLB before the frames can be reused by someone else */
+  if (vm_tlb_shootdown(as, vaddr, npages)) {
+    vm_tlb_drop(as);
+  }
+
+  /* Nobody can fault on these pages anymore */
+  lock_release(as->as_lock);
+
+  pt_unmap(as->as_pt, vaddr, npages);
+}
+
+/**
+ * Move the end of the heap
+ * @param as        Current address space
+ * @param amount    Bytes to add to the heap, negative to shrink it
+ * @param oldbreak  Where to store the previous end of the heap
+ * @return          0 on success, EINVAL if the heap would end below its
+ *                  start, ENOMEM if it can't grow that much
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+  struct vm_region *heap;
+  vaddr_t newbreak;
+  size_t npages, oldpages;
+
+  lock_acquire(as->as_lock);
+
+  heap = as->as_heap;
+  if (heap == NULL) {
+    lock_release(as->as_lock);
+    return EINVAL;
+  }
+
+  newbreak = as->as_heapend + amount;
+  if (amount < 0 && (newbreak < heap->vr_base || newbreak > as->as_heapend)) {
+    lock_release(as->as_lock);
+    return EINVAL;
+  }
+  if (amount > 0 && newbreak < as->as_heapend) {
+    lock_release(as->as_lock);
+    return ENOMEM;
+  }
+
+  oldpages = heap->vr_npages;
+  npages = DIVROUNDUP(newbreak - heap->vr_base, PAGE_SIZE);
+  if (npages > oldpages &&
+      (heap->vr_base + npages * PAGE_SIZE > USERSTACK ||
+       as_overlaps(as, heap->vr_base, npages, heap))) {
+    lock_release(as->as_lock);
+    return ENOMEM;
+  }
+
+  *oldbreak = as->as_heapend;
+  as->as_heapend = newbreak;
+  heap->vr_npages = npages;
+
+  if (npages < oldpages) {
+    as_release_pages(as, heap->vr_base + npages * PAGE_SIZE,
+                     oldpages - npages);
+  } else {
+    lock_release(as->as_lock);
+  }
+
+  return 0;
+}
+
+/*
+ * Define a region created by mmap, in the highest free range below the
+ * stack. The address space lock must be held. Returns NULL if there is
+ * no room.
+ */
+static
+struct vm_region *
+as_placemap(struct addrspace *as, size_t npages, int perm)
+{
+  struct vm_region *r;
+  vaddr_t top, bottom, base;
+
+  /* Leave the heap room to grow up to where it is now */
+  bottom = as->as_heap != NULL ?
+           as->as_heap->vr_base + as->as_heap->vr_npages * PAGE_SIZE : 0;
+  top = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+
+  /* Move down past any region overlapping the candidate range */
+  for (;;) {
+    if (top - bottom < npages * PAGE_SIZE || top < bottom) {
+      return NULL;
+    }
+    base = top - npages * PAGE_SIZE;
+    for (r = as->as_regions; r != NULL; r = r->vr_next) {
+      if (base < r->vr_base + r->vr_npages * PAGE_SIZE &&
+          r->vr_base < top) {
+        break;
+      }
+    }
+    if (r == NULL) break;
+    top = r->vr_base;
+  }
+
+  r = as_add_region(as, base, npages, perm);
+  if (r != NULL) {
+    r->vr_mapped = true;
+  }
+
+  return r;
+}
+
+/**
+ * Map anonymous zero-filled pages, in the highest free range below the
+ * stack
+ * @param as        Current address space
+ * @param npages    Number of pages
+ * @param perm      VR_READ | VR_WRITE | VR_EXEC
+ * @param vaddr     Where to store the address of the mapping
+ * @return          0 on success, ENOMEM if there is no room
+ */
+int
+as_mmap(struct addrspace *as, size_t npages, int perm, vaddr_t *vaddr)
+{
+  struct vm_region *r;
+
+  lock_acquire(as->as_lock);
+  r = as_placemap(as, npages, perm);
+  lock_release(as->as_lock);
+
+  if (r == NULL) {
+    return ENOMEM;
+  }
+
+  *vaddr = r->vr_base;
+  return 0;
+}
+
+#if OPT_MMAPFILE
+/**
+ * Map a file, in the highest free range below the stack. The pages are
+ * read from the file when first touched; the ones past the end of the
+ * file are zero-filled.
+ * @param as        Current address space
+ * @param npages    Number of pages
+ * @param perm      VR_READ | VR_WRITE | VR_EXEC
+ * @param shared    Writes go to the file and are seen by the other
+ *                  processes mapping it, instead of private copies
+ * @param v         File, that gets a reference
+ * @param offset    Offset of the first page in the file (page aligned)
+ * @param filesize  Bytes of the file in the mapping
+ * @param vaddr     Where to store the address of the mapping
+ * @return          0 on success, ENOMEM if there is no room
+ */
+int
+as_mmapfile(struct addrspace *as, size_t npages, int perm, bool shared,
+            struct vnode *v, off_t offset, size_t filesize, vaddr_t *vaddr)
+{
+  struct vm_region *r;
+
+  KASSERT(offset % PAGE_SIZE == 0);
+  KASSERT(filesize <= npages * PAGE_SIZE);
+
+  lock_acquire(as->as_lock);
+
+  r = as_placemap(as, npages, perm);
+  if (r == NULL) {
+    lock_release(as->as_lock);
+    return ENOMEM;
+  }
+
+  VOP_INCREF(v);
+  r->vr_vnode = v;
+  r->vr_offset = offset;
+  r->vr_filebase = r->vr_base;
+  r->vr_filesize = filesize;
+  r->vr_shared = shared;
+
+  lock_release(as->as_lock);
+
+  *vaddr = r->vr_base;
+  return 0;
+}
+
+/**
+ * Write back the pages of a shared file mapping written since the last
+ * msync
+ * @param as        Current address space
+ * @param vaddr     First page
+ * @param npages    Number of pages, in a single mapping
+ * @return          0 on success, ENOMEM if the range is not mapped,
+ *                  the error of the file system otherwise
+ */
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+  struct vm_region *r;
+  vaddr_t end;
+  int result;
+
+  end = vaddr + npages * PAGE_SIZE;
+
+  lock_acquire(as->as_lock);
+
+  r = as_find_region(as, vaddr);
+  if (r == NULL || end < vaddr ||
+      end > r->vr_base + r->vr_npages * PAGE_SIZE) {
+    lock_release(as->as_lock);
+    return ENOMEM;
+  }
+
+  result = vm_msync(as, r, vaddr, npages);
+
+  /* The next write to a clean page must mark it dirty again */
+  vm_tlb_drop(as);
+
+  lock_release(as->as_lock);
+
+  return result;
+}
+#endif /* OPT_MMAPFILE */
+
+/**
+ * Unmap a range of pages created by as_mmap. The range must lie in a
+ * single mapping; unmapping the middle of it splits the mapping in two.
+ * @param as        Current address space
+ * @param vaddr     First page
+ * @param npages    Number of pages
+ * @return          0 on success, EINVAL if the range is not mapped by
+ *                  mmap, ENOMEM if the split fails
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+  struct vm_region *r, *tail, **link;
+  vaddr_t end, rend;
+#if OPT_MMAPFILE
+  int result;
+#endif
+
+  end = vaddr + npages * PAGE_SIZE;
+
+  lock_acquire(as->as_lock);
+
+  r = as_find_region(as, vaddr);
+  if (r == NULL || !r->vr_mapped || end < vaddr ||
+      end > r->vr_base + r->vr_npages * PAGE_SIZE) {
+    lock_release(as->as_lock);
+    return EINVAL;
+  }
+  rend = r->vr_base + r->vr_npages * PAGE_SIZE;
+
+#if OPT_MMAPFILE
+  /* The written pages of a shared file mapping go back to the file */
+  result = vm_msync(as, r, vaddr, npages);
+  if (result) {
+    lock_release(as->as_lock);
+    return result;
+  }
+#endif
+
+  if (vaddr == r->vr_base && end == rend) {
+    /* The whole mapping */
+    for (link = &as->as_regions; *link != r; link = &(*link)->vr_next);
+    *link = r->vr_next;
+#if OPT_DEMANDLOAD
+    if (r->vr_vnode != NULL) {
+      VOP_DECREF(r->vr_vnode);
+    }
+#endif
+    kfree(r);
+  } else if (vaddr == r->vr_base) {
+    r->vr_base = end;
+    r->vr_npages -= npages;
+  } else if (end == rend) {
+    r->vr_npages -= npages;
+  } else {
+    /* A hole in the middle: the part after it becomes a new mapping */
+    tail = as_add_region(as, end, (rend - end) / PAGE_SIZE, r->vr_perm);
+    if (tail == NULL) {
+      lock_release(as->as_lock);
+      return ENOMEM;
+    }
+    tail->vr_mapped = true;
+#if OPT_DEMANDLOAD
+    as_copy_backing(tail, r);
+#endif
+#if OPT_MMAPFILE
+    tail->vr_shared = r->vr_shared;
+#endif
+    r->vr_npages = (vaddr - r->vr_base) / PAGE_SIZE;
+  }
+
+  as_release_pages(as, vaddr, npages);
+
+  return 0;
+}
+#endif /* OPT_SYS_VM */
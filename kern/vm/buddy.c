@@ -0,0 +1,200 @@
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <buddy.h>
+
+/*
+ * Free list node, stored at the beginning of the first frame of each
+ * free block.
+ */
+struct buddy_block {
+  struct buddy_block*   bb_next;
+  struct buddy_block*   bb_prev;
+};
+
+static struct buddy_block *bd_free[BUDDY_NORDERS];  /* Free lists       */
+static unsigned bd_nfree[BUDDY_NORDERS];            /* List lengths     */
+
+/*
+ * For each frame, 1 + the order of the free block starting there, or 0
+ * if the frame is not the head of a free block.
+ */
+static unsigned char *bd_tag = NULL;
+static unsigned bd_nframes = 0;
+
+#define FRAME_TO_BLOCK(f) ((struct buddy_block *)PADDR_TO_KVADDR((paddr_t)(f) * PAGE_SIZE))
+#define BLOCK_TO_FRAME(b) ((unsigned)(((vaddr_t)(b) - MIPS_KSEG0) / PAGE_SIZE))
+
+/*
+ * Smallest order whose blocks hold NPAGES frames.
+ */
+static
+unsigned
+buddy_order(unsigned npages)
+{
+  unsigned order;
+
+  for (order = 0; (1U << order) < npages; order++);
+  return order;
+}
+
+static
+void
+buddy_push(unsigned frame, unsigned order)
+{
+  struct buddy_block *b;
+
+  b = FRAME_TO_BLOCK(frame);
+  b->bb_prev = NULL;
+  b->bb_next = bd_free[order];
+  if (b->bb_next != NULL) {
+    b->bb_next->bb_prev = b;
+  }
+  bd_free[order] = b;
+  bd_nfree[order]++;
+  bd_tag[frame] = order + 1;
+}
+
+static
+void
+buddy_remove(unsigned frame, unsigned order)
+{
+  struct buddy_block *b;
+
+  KASSERT(bd_tag[frame] == order + 1);
+
+  b = FRAME_TO_BLOCK(frame);
+  if (b->bb_prev != NULL) {
+    b->bb_prev->bb_next = b->bb_next;
+  } else {
+    bd_free[order] = b->bb_next;
+  }
+  if (b->bb_next != NULL) {
+    b->bb_next->bb_prev = b->bb_prev;
+  }
+  bd_nfree[order]--;
+  bd_tag[frame] = 0;
+}
+
+/**
+ * Allocate the metadata of the allocator
+ * @param nframes   Number of frames of RAM
+ */
+void
+buddy_bootstrap(unsigned nframes)
+{
+  paddr_t paddr;
+  unsigned i;
+
+  paddr = ram_stealmem(DIVROUNDUP(nframes, PAGE_SIZE));
+  if (paddr == 0) {
+    panic("buddy: cannot allocate the metadata for %u frames\n", nframes);
+  }
+
+  bd_tag = (unsigned char *)PADDR_TO_KVADDR(paddr);
+  bd_nframes = nframes;
+  bzero(bd_tag, nframes);
+
+  for (i = 0; i < BUDDY_NORDERS; i++) {
+    bd_free[i] = NULL;
+    bd_nfree[i] = 0;
+  }
+}
+
+/**
+ * Make a range of frames available, split in the largest aligned blocks
+ * @param first     First frame
+ * @param last      One past the last frame
+ */
+void
+buddy_addrange(unsigned first, unsigned last)
+{
+  unsigned order;
+
+  KASSERT(bd_tag != NULL);
+  KASSERT(first > 0 && last <= bd_nframes);
+
+  while (first < last) {
+    for (order = BUDDY_NORDERS - 1; order > 0; order--) {
+      if ((first & ((1U << order) - 1)) == 0 && first + (1U << order) <= last) {
+        break;
+      }
+    }
+    buddy_push(first, order);
+    first += 1U << order;
+  }
+}
+
+/**
+ * Allocate a block of frames
+ * @param npages    Number of frames needed
+ * @return          First frame of the block, 0 if not available
+ */
+unsigned
+buddy_alloc(unsigned npages)
+{
+  unsigned order, o, frame;
+
+  KASSERT(npages > 0);
+
+  order = buddy_order(npages);
+  for (o = order; o < BUDDY_NORDERS && bd_free[o] == NULL; o++);
+  if (o == BUDDY_NORDERS) {
+    return 0;
+  }
+
+  frame = BLOCK_TO_FRAME(bd_free[o]);
+  buddy_remove(frame, o);
+
+  /* Give back the upper halves until the block is small enough */
+  while (o > order) {
+    o--;
+    buddy_push(frame + (1U << o), o);
+  }
+
+  return frame;
+}
+
+/**
+ * Release a block of frames, merging it with its free buddies
+ * @param frame     First frame of the block
+ * @param npages    Number of frames requested at allocation
+ */
+void
+buddy_free(unsigned frame, unsigned npages)
+{
+  unsigned order, buddy;
+
+  KASSERT(frame < bd_nframes);
+  KASSERT(bd_tag[frame] == 0);
+
+  order = buddy_order(npages);
+  KASSERT((frame & ((1U << order) - 1)) == 0);
+
+  while (order < BUDDY_NORDERS - 1) {
+    buddy = frame ^ (1U << order);
+    if (buddy >= bd_nframes || bd_tag[buddy] != order + 1) {
+      break;
+    }
+    buddy_remove(buddy, order);
+    if (buddy < frame) {
+      frame = buddy;
+    }
+    order++;
+  }
+
+  buddy_push(frame, order);
+}
+
+/**
+ * Get the number of free blocks of an order
+ * @param order     Block order (size is 2^order frames)
+ * @return          Number of free blocks
+ */
+unsigned
+buddy_nfree(unsigned order)
+{
+  KASSERT(order < BUDDY_NORDERS);
+
+  return bd_nfree[order];
+}
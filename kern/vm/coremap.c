@@ -0,0 +1,1561 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <wchan.h>
+#include <vm.h>
+#include <coremap.h>
+#if OPT_BUDDY
+#include <buddy.h>
+#endif
+#if OPT_PFCACHE
+#include <pfcache.h>
+#endif
+#include <opt-workqueue.h>
+#if OPT_SWAP && OPT_WORKQUEUE
+#include <workqueue.h>
+#endif
+
+/*
+ * Frame states.
+ */
+typedef enum {
+  CM_FREE,          /* Available for allocation                     */
+  CM_FIXED,         /* Kernel memory (or reserved before bootstrap)  */
+  CM_USER,          /* Page of a user address space                 */
+#if OPT_ZEROPOOL
+  CM_ZERO,          /* Free and zero-filled, in the zero pool        */
+#endif
+} cm_state_t;
+
+struct coremap_entry {
+  struct addrspace*   cm_as;        /* Owner of a user frame             */
+  vaddr_t             cm_vaddr;     /* Virtual page mapped on this frame */
+  unsigned            cm_npages;    /* Block length (first frame only)   */
+  unsigned            cm_refcount;  /* Page tables mapping a user frame  */
+  cm_state_t          cm_state;     /* Current frame state               */
+  bool                cm_pinned;    /* Being mapped by vm_fault          */
+  bool                cm_busy;      /* Being paged out                   */
+  bool                cm_shared;    /* Shared copy-on-write              */
+  bool                cm_referenced;/* Used since the clock hand passed  */
+#if OPT_SHARETEXT
+  struct vnode*       cm_vnode;     /* File of a page cache frame, or NULL */
+  off_t               cm_offset;    /* Offset of the page in the file    */
+  unsigned            cm_hnext;     /* Next frame of the hash chain      */
+  bool                cm_mapped;    /* Page of a file mapping, not of an
+                                       executable segment               */
+#endif
+  bool                cm_dirty;     /* Written since filled (user frames) */
+};
+
+/*
+ * Before coremap_bootstrap the pages come from ram_stealmem, that is not
+ * synchronized by itself. Afterwards the same spinlock protects the coremap.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap = NULL;
+static unsigned cm_nframes;       /* Number of frames described         */
+static unsigned cm_firstframe;    /* First frame managed by the coremap */
+static unsigned cm_nalloc;        /* Number of allocated managed frames */
+#if !OPT_BUDDY
+static unsigned cm_hint;          /* Where to start looking for a frame */
+#endif
+#if OPT_SWAP
+static unsigned cm_clockhand;     /* Next eviction candidate            */
+static unsigned cm_refclears;     /* Reference bits cleared by the hand */
+static unsigned cm_evictions;     /* Frames freed by the hand           */
+#endif
+#if OPT_COMPACT
+static unsigned cm_compactions;   /* Calls to coremap_compact           */
+static unsigned cm_compacted;     /* Blocks actually rebuilt            */
+static unsigned cm_relocations;   /* User pages moved to another frame  */
+#endif
+
+/*
+ * Free frames user pages can't take: below this a user allocation evicts
+ * (or fails) instead, so that page tables, stacks and kmalloc pages can
+ * still be allocated when RAM is full of user pages.
+ */
+#define COREMAP_KRESERVE  16
+
+#if OPT_SWAP && OPT_WORKQUEUE
+/* Evicts user pages once a kernel allocation dipped into the reserve */
+static void coremap_refill(void *arg);
+static struct work cm_refillwork = WORK_INITIALIZER(coremap_refill, NULL);
+#endif
+
+#if OPT_ZEROPOOL
+/*
+ * Free frames already zero-filled by the idle CPUs. They're not in the
+ * free lists (so the buddy allocator can't write its links in them) and
+ * not counted in cm_nalloc either.
+ */
+#define ZEROPOOL_SIZE     32      /* Maximum number of frames in the pool */
+#define ZEROPOOL_RESERVE  16      /* Free frames left alone by the idle CPUs */
+
+static unsigned cm_zeropool[ZEROPOOL_SIZE];
+static unsigned cm_nzero;         /* Frames in the pool                 */
+static unsigned cm_zerohits;      /* Zero-filled frames from the pool   */
+static unsigned cm_zeromisses;    /* Zero-filled frames cleared on demand */
+#endif
+
+#if OPT_SHARETEXT
+/*
+ * Page cache of read-only file pages, hashed by vnode and offset. The
+ * chains are linked through the coremap entries (cm_hnext), frame 0
+ * ends them. A cached frame is always marked shared, so it's never taken
+ * over by coremap_unshare: it stays in the cache until the last page
+ * table mapping it lets it go, or until the clock reclaims it from all of
+ * them at once (vm_pageout_cached), writing it back first if it's dirty.
+ *
+ * The pages of an executable segment are zero-filled outside the segment,
+ * so they're never confused with the pages of a file mapping (cm_mapped),
+ * that hold the file as it is.
+ */
+#define CM_HASHSIZE       128
+
+static unsigned cm_hash[CM_HASHSIZE];
+static unsigned cm_ncached;       /* Frames in the page cache           */
+static unsigned cm_cachehits;     /* Mappings of an already cached page */
+
+#define CM_HASH(v, off) \
+  ((((uintptr_t)(v) / sizeof(void *)) ^ (unsigned)((off) / PAGE_SIZE)) % CM_HASHSIZE)
+#endif
+
+/* Threads waiting for a page-out to complete */
+static struct wchan *coremap_wchan;
+
+#define COREMAP_ACTIVE (coremap != NULL)
+
+#define PADDR_TO_FRAME(paddr) ((unsigned)((paddr) / PAGE_SIZE))
+#define FRAME_TO_PADDR(frame) ((paddr_t)(frame) * PAGE_SIZE)
+
+/**
+ * Steal the memory needed for the coremap itself and mark everything that
+ * was already allocated as fixed.
+ */
+void
+coremap_bootstrap(void)
+{
+  paddr_t last, first, cm_paddr;
+  unsigned i, cm_npages;
+
+  last = ram_getsize();
+  cm_nframes = PADDR_TO_FRAME(last);
+  cm_npages = DIVROUNDUP(cm_nframes * sizeof(struct coremap_entry), PAGE_SIZE);
+
+  spinlock_acquire(&coremap_lock);
+
+  cm_paddr = ram_stealmem(cm_npages);
+  if (cm_paddr == 0) {
+    panic("coremap: cannot allocate %u pages for the coremap\n", cm_npages);
+  }
+#if OPT_BUDDY
+  buddy_bootstrap(cm_nframes);
+#endif
+
+  /*
+   * From now on the ram_stealmem() function won't work anymore.
+   * We are fully relying on the coremap for memory management
+   */
+  first = ram_getfirstfree();
+
+  KASSERT((first & PAGE_FRAME) == first);
+  KASSERT((last & PAGE_FRAME) == last);
+
+  cm_firstframe = PADDR_TO_FRAME(first);
+  cm_nalloc = 0;
+#if !OPT_BUDDY
+  cm_hint = cm_firstframe;
+#endif
+#if OPT_SWAP
+  cm_clockhand = cm_firstframe;
+#endif
+
+  coremap = (struct coremap_entry *)PADDR_TO_KVADDR(cm_paddr);
+  for (i = 0; i < cm_nframes; i++) {
+    coremap[i].cm_as = NULL;
+    coremap[i].cm_vaddr = 0;
+    coremap[i].cm_npages = 0;
+    coremap[i].cm_refcount = 0;
+    coremap[i].cm_state = i < cm_firstframe ? CM_FIXED : CM_FREE;
+    coremap[i].cm_pinned = false;
+    coremap[i].cm_busy = false;
+    coremap[i].cm_shared = false;
+    coremap[i].cm_referenced = false;
+#if OPT_SHARETEXT
+    coremap[i].cm_vnode = NULL;
+    coremap[i].cm_offset = 0;
+    coremap[i].cm_hnext = 0;
+    coremap[i].cm_mapped = false;
+#endif
+    coremap[i].cm_dirty = false;
+  }
+#if OPT_BUDDY
+  buddy_addrange(cm_firstframe, cm_nframes);
+#endif
+
+  spinlock_release(&coremap_lock);
+
+  coremap_wchan = wchan_create("coremap");
+  if (coremap_wchan == NULL) {
+    panic("coremap: cannot create the wait channel\n");
+  }
+
+  kprintf("coremap: %u frames, %u managed\n",
+          cm_nframes, cm_nframes - cm_firstframe);
+}
+
+#if !OPT_BUDDY
+/*
+ * Look for NPAGES contiguous free frames (first fit). The coremap lock must
+ * be held. Returns the first frame of the block or 0 if there is none
+ * (frame 0 is never managed, since it holds the exception handlers).
+ */
+static
+unsigned
+coremap_findblock(unsigned npages)
+{
+  unsigned pos, start, len;
+
+  start = len = 0;
+  for (pos = cm_firstframe; pos < cm_nframes; pos++) {
+    if (coremap[pos].cm_state != CM_FREE) {
+      len = 0;
+      continue;
+    }
+    if (len == 0) start = pos;
+    if (++len == npages) return start;
+  }
+
+  return 0;
+}
+
+/*
+ * Look for a single free frame, starting from the last allocated one. The
+ * coremap lock must be held. Returns 0 if the memory is exhausted.
+ */
+static
+unsigned
+coremap_findframe(void)
+{
+  unsigned i, pos;
+
+  for (i = cm_firstframe; i < cm_nframes; i++) {
+    pos = cm_hint + i - cm_firstframe;
+    if (pos >= cm_nframes) pos -= cm_nframes - cm_firstframe;
+    if (coremap[pos].cm_state == CM_FREE) {
+      cm_hint = pos;
+      return pos;
+    }
+  }
+
+  return 0;
+}
+
+#endif /* !OPT_BUDDY */
+
+/*
+ * Count the free frames, the zero pool included. The coremap lock must be
+ * held.
+ */
+static
+unsigned
+coremap_nfree(void)
+{
+#if OPT_BUDDY
+  unsigned order, nfree;
+
+  /* The tails of the blocks handed out are not in cm_nalloc */
+  for (order = 0, nfree = 0; order < BUDDY_NORDERS; order++) {
+    nfree += buddy_nfree(order) << order;
+  }
+#if OPT_ZEROPOOL
+  nfree += cm_nzero;
+#endif
+  return nfree;
+#else
+  return cm_nframes - cm_firstframe - cm_nalloc;
+#endif
+}
+
+/*
+ * Check the reserve after a kernel allocation, and have it refilled by a
+ * worker if needed. The coremap lock must be held.
+ */
+static
+void
+coremap_checkreserve(void)
+{
+#if OPT_SWAP && OPT_WORKQUEUE
+  if (coremap_nfree() < COREMAP_KRESERVE && CURCPU_EXISTS()) {
+    work_queue(&cm_refillwork);
+  }
+#endif
+}
+
+/*
+ * Take a block of NPAGES free frames, with the buddy allocator if
+ * available. The coremap lock must be held. Returns 0 if there is none.
+ */
+static
+unsigned
+coremap_allocblock(unsigned npages)
+{
+#if OPT_BUDDY
+  return buddy_alloc(npages);
+#else
+  return npages == 1 ? coremap_findframe() : coremap_findblock(npages);
+#endif
+}
+
+/*
+ * Mark a block of frames as allocated. The coremap lock must be held.
+ */
+static
+void
+coremap_markblock(unsigned start, unsigned npages, cm_state_t state,
+                  struct addrspace *as, vaddr_t vaddr)
+{
+  unsigned i;
+
+  for (i = start; i < start + npages; i++) {
+#if OPT_ZEROPOOL
+    KASSERT(coremap[i].cm_state == CM_FREE || coremap[i].cm_state == CM_ZERO);
+#else
+    KASSERT(coremap[i].cm_state == CM_FREE);
+#endif
+    coremap[i].cm_state = state;
+    coremap[i].cm_as = as;
+    coremap[i].cm_vaddr = vaddr;
+    coremap[i].cm_npages = 0;
+    coremap[i].cm_refcount = 1;
+    coremap[i].cm_pinned = state == CM_USER;
+    coremap[i].cm_shared = false;
+    coremap[i].cm_referenced = true;
+    coremap[i].cm_dirty = false;
+  }
+  coremap[start].cm_npages = npages;
+  cm_nalloc += npages;
+}
+
+/*
+ * Return a block of frames to the free pool. The coremap lock must be held.
+ */
+static
+void
+coremap_releaseblock(unsigned start)
+{
+  unsigned i, npages;
+
+  npages = coremap[start].cm_npages;
+  KASSERT(npages > 0);
+
+  for (i = start; i < start + npages; i++) {
+#if OPT_SHARETEXT
+    KASSERT(coremap[i].cm_vnode == NULL);
+#endif
+    coremap[i].cm_state = CM_FREE;
+    coremap[i].cm_as = NULL;
+    coremap[i].cm_vaddr = 0;
+    coremap[i].cm_npages = 0;
+    coremap[i].cm_refcount = 0;
+    coremap[i].cm_pinned = false;
+    coremap[i].cm_shared = false;
+    coremap[i].cm_referenced = false;
+  }
+  cm_nalloc -= npages;
+
+#if OPT_BUDDY
+  buddy_free(start, npages);
+#endif
+}
+
+#if OPT_PFCACHE
+/*
+ * Give back the free frames held by the per-CPU caches, which are
+ * allocated as far as the coremap is concerned. The coremap lock must be
+ * held, and it's released meanwhile. Returns false if they were empty.
+ */
+static
+bool
+coremap_pfdrain(void)
+{
+  if (!CURCPU_EXISTS() || pfcache_ncached() == 0) {
+    return false;
+  }
+
+  spinlock_release(&coremap_lock);
+  pfcache_flushall();
+  spinlock_acquire(&coremap_lock);
+
+  return true;
+}
+#endif /* OPT_PFCACHE */
+
+#if OPT_ZEROPOOL
+/*
+ * Give back every frame of the zero pool to the free lists. The coremap
+ * lock must be held.
+ */
+static
+void
+coremap_zerodrain(void)
+{
+  unsigned frame;
+
+  while (cm_nzero > 0) {
+    frame = cm_zeropool[--cm_nzero];
+    KASSERT(coremap[frame].cm_state == CM_ZERO);
+    coremap[frame].cm_state = CM_FREE;
+#if OPT_BUDDY
+    buddy_free(frame, 1);
+#endif
+  }
+}
+
+/**
+ * Zero-fill a free frame and put it in the zero pool. Called by the idle
+ * loop of thread_switch, with interrupts off, which lets them in again
+ * before asking for the next frame.
+ * @return    true if a frame was zeroed, false if there is nothing to do
+ */
+bool
+coremap_zerofill(void)
+{
+  unsigned frame;
+
+  spinlock_acquire(&coremap_lock);
+
+  if (!COREMAP_ACTIVE || cm_nzero == ZEROPOOL_SIZE ||
+      coremap_nfree() - cm_nzero <= ZEROPOOL_RESERVE) {
+    spinlock_release(&coremap_lock);
+    return false;
+  }
+
+  frame = coremap_allocblock(1);
+  if (frame == 0) {
+    spinlock_release(&coremap_lock);
+    return false;
+  }
+  /* Not free, not in the pool yet: nobody looks at it meanwhile */
+  coremap[frame].cm_state = CM_FIXED;
+
+  spinlock_release(&coremap_lock);
+
+  bzero((void *)PADDR_TO_KVADDR(FRAME_TO_PADDR(frame)), PAGE_SIZE);
+
+  spinlock_acquire(&coremap_lock);
+  coremap[frame].cm_state = CM_ZERO;
+  cm_zeropool[cm_nzero++] = frame;
+  spinlock_release(&coremap_lock);
+
+  return true;
+}
+
+/**
+ * Print the zero pool statistics
+ */
+void
+coremap_zerostats(void)
+{
+  unsigned total;
+
+  total = cm_zerohits + cm_zeromisses;
+  kprintf("%u zero-filled pages, %u from the pool (%u%%), %u pooled\n",
+          total, cm_zerohits,
+          total == 0 ? 0 : (100 * cm_zerohits + total / 2) / total,
+          cm_nzero);
+}
+#endif /* OPT_ZEROPOOL */
+
+/**
+ * Allocate a block of contiguous frames for kernel use.
+ * @param npages    Number of frames needed
+ * @return          Physical address of the block or 0 if not available
+ */
+paddr_t
+coremap_getkpages(unsigned npages)
+{
+  paddr_t addr;
+  unsigned start;
+
+  KASSERT(npages > 0);
+
+  spinlock_acquire(&coremap_lock);
+
+  if (!COREMAP_ACTIVE) {
+    /*
+     * We're in the early phases of bootstrap so we go with the old method
+     */
+    addr = ram_stealmem(npages);
+    spinlock_release(&coremap_lock);
+    return addr;
+  }
+
+  start = coremap_allocblock(npages);
+#if OPT_ZEROPOOL
+  /* The zero pool is free memory too */
+  if (start == 0 && cm_nzero > 0) {
+    coremap_zerodrain();
+    start = coremap_allocblock(npages);
+  }
+#endif
+#if OPT_PFCACHE
+  /* And so are the frames cached by the CPUs */
+  if (start == 0 && coremap_pfdrain()) {
+    start = coremap_allocblock(npages);
+  }
+#endif
+  if (start == 0) {
+    spinlock_release(&coremap_lock);
+    return 0;
+  }
+  coremap_markblock(start, npages, CM_FIXED, NULL, 0);
+  coremap_checkreserve();
+
+  spinlock_release(&coremap_lock);
+
+  return FRAME_TO_PADDR(start);
+}
+
+#if OPT_SHARETEXT
+/*
+ * Remove a frame from the page cache. The coremap lock must be held.
+ */
+static
+void
+coremap_uncache(unsigned frame)
+{
+  unsigned *link;
+
+  link = &cm_hash[CM_HASH(coremap[frame].cm_vnode, coremap[frame].cm_offset)];
+  while (*link != frame) {
+    KASSERT(*link != 0);
+    link = &coremap[*link].cm_hnext;
+  }
+  *link = coremap[frame].cm_hnext;
+
+  coremap[frame].cm_vnode = NULL;
+  coremap[frame].cm_offset = 0;
+  coremap[frame].cm_hnext = 0;
+  coremap[frame].cm_mapped = false;
+  cm_ncached--;
+}
+#endif /* OPT_SHARETEXT */
+
+#if OPT_SWAP
+/*
+ * Choose a frame to page out with the second-chance (clock) policy. The
+ * coremap lock must be held. A frame used since the last pass of the hand
+ * gets its reference bit cleared and is skipped; frames being mapped or
+ * already being paged out are never chosen. Returns 0 if there is no
+ * candidate.
+ *
+ * The MIPS TLB has no reference bit: vm_fault sets cm_referenced when it
+ * loads a translation. When the bit is cleared the translation is dropped
+ * from the TLB of this CPU too, so that the next use of the page faults
+ * and sets it again. The other CPUs are not interrupted: a page used only
+ * through their TLB may look idle, and vm_pageout shoots it down anyway.
+ * The owner of a shared frame may be gone, so its translations are left
+ * alone: only faults mark it as used.
+ */
+static
+unsigned
+coremap_clock(void)
+{
+  unsigned i, pos;
+  struct coremap_entry *e;
+
+  /* Two sweeps: the first one may only clear reference bits */
+  for (i = 0; i < 2 * (cm_nframes - cm_firstframe); i++) {
+    pos = cm_clockhand;
+    cm_clockhand = pos + 1 < cm_nframes ? pos + 1 : cm_firstframe;
+
+    e = &coremap[pos];
+    if (e->cm_state != CM_USER || e->cm_pinned || e->cm_busy) {
+      continue;
+    }
+    if (e->cm_referenced) {
+      e->cm_referenced = false;
+      cm_refclears++;
+      if (!e->cm_shared) {
+        vm_tlb_invalidate(e->cm_as, e->cm_vaddr);
+      }
+      continue;
+    }
+    return pos;
+  }
+
+  return 0;
+}
+
+/*
+ * Free a frame by paging out its content. The coremap lock must be held
+ * and it's released while the page is written. Returns false if nothing
+ * could be paged out.
+ */
+static
+bool
+coremap_evict(void)
+{
+  unsigned frame;
+  struct coremap_entry *e;
+  struct addrspace *as;
+  vaddr_t vaddr;
+  bool shared;
+  int result;
+#if OPT_SHARETEXT
+  struct vnode *v;
+  off_t offset;
+  bool mapped;
+#endif
+
+  while ((frame = coremap_clock()) != 0) {
+    e = &coremap[frame];
+    e->cm_busy = true;
+    as = e->cm_as;
+    vaddr = e->cm_vaddr;
+    shared = e->cm_shared;
+#if OPT_SHARETEXT
+    /* Stays in the cache until released, so that it's not read twice */
+    v = e->cm_vnode;
+    offset = e->cm_offset;
+    mapped = e->cm_mapped;
+#endif
+
+    spinlock_release(&coremap_lock);
+#if OPT_SHARETEXT
+    if (v != NULL) {
+      result = vm_pageout_cached(v, offset, mapped, FRAME_TO_PADDR(frame));
+    } else
+#endif
+    if (shared) {
+      result = vm_pageout_shared(vaddr, FRAME_TO_PADDR(frame));
+    } else {
+      result = vm_pageout(as, vaddr, FRAME_TO_PADDR(frame));
+    }
+    spinlock_acquire(&coremap_lock);
+
+    e->cm_busy = false;
+    wchan_wakeall(coremap_wchan, &coremap_lock);
+
+#if OPT_SHARETEXT
+    if (e->cm_vnode != NULL && e->cm_dirty) {
+      /* Written again meanwhile, or not written back: keep it */
+      continue;
+    }
+#endif
+    if (shared && e->cm_refcount == 0) {
+      /* Also if an error stopped the walk after the last mapping */
+#if OPT_SHARETEXT
+      if (e->cm_vnode != NULL) {
+        coremap_uncache(frame);
+      }
+#endif
+      cm_evictions++;
+      coremap_releaseblock(frame);
+      return true;
+    }
+    if (result == 0 && !shared) {
+      KASSERT(e->cm_refcount == 1);
+      cm_evictions++;
+      coremap_releaseblock(frame);
+      return true;
+    }
+    if (result == ENOSPC) {
+      /* Swap area full: no use trying again */
+      return false;
+    }
+    /* The frame changed meanwhile, or was shared again: try another one */
+  }
+
+  return false;
+}
+
+#if OPT_WORKQUEUE
+/*
+ * Page out user pages until the reserve of the kernel is whole again. Run
+ * by a worker, that holds no address space lock.
+ */
+static
+void
+coremap_refill(void *arg)
+{
+  (void)arg;
+
+  spinlock_acquire(&coremap_lock);
+  while (coremap_nfree() < COREMAP_KRESERVE && coremap_evict()) {
+    /* Kernel allocations may keep taking frames meanwhile */
+  }
+  spinlock_release(&coremap_lock);
+}
+#endif /* OPT_WORKQUEUE */
+
+/**
+ * Print the statistics of the page replacement
+ */
+void
+coremap_clockstats(void)
+{
+  kprintf("%u frames evicted, %u reference bits cleared\n",
+          cm_evictions, cm_refclears);
+}
+#endif /* OPT_SWAP */
+
+/**
+ * Allocate a frame for a user page. The last COREMAP_KRESERVE free frames
+ * are left to the kernel: when they're reached a page is evicted to the
+ * swap area instead.
+ *
+ * The frame is pinned, so that it's not chosen for eviction before it's
+ * mapped: the caller must call coremap_unpin once the page table entry
+ * is set.
+ * @param as        Address space the page belongs to
+ * @param vaddr     Virtual address of the page
+ * @param zero      Return a zero-filled frame, otherwise the content is
+ *                  undefined
+ * @return          Physical address of the frame or 0 if out of memory
+ */
+paddr_t
+coremap_getupage(struct addrspace *as, vaddr_t vaddr, bool zero)
+{
+  unsigned frame;
+  bool zeroed;
+
+  KASSERT(COREMAP_ACTIVE);
+  KASSERT(as != NULL);
+  KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+  spinlock_acquire(&coremap_lock);
+#if OPT_PFCACHE
+  /* Rather than evicting, take back the frames cached by the CPUs */
+  if (coremap_nfree() <= COREMAP_KRESERVE) {
+    coremap_pfdrain();
+  }
+#endif
+#if OPT_SWAP
+  while (coremap_nfree() <= COREMAP_KRESERVE && coremap_evict()) {
+    /* Somebody else may take the evicted frame first: check again */
+  }
+#endif
+  if (coremap_nfree() <= COREMAP_KRESERVE) {
+    /* The rest is for the kernel */
+    spinlock_release(&coremap_lock);
+    return 0;
+  }
+
+#if OPT_ZEROPOOL
+  /* Pooled frames are for zero-fill pages, or when memory is exhausted */
+  frame = zero ? 0 : coremap_allocblock(1);
+  zeroed = frame == 0 && cm_nzero > 0;
+  if (zeroed) {
+    frame = cm_zeropool[--cm_nzero];
+  } else if (frame == 0) {
+    frame = coremap_allocblock(1);
+  }
+  if (zero) {
+    if (zeroed) cm_zerohits++;
+    else cm_zeromisses++;
+  }
+#else
+  zeroed = false;
+  frame = coremap_allocblock(1);
+#endif
+  /* Free frames are left, in the free lists or in the pool */
+  KASSERT(frame != 0);
+  coremap_markblock(frame, 1, CM_USER, as, vaddr);
+  spinlock_release(&coremap_lock);
+
+  if (zero && !zeroed) {
+    bzero((void *)PADDR_TO_KVADDR(FRAME_TO_PADDR(frame)), PAGE_SIZE);
+  }
+
+  return FRAME_TO_PADDR(frame);
+}
+
+/**
+ * Allow a frame returned by coremap_getupage to be paged out
+ * @param paddr     Physical address of the frame
+ */
+void
+coremap_unpin(paddr_t paddr)
+{
+  unsigned frame;
+
+  frame = PADDR_TO_FRAME(paddr & PAGE_FRAME);
+
+  spinlock_acquire(&coremap_lock);
+  KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+  KASSERT(coremap[frame].cm_pinned);
+  coremap[frame].cm_pinned = false;
+  spinlock_release(&coremap_lock);
+}
+
+/**
+ * Record a use of a user frame, for the replacement policy
+ * @param paddr     Physical address of the frame
+ */
+void
+coremap_touch(paddr_t paddr)
+{
+  unsigned frame;
+
+  frame = PADDR_TO_FRAME(paddr & PAGE_FRAME);
+
+  spinlock_acquire(&coremap_lock);
+  KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+  coremap[frame].cm_referenced = true;
+  spinlock_release(&coremap_lock);
+}
+
+/**
+ * Add a reference to a user frame, now mapped by one more page table.
+ * From now on the owner recorded in the coremap is not reliable, so the
+ * frame is paged out from every address space (vm_pageout_shared) until
+ * coremap_unshare.
+ * @param paddr     Physical address of the frame
+ */
+void
+coremap_share(paddr_t paddr)
+{
+  unsigned frame;
+
+  frame = PADDR_TO_FRAME(paddr & PAGE_FRAME);
+
+  spinlock_acquire(&coremap_lock);
+  KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+  KASSERT(coremap[frame].cm_state == CM_USER);
+  coremap[frame].cm_refcount++;
+  coremap[frame].cm_shared = true;
+  spinlock_release(&coremap_lock);
+}
+
+/**
+ * Take over a copy-on-write frame if nobody else maps it anymore
+ * @param paddr     Physical address of the frame
+ * @param as        Address space of the caller
+ * @param vaddr     Virtual address of the page in AS
+ * @return          true if AS is now the only owner of the frame, false
+ *                  if the frame is still shared
+ */
+bool
+coremap_unshare(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+  unsigned frame;
+  bool owned;
+
+  frame = PADDR_TO_FRAME(paddr & PAGE_FRAME);
+
+  spinlock_acquire(&coremap_lock);
+  KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+  KASSERT(coremap[frame].cm_state == CM_USER);
+  /* While it's paged out the mappings are being replaced */
+  owned = coremap[frame].cm_refcount == 1 && !coremap[frame].cm_busy;
+#if OPT_SHARETEXT
+  /* Page cache frames are never private */
+  owned = owned && coremap[frame].cm_vnode == NULL;
+#endif
+  if (owned) {
+    coremap[frame].cm_as = as;
+    coremap[frame].cm_vaddr = vaddr;
+    coremap[frame].cm_shared = false;
+  }
+  spinlock_release(&coremap_lock);
+
+  return owned;
+}
+
+/**
+ * Record a write to a user frame: its content differs now from the page
+ * it was filled with
+ * @param paddr     Physical address of the frame
+ */
+void
+coremap_dirty(paddr_t paddr)
+{
+  unsigned frame;
+
+  frame = PADDR_TO_FRAME(paddr & PAGE_FRAME);
+
+  spinlock_acquire(&coremap_lock);
+  KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+  KASSERT(coremap[frame].cm_state == CM_USER);
+  coremap[frame].cm_dirty = true;
+  spinlock_release(&coremap_lock);
+}
+
+/**
+ * Check if a user frame was written since it was filled
+ * @param paddr     Physical address of the frame
+ * @return          true if the frame is dirty
+ */
+bool
+coremap_isdirty(paddr_t paddr)
+{
+  unsigned frame;
+  bool dirty;
+
+  frame = PADDR_TO_FRAME(paddr & PAGE_FRAME);
+
+  spinlock_acquire(&coremap_lock);
+  KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+  dirty = coremap[frame].cm_dirty;
+  spinlock_release(&coremap_lock);
+
+  return dirty;
+}
+
+/**
+ * Release a block of frames allocated by coremap_getkpages.
+ * @param paddr     Physical address of the first frame
+ */
+void
+coremap_freepages(paddr_t paddr)
+{
+  unsigned frame;
+
+  /* Page align the physical address */
+  paddr &= PAGE_FRAME;
+  frame = PADDR_TO_FRAME(paddr);
+
+#if OPT_PFCACHE
+  /* The block is still ours, so its length can be read without locking */
+  if (COREMAP_ACTIVE && frame >= cm_firstframe &&
+      coremap[frame].cm_npages == 1 && pfcache_put(paddr)) {
+    return;
+  }
+#endif /* OPT_PFCACHE */
+
+  spinlock_acquire(&coremap_lock);
+
+  /* Memory allocated before VM initialization is never recycled */
+  if (!COREMAP_ACTIVE || frame < cm_firstframe) {
+    spinlock_release(&coremap_lock);
+    return;
+  }
+
+  KASSERT(frame < cm_nframes);
+  KASSERT(coremap[frame].cm_state == CM_FIXED);
+
+  coremap_releaseblock(frame);
+
+  spinlock_release(&coremap_lock);
+}
+
+#if OPT_PFCACHE
+/**
+ * Refill a per-CPU frame cache
+ * @param frames    Where to store the frames
+ * @param n         Number of frames wanted
+ * @return          Number of frames obtained
+ */
+unsigned
+vm_getframes(paddr_t *frames, unsigned n)
+{
+  unsigned i, frame;
+
+  spinlock_acquire(&coremap_lock);
+
+  if (!COREMAP_ACTIVE) {
+    spinlock_release(&coremap_lock);
+    return 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    frame = coremap_allocblock(1);
+    if (frame == 0) break;
+    coremap_markblock(frame, 1, CM_FIXED, NULL, 0);
+    frames[i] = FRAME_TO_PADDR(frame);
+  }
+  coremap_checkreserve();
+
+  spinlock_release(&coremap_lock);
+
+  return i;
+}
+
+/**
+ * Drain a per-CPU frame cache
+ * @param frames    Frames to release
+ * @param n         Number of frames
+ */
+void
+vm_putframes(const paddr_t *frames, unsigned n)
+{
+  unsigned i;
+
+  spinlock_acquire(&coremap_lock);
+  for (i = 0; i < n; i++) {
+    KASSERT(coremap[PADDR_TO_FRAME(frames[i])].cm_state == CM_FIXED);
+    coremap_releaseblock(PADDR_TO_FRAME(frames[i]));
+  }
+  spinlock_release(&coremap_lock);
+}
+#endif /* OPT_PFCACHE */
+
+#if OPT_SHARETEXT
+/*
+ * Find the frame of a page in the page cache. The coremap lock must be
+ * held. Returns 0 if the page is not cached.
+ */
+static
+unsigned
+coremap_findcached(struct vnode *v, off_t offset, bool mapped)
+{
+  unsigned frame;
+
+  for (frame = cm_hash[CM_HASH(v, offset)]; frame != 0;
+       frame = coremap[frame].cm_hnext) {
+    if (coremap[frame].cm_vnode == v && coremap[frame].cm_offset == offset &&
+        coremap[frame].cm_mapped == mapped) {
+      return frame;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Look for a page of a file in the page cache. If found, the frame gets a
+ * reference for the caller's page table.
+ * @param v         File
+ * @param offset    Offset of the page in the file
+ * @param mapped    Page of a file mapping rather than of an executable
+ * @return          Physical address of the frame, 0 if not cached
+ */
+paddr_t
+coremap_lookupfile(struct vnode *v, off_t offset, bool mapped)
+{
+  unsigned frame;
+
+  spinlock_acquire(&coremap_lock);
+  frame = coremap_findcached(v, offset, mapped);
+  if (frame != 0) {
+    coremap[frame].cm_refcount++;
+    cm_cachehits++;
+  }
+  spinlock_release(&coremap_lock);
+
+  return frame == 0 ? 0 : FRAME_TO_PADDR(frame);
+}
+
+/**
+ * Add a frame just filled with a page of a file to the page cache. If
+ * somebody else added the same page in the meantime, that frame is
+ * returned instead, with a reference for the caller, and the caller
+ * must release its own.
+ * @param paddr     Frame returned by coremap_getupage, still pinned
+ * @param v         File
+ * @param offset    Offset of the page in the file
+ * @param mapped    Page of a file mapping rather than of an executable
+ * @return          Physical address of the frame to map
+ */
+paddr_t
+coremap_cachefile(paddr_t paddr, struct vnode *v, off_t offset, bool mapped)
+{
+  unsigned frame, cached, bucket;
+
+  frame = PADDR_TO_FRAME(paddr & PAGE_FRAME);
+
+  spinlock_acquire(&coremap_lock);
+
+  KASSERT(coremap[frame].cm_state == CM_USER);
+  KASSERT(coremap[frame].cm_vnode == NULL);
+
+  cached = coremap_findcached(v, offset, mapped);
+  if (cached != 0) {
+    coremap[cached].cm_refcount++;
+    cm_cachehits++;
+    spinlock_release(&coremap_lock);
+    return FRAME_TO_PADDR(cached);
+  }
+
+  bucket = CM_HASH(v, offset);
+  coremap[frame].cm_vnode = v;
+  coremap[frame].cm_offset = offset;
+  coremap[frame].cm_hnext = cm_hash[bucket];
+  coremap[frame].cm_mapped = mapped;
+  coremap[frame].cm_shared = true;
+  cm_hash[bucket] = frame;
+  cm_ncached++;
+
+  spinlock_release(&coremap_lock);
+
+  return paddr;
+}
+
+/**
+ * Print the page cache statistics
+ */
+void
+coremap_filestats(void)
+{
+  kprintf("%u pages cached, %u mappings shared\n", cm_ncached, cm_cachehits);
+}
+#endif /* OPT_SHARETEXT */
+
+#if OPT_MMAPFILE
+/**
+ * Mark a page cache frame clean after it was written back. Other page
+ * tables may still hold writeable translations of the frame, so it stays
+ * dirty unless the caller is the only one mapping it: the caller must
+ * then drop its own translations, so that the next write faults again.
+ * While the clock reclaims the frame the caller maps nothing, and it must
+ * be unmapped everywhere.
+ * @param paddr     Physical address of the frame
+ * @return          true if the frame is now clean
+ */
+bool
+coremap_clean(paddr_t paddr)
+{
+  unsigned frame;
+  bool clean;
+
+  frame = PADDR_TO_FRAME(paddr & PAGE_FRAME);
+
+  spinlock_acquire(&coremap_lock);
+  clean = coremap[frame].cm_refcount == (coremap[frame].cm_busy ? 0 : 1);
+  if (clean) {
+    coremap[frame].cm_dirty = false;
+  }
+  spinlock_release(&coremap_lock);
+
+  return clean;
+}
+#endif /* OPT_MMAPFILE */
+
+/**
+ * Drop a reference to a user frame, and release it if it was the last one.
+ * If the frame is being paged out, wait for the page-out to complete
+ * instead: the page table entry has changed in the meantime. A shared
+ * frame is paged out one address space at a time, under its lock, which
+ * the caller may hold: the reference is just dropped, and the frame is
+ * released by coremap_evict.
+ * @param paddr     Physical address of the frame
+ * @return          true if the reference was dropped, false if the caller
+ *                  must look at its page table entry again
+ */
+bool
+coremap_freeupage(paddr_t paddr)
+{
+  unsigned frame;
+
+  frame = PADDR_TO_FRAME(paddr & PAGE_FRAME);
+
+  spinlock_acquire(&coremap_lock);
+
+  KASSERT(frame >= cm_firstframe && frame < cm_nframes);
+  KASSERT(coremap[frame].cm_state == CM_USER);
+
+  if (coremap[frame].cm_busy && !coremap[frame].cm_shared) {
+    while (coremap[frame].cm_busy) {
+      wchan_sleep(coremap_wchan, &coremap_lock);
+    }
+    spinlock_release(&coremap_lock);
+    return false;
+  }
+
+  KASSERT(coremap[frame].cm_refcount > 0);
+  if (--coremap[frame].cm_refcount == 0 && !coremap[frame].cm_busy) {
+#if OPT_SHARETEXT
+    if (coremap[frame].cm_vnode != NULL) {
+      coremap_uncache(frame);
+    }
+#endif
+    coremap_releaseblock(frame);
+  }
+
+  spinlock_release(&coremap_lock);
+  return true;
+}
+
+/*
+ * Check if we're in a context that can sleep.
+ */
+static
+void
+coremap_can_sleep(void)
+{
+  if (CURCPU_EXISTS()) {
+    /* must not hold spinlocks */
+    KASSERT(curcpu->c_spinlocks == 0);
+
+    /* must not be in an interrupt handler */
+    KASSERT(curthread->t_in_interrupt == 0);
+  }
+}
+
+#if OPT_COMPACT
+/*
+ * Check if a user frame can be moved elsewhere: it has a single owner and
+ * nobody is mapping, paging out or caching it. The coremap lock must be
+ * held.
+ */
+static
+bool
+coremap_movable(unsigned frame)
+{
+  const struct coremap_entry *e = &coremap[frame];
+
+  return e->cm_state == CM_USER && !e->cm_pinned && !e->cm_busy &&
+         !e->cm_shared && e->cm_refcount == 1
+#if OPT_SHARETEXT
+         && e->cm_vnode == NULL
+#endif
+         ;
+}
+
+/*
+ * Choose the block of SIZE frames (aligned to its size, like the blocks of
+ * the buddy allocator) that needs the fewest pages moved to become free.
+ * Every frame must be free or movable, and the free frames outside the
+ * block must be enough to hold the moved pages. The coremap lock must be
+ * held. Returns 0 if no block qualifies.
+ */
+static
+unsigned
+coremap_findwindow(unsigned size)
+{
+  unsigned start, i, nfree, inside, moves, best, bestmoves;
+#if OPT_BUDDY
+  unsigned b;
+#endif
+
+  nfree = coremap_nfree();
+  best = 0;
+  bestmoves = size + 1;
+
+  for (start = ROUNDUP(cm_firstframe, size); start + size <= cm_nframes;
+       start += size) {
+    inside = moves = 0;
+    for (i = start; i < start + size; i++) {
+      if (coremap[i].cm_state == CM_FREE) {
+        inside++;
+      } else if (coremap_movable(i)) {
+        moves++;
+      } else {
+        break;
+      }
+    }
+#if OPT_BUDDY
+    /* The tail of a block is held by the buddy allocator, although free */
+    if (i < start + size && coremap[i].cm_npages > 1) {
+      for (b = 1; b < coremap[i].cm_npages; b <<= 1);
+      start = ROUNDUP(i + b, size) - size;
+      continue;
+    }
+#endif
+    if (i == start + size && moves < bestmoves &&
+        moves + inside <= nfree) {
+      best = start;
+      bestmoves = moves;
+    }
+  }
+
+  return best;
+}
+
+/*
+ * Take a free frame outside the block of SIZE frames from START. The frames
+ * of the block handed out meanwhile are kept aside, in a list linked
+ * through the frames themselves whose head is *HOLDERS, so that they're
+ * not handed out again. The coremap lock must be held. Returns 0 if memory
+ * is exhausted.
+ */
+static
+unsigned
+coremap_allocoutside(unsigned start, unsigned size, unsigned *holders)
+{
+  unsigned frame;
+
+  while ((frame = coremap_allocblock(1)) != 0) {
+    if (frame < start || frame >= start + size) {
+      return frame;
+    }
+    coremap_markblock(frame, 1, CM_FIXED, NULL, 0);
+    *(unsigned *)PADDR_TO_KVADDR(FRAME_TO_PADDR(frame)) = *holders;
+    *holders = frame;
+  }
+
+  return 0;
+}
+
+/**
+ * Rebuild a block of contiguous free frames by moving the user pages that
+ * occupy it to other frames. Kernel frames can't be moved, so the block is
+ * chosen among the ones holding only free frames and movable user pages.
+ * The caller must be able to sleep and must not hold the lock of an
+ * address space, whose pages would be skipped (or deadlock against
+ * another compaction, if it's not the caller's own).
+ * @param npages    Number of frames needed
+ * @return          true if the block is free, false if no block could be
+ *                  emptied. Another thread may still take it before the
+ *                  caller does
+ */
+bool
+coremap_compact(unsigned npages)
+{
+  unsigned size, start, frame, dest, holders;
+  struct addrspace *as;
+  vaddr_t vaddr;
+  int result;
+
+  KASSERT(npages > 0);
+  coremap_can_sleep();
+
+  for (size = 1; size < npages; size <<= 1);
+
+  spinlock_acquire(&coremap_lock);
+
+  if (!COREMAP_ACTIVE) {
+    spinlock_release(&coremap_lock);
+    return false;
+  }
+  cm_compactions++;
+
+#if OPT_ZEROPOOL
+  coremap_zerodrain();
+#endif
+#if OPT_PFCACHE
+  /* Cached frames are neither free nor movable */
+  coremap_pfdrain();
+#endif
+
+  start = coremap_findwindow(size);
+  if (start == 0) {
+    spinlock_release(&coremap_lock);
+    return false;
+  }
+
+  holders = 0;
+  result = 0;
+  for (frame = start; frame < start + size && !result; frame++) {
+    if (coremap[frame].cm_state != CM_USER) {
+      /* Free, or already kept aside */
+      continue;
+    }
+    if (!coremap_movable(frame)) {
+      /* Changed while the lock was released */
+      result = EBUSY;
+      break;
+    }
+
+    dest = coremap_allocoutside(start, size, &holders);
+    if (dest == 0) {
+      result = ENOMEM;
+      break;
+    }
+
+    as = coremap[frame].cm_as;
+    vaddr = coremap[frame].cm_vaddr;
+    coremap_markblock(dest, 1, CM_USER, as, vaddr);
+    coremap[frame].cm_busy = true;
+
+    spinlock_release(&coremap_lock);
+    result = vm_relocate(as, vaddr, FRAME_TO_PADDR(frame),
+                         FRAME_TO_PADDR(dest));
+    spinlock_acquire(&coremap_lock);
+
+    coremap[frame].cm_busy = false;
+    wchan_wakeall(coremap_wchan, &coremap_lock);
+
+    if (result) {
+      coremap_releaseblock(dest);
+      break;
+    }
+
+    /* The page may have been written through the new frame already */
+    coremap[dest].cm_dirty |= coremap[frame].cm_dirty;
+    coremap[dest].cm_pinned = false;
+    KASSERT(coremap[frame].cm_refcount == 1);
+    coremap_releaseblock(frame);
+    cm_relocations++;
+  }
+
+  while (holders != 0) {
+    frame = holders;
+    holders = *(unsigned *)PADDR_TO_KVADDR(FRAME_TO_PADDR(frame));
+    coremap_releaseblock(frame);
+  }
+
+  if (!result) {
+    cm_compacted++;
+  }
+
+  spinlock_release(&coremap_lock);
+
+  return result == 0;
+}
+
+/**
+ * Print the compaction statistics
+ */
+void
+coremap_compactstats(void)
+{
+  kprintf("%u compactions, %u blocks rebuilt, %u pages moved\n",
+          cm_compactions, cm_compacted, cm_relocations);
+}
+#endif /* OPT_COMPACT */
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+  paddr_t pa;
+
+  coremap_can_sleep();
+#if OPT_PFCACHE
+  /* Single pages come from the cache of this CPU, if possible */
+  pa = npages == 1 ? pfcache_get() : 0;
+  if (pa == 0) {
+    pa = coremap_getkpages(npages);
+  }
+#else
+  pa = coremap_getkpages(npages);
+#endif /* OPT_PFCACHE */
+#if OPT_COMPACT
+  /* Free RAM may be enough, just fragmented by user pages */
+  if (pa == 0 && npages > 1 && CURCPU_EXISTS() && coremap_compact(npages)) {
+    pa = coremap_getkpages(npages);
+  }
+#endif
+  if (pa == 0) {
+    return 0;
+  }
+  return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+  KASSERT(addr >= MIPS_KSEG0);
+
+  coremap_freepages(addr - MIPS_KSEG0);
+}
+
+/* Test utilities */
+#if OPT_VM_ALLOC
+
+/**
+ * Get the RAM size (obtained during early stage of bootstrap)
+ * @return  RAM size in KiB
+ */
+unsigned
+ram_gettotal(void)
+{
+  return FRAME_TO_PADDR(cm_nframes) / 1024;
+}
+
+/**
+ * Get the portion of RAM dedicated to the kernel (included the coremap)
+ * @return  kernel RAM in KiB
+ */
+unsigned
+ram_getkernel(void)
+{
+  return FRAME_TO_PADDR(cm_firstframe) / 1024;
+}
+
+/**
+ * Return the number of page that the VM is able to allocate (both for kernel
+ * and userspace needs)
+ * @return  Number of allocatable pages
+ */
+unsigned
+ram_gettotalpages(void)
+{
+  return cm_nframes - cm_firstframe;
+}
+
+/**
+ * Return the number of *actually* allocated pages
+ * @return  Number of *actually* allocated pages
+ */
+unsigned
+ram_getallocatedpages(void)
+{
+#if OPT_PFCACHE
+  /* Frames in the per-CPU caches are free, actually */
+  return cm_nalloc - pfcache_ncached();
+#else
+  return cm_nalloc;
+#endif
+}
+
+/**
+ * Count the runs of contiguous free frames by length. The frames of the
+ * zero pool are free too, since they're given back when needed.
+ * @param runs      For each I, receives the number of runs of 2^I to
+ *                  2^(I+1)-1 frames. The last entry counts the longer too
+ * @param nbuckets  Number of entries of RUNS
+ * @return          Length of the longest run
+ */
+unsigned
+ram_getfreeruns(unsigned *runs, unsigned nbuckets)
+{
+  unsigned i, b, len, longest, npages;
+
+  KASSERT(nbuckets > 0);
+  bzero(runs, nbuckets * sizeof(*runs));
+
+  spinlock_acquire(&coremap_lock);
+  for (i = cm_firstframe, len = longest = 0; i <= cm_nframes; i++) {
+    if (i < cm_nframes && (coremap[i].cm_state == CM_FREE
+#if OPT_ZEROPOOL
+                           || coremap[i].cm_state == CM_ZERO
+#endif
+                          )) {
+      len++;
+      continue;
+    }
+    if (len > 0) {
+      for (b = 0; b + 1 < nbuckets && (len >> (b + 1)) != 0; b++);
+      runs[b]++;
+      if (len > longest) longest = len;
+      len = 0;
+    }
+#if OPT_BUDDY
+    /* The tail of a block is held by the buddy allocator, although free */
+    npages = i < cm_nframes ? coremap[i].cm_npages : 0;
+    if (npages > 1) {
+      for (b = 1; b < npages; b <<= 1);
+      i += b - 1;
+    }
+#else
+    (void)npages;
+#endif
+  }
+  spinlock_release(&coremap_lock);
+
+  return longest;
+}
+
+/**
+ * Check (as much as possible) if there has been a memory leakage until now.
+ * @return  Number of leaked page.
+ */
+unsigned
+ram_leaked(void)
+{
+  unsigned i, leaked;
+
+  /*
+   * No user process is running while memstats is executed from the menu,
+   * so every user frame still allocated has been leaked
+   */
+  spinlock_acquire(&coremap_lock);
+  for (i = cm_firstframe, leaked = 0; i < cm_nframes; i++) {
+    if (coremap[i].cm_state == CM_USER) leaked++;
+  }
+  spinlock_release(&coremap_lock);
+
+  return leaked;
+}
+
+#endif /* OPT_VM_ALLOC */
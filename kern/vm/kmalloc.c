@@ -29,8 +29,24 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
 #include <spinlock.h>
+#include <current.h>
 #include <vm.h>
+#include <opt-kmcache.h>
+#include <opt-kmclass.h>
+#include <opt-kvmap.h>
+#include <opt-kmprof.h>
+#if OPT_KMCACHE
+#include <kmcache.h>
+#endif
+#if OPT_KVMAP
+#include <kvmap.h>
+#endif
+#if OPT_KMPROF
+#include <kmprof.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -121,6 +137,15 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * The per-CPU caches of free blocks (OPT_KMCACHE) are left out by the
+ * debugging modes that tag each block, since cached blocks skip the
+ * tagging.
+ */
+#if OPT_KMCACHE && !defined(GUARDS) && !defined(LABELS)
+#define KMCACHE
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -131,6 +156,21 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
+#if OPT_KMCLASS
+/*
+ * Multi-page size classes (OPT_KMCLASS), for blocks too big for the
+ * subpage allocator. The 3K blocks are carved four at a time out of
+ * spans of three contiguous pages, the others take a span of their
+ * own. Each class keeps a few free blocks rather than giving their
+ * pages back at once.
+ */
+#define NBIGSIZES 4
+static const size_t bigsizes[NBIGSIZES] = { 3072, 4096, 8192, 16384 };
+static const unsigned bigpages[NBIGSIZES] = { 3, 1, 2, 4 };
+
+#define LARGEST_BIG_SIZE 16384
+#endif /* OPT_KMCLASS */
+
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
 #else
@@ -172,82 +212,74 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 /*
  * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * This is a struct type for such a page, that begins with the bitmap
+ * of its free entries.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each pageref page contains 252 pagerefs, which can manage up to
+ * 252 * 4K = 1008K of kernel heap. The pages are added as the heap
+ * grows, so its size is only bounded by the RAM; once allocated they
+ * aren't ever freed, which costs at most one page for each 252 pages
+ * the heap ever had.
  */
 
-#define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+#define PAGEREFPAGE_HEADER 64
+#define NPAGEREFS_PER_PAGE \
+	((PAGE_SIZE - PAGEREFPAGE_HEADER) / sizeof(struct pageref))
+#define INUSE_WORDS DIVROUNDUP(NPAGEREFS_PER_PAGE, 32)
 
 struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
-};
-
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
+	struct pagerefpage *next;	/* All the pageref pages */
 	unsigned numinuse;
+	uint32_t pagerefs_inuse[INUSE_WORDS];
+	struct pageref refs[NPAGEREFS_PER_PAGE];
 };
 
-/*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
- */
-
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static struct pagerefpage *pagerefpages;
+static unsigned npagerefpages;
+static unsigned npagerefs_inuse;
 
 /*
- * Allocate a page to hold pagerefs.
+ * Add a page of pagerefs. Returns false if out of memory.
  */
 static
-void
-allocpagerefpage(struct kheap_root *root)
+bool
+allocpagerefpage(void)
 {
+	struct pagerefpage *page;
 	vaddr_t va;
+	unsigned i;
 
-	KASSERT(root->page == NULL);
+	KASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
 	 * Note that this means things can change behind our back...
+	 * at worst somebody else adds a page too.
 	 */
 	spinlock_release(&kmalloc_spinlock);
 	va = alloc_kpages(1);
 	spinlock_acquire(&kmalloc_spinlock);
 	if (va == 0) {
 		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
+		return false;
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
+	page = (struct pagerefpage *)va;
+	page->numinuse = 0;
+	for (i=0; i<INUSE_WORDS; i++) {
+		page->pagerefs_inuse[i] = 0;
+	}
+	/* Mark the bits past the last entry as used */
+	for (i=NPAGEREFS_PER_PAGE; i<INUSE_WORDS*32; i++) {
+		page->pagerefs_inuse[i/32] |= ((uint32_t)1) << (i%32);
 	}
 
-	root->page = (struct pagerefpage *)va;
+	page->next = pagerefpages;
+	pagerefpages = page;
+	npagerefpages++;
+	return true;
 }
 
 /*
@@ -259,42 +291,39 @@ allocpageref(void)
 {
 	unsigned i,j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
-		}
+	struct pagerefpage *page;
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
+	while (1) {
+		for (page = pagerefpages; page != NULL; page = page->next) {
+			if (page->numinuse >= NPAGEREFS_PER_PAGE) {
 				continue;
 			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
+
+			/*
+			 * This should probably not be a linear search.
+			 */
+			for (i=0; i<INUSE_WORDS; i++) {
+				if (page->pagerefs_inuse[i]==0xffffffff) {
+					/* full */
+					continue;
+				}
+				for (k=1,j=0; k!=0; k<<=1,j++) {
+					if ((page->pagerefs_inuse[i] & k)==0) {
+						page->pagerefs_inuse[i] |= k;
+						page->numinuse++;
+						npagerefs_inuse++;
+						return &page->refs[i*32 + j];
 					}
-					return &root->page->refs[i*32 + j];
 				}
+				KASSERT(0);
 			}
-			KASSERT(0);
 		}
-	}
 
-	/* ran out */
-	return NULL;
+		/* ran out, add a page */
+		if (!allocpagerefpage()) {
+			return NULL;
+		}
+	}
 }
 
 /*
@@ -306,34 +335,21 @@ freepageref(struct pageref *p)
 {
 	size_t i, j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
 	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
-
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
-	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	/* The pageref page holding it */
+	page = (struct pagerefpage *)((vaddr_t)p & PAGE_FRAME);
+
+	j = p-page->refs;
+	/* note: j is unsigned, don't test < 0 */
+	KASSERT(j < NPAGEREFS_PER_PAGE);
+	i = j/32;
+	k = ((uint32_t)1) << (j%32);
+	KASSERT((page->pagerefs_inuse[i] & k) != 0);
+	page->pagerefs_inuse[i] &= ~k;
+	KASSERT(page->numinuse > 0);
+	page->numinuse--;
+	npagerefs_inuse--;
 }
 
 ////////////////////////////////////////
@@ -345,6 +361,107 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+#if defined(KMCACHE) || OPT_KMCLASS
+#define PAGECLASS
+#endif
+
+#ifdef PAGECLASS
+/*
+ * The block type of each heap page, plus one, indexed by physical page
+ * number; 0 for pages that are not subpage allocator pages. The pages
+ * of the multi-page classes hold NSIZES plus their class plus one. It's
+ * written under kmalloc_spinlock when a page is added or released, but
+ * read without it by kfree: a page can't be released while one of its
+ * blocks is still being freed, so the entry can't change under the
+ * reader.
+ *
+ * The table covers the whole of kseg0, in chunks of a page each that
+ * are allocated (and never freed) the first time one of their pages
+ * joins the heap, so it takes a page for each 16M of RAM in use.
+ */
+#define KHEAP_MAXPAGES ((MIPS_KSEG1 - MIPS_KSEG0) / PAGE_SIZE)
+#define PAGECLASS_NCHUNKS DIVROUNDUP(KHEAP_MAXPAGES, PAGE_SIZE)
+
+static uint8_t *kheap_pageclass[PAGECLASS_NCHUNKS];
+static unsigned kheap_npageclasschunks;
+
+#define PAGECLASS_PAGE(addr)  (((addr) - MIPS_KSEG0) / PAGE_SIZE)
+#define PAGECLASS_CHUNK(addr) (PAGECLASS_PAGE(addr) / PAGE_SIZE)
+
+/*
+ * Make sure that the table has room for NPAGES pages from PAGE. Must
+ * be called without kmalloc_spinlock, before adding the pages to the
+ * heap. Returns false if out of memory.
+ */
+static
+bool
+pageclass_ensure(vaddr_t page, unsigned npages)
+{
+	unsigned chunk;
+	vaddr_t va;
+
+	KASSERT(page >= MIPS_KSEG0);
+	KASSERT(PAGECLASS_PAGE(page) + npages <= KHEAP_MAXPAGES);
+
+	for (chunk = PAGECLASS_CHUNK(page);
+	     chunk <= PAGECLASS_CHUNK(page + (npages-1)*PAGE_SIZE); chunk++) {
+		if (kheap_pageclass[chunk] != NULL) {
+			continue;
+		}
+		va = alloc_kpages(1);
+		if (va == 0) {
+			kprintf("kmalloc: Couldn't get a page class page\n");
+			return false;
+		}
+		bzero((void *)va, PAGE_SIZE);
+
+		spinlock_acquire(&kmalloc_spinlock);
+		if (kheap_pageclass[chunk] == NULL) {
+			kheap_pageclass[chunk] = (uint8_t *)va;
+			kheap_npageclasschunks++;
+			va = 0;
+		}
+		spinlock_release(&kmalloc_spinlock);
+
+		if (va != 0) {
+			/* Oops, somebody else allocated it. */
+			free_kpages(va);
+		}
+	}
+	return true;
+}
+
+static
+void
+setpageclass(vaddr_t page, unsigned pageclass)
+{
+	KASSERT(page >= MIPS_KSEG0);
+	KASSERT(PAGECLASS_PAGE(page) < KHEAP_MAXPAGES);
+	KASSERT(kheap_pageclass[PAGECLASS_CHUNK(page)] != NULL);
+	kheap_pageclass[PAGECLASS_CHUNK(page)][PAGECLASS_PAGE(page) % PAGE_SIZE]
+		= pageclass;
+}
+
+static
+unsigned
+getpageclass(vaddr_t addr)
+{
+	uint8_t *chunk;
+
+	KASSERT(addr >= MIPS_KSEG0);
+	KASSERT(PAGECLASS_PAGE(addr) < KHEAP_MAXPAGES);
+	chunk = kheap_pageclass[PAGECLASS_CHUNK(addr)];
+	if (chunk == NULL) {
+		/* No page of the chunk ever joined the heap */
+		return 0;
+	}
+	return chunk[PAGECLASS_PAGE(addr) % PAGE_SIZE];
+}
+#else
+#define pageclass_ensure(page, npages) ((void)(page), (void)(npages), true)
+#define setpageclass(page, pageclass) ((void)(page), (void)(pageclass))
+#endif /* PAGECLASS */
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -588,14 +705,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(sc < npagerefs_inuse);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
+		KASSERT(ac < npagerefs_inuse);
 		ac++;
 	}
 
@@ -739,6 +856,156 @@ kheap_dumpall(void)
 
 ////////////////////////////////////////
 
+#if OPT_KMCACHE
+/*
+ * The caches are only listed for statistics: they are never removed,
+ * so once the head is read the list can be walked unlocked.
+ */
+static struct spinlock kmcache_listlock = SPINLOCK_INITIALIZER;
+static struct kmcache *kmcache_list = NULL;
+
+/*
+ * Initialize the empty caches of a new CPU.
+ */
+void
+kmcache_init(struct kmcache *kc, unsigned cpunum)
+{
+	unsigned i;
+
+	for (i=0; i<KMCACHE_NSIZES; i++) {
+		kc->kc_count[i] = 0;
+	}
+	kc->kc_hits = 0;
+	kc->kc_misses = 0;
+	kc->kc_flushes = 0;
+	kc->kc_cpu = cpunum;
+
+	spinlock_acquire(&kmcache_listlock);
+	kc->kc_next = kmcache_list;
+	kmcache_list = kc;
+	spinlock_release(&kmcache_listlock);
+}
+
+/*
+ * Print the hit rate of the caches of every CPU.
+ */
+static
+void
+kmcache_printstats(void)
+{
+	struct kmcache *kc;
+	unsigned i, total, cached;
+
+	spinlock_acquire(&kmcache_listlock);
+	kc = kmcache_list;
+	spinlock_release(&kmcache_listlock);
+
+	kprintf("Per-CPU caches:\n");
+	for (; kc != NULL; kc = kc->kc_next) {
+		total = kc->kc_hits + kc->kc_misses;
+		for (i=cached=0; i<KMCACHE_NSIZES; i++) {
+			cached += kc->kc_count[i];
+		}
+		kprintf("cpu%u: %u allocations, %u hits (%u%%), "
+			"%u flushes, %u cached blocks\n",
+			kc->kc_cpu, total, kc->kc_hits,
+			total == 0 ? 0 : (100 * kc->kc_hits + total / 2) / total,
+			kc->kc_flushes, cached);
+	}
+}
+#endif /* OPT_KMCACHE */
+
+////////////////////////////////////////
+
+#if OPT_KMCLASS
+/*
+ * A span of contiguous pages of a multi-page class holding more than
+ * one block.
+ */
+struct bigspan {
+	vaddr_t addr;			/* First page */
+	unsigned nfree;			/* Free blocks in the span */
+	struct bigspan *next;
+};
+
+/*
+ * State of a multi-page class, protected by kmalloc_spinlock.
+ */
+struct bigclass {
+	struct freelist *freelist;	/* Free blocks of all the spans */
+	unsigned nfree;			/* Blocks on the freelist */
+	struct bigspan *spans;		/* Spans with more than one block */
+	unsigned nspans;		/* Spans of the class */
+	unsigned ninuse;		/* Blocks handed out */
+	unsigned nallocs;		/* Allocations so far */
+	uint64_t reqbytes;		/* Bytes requested by them */
+};
+
+static struct bigclass bigclasses[NBIGSIZES];
+
+/* Free blocks of a class kept when their span could be released */
+#define BIG_KEEP 4
+
+#define BIG_PERSPAN(c) (bigpages[c] * PAGE_SIZE / bigsizes[c])
+
+/*
+ * Allocations of whole pages, beyond the multi-page classes or when
+ * these fail.
+ */
+static unsigned large_nallocs;		/* Allocations so far */
+static uint64_t large_reqbytes;		/* Bytes requested by them */
+static uint64_t large_bytes;		/* Bytes of the pages they got */
+static unsigned large_nwindow;		/* Ones mapped in the window */
+
+/*
+ * Percentage of ALLOCATED bytes not asked for.
+ */
+static
+unsigned
+wasteperc(uint64_t allocated, uint64_t requested)
+{
+	if (allocated == 0) {
+		return 0;
+	}
+	return (unsigned)((100 * (allocated - requested) + allocated / 2)
+			  / allocated);
+}
+
+/*
+ * Print the usage and the overhead of the multi-page classes and of
+ * the whole-page allocations.
+ */
+static
+void
+bigclass_printstats(void)
+{
+	struct bigclass *bc;
+	unsigned c;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	kprintf("Multi-page classes:\n");
+	for (c=0; c<NBIGSIZES; c++) {
+		bc = &bigclasses[c];
+		kprintf("%5zu bytes: %u spans (%u pages), %u in use, %u free, "
+			"%u allocations, %u%% wasted\n",
+			bigsizes[c], bc->nspans, bc->nspans * bigpages[c],
+			bc->ninuse, bc->nfree, bc->nallocs,
+			wasteperc((uint64_t)bc->nallocs * bigsizes[c],
+				  bc->reqbytes));
+	}
+	kprintf("Whole pages: %u allocations (%u in the window), "
+		"%u%% wasted\n", large_nallocs, large_nwindow,
+		wasteperc(large_bytes, large_reqbytes));
+
+	spinlock_release(&kmalloc_spinlock);
+
+#if OPT_KVMAP
+	kvmap_printstats();
+#endif
+}
+#endif /* OPT_KMCLASS */
+
 /*
  * Print the allocated/freed map of a single kernel heap page.
  */
@@ -811,7 +1078,26 @@ kheap_printstats(void)
 		subpage_stats(pr);
 	}
 
+	kprintf("Metadata: %u pageref pages (%u of %u pagerefs in use)",
+		npagerefpages, npagerefs_inuse,
+		npagerefpages * (unsigned)NPAGEREFS_PER_PAGE);
+#ifdef PAGECLASS
+	kprintf(", %u page class pages", kheap_npageclasschunks);
+	kprintf(", %u KiB\n",
+		(npagerefpages + kheap_npageclasschunks) * PAGE_SIZE / 1024);
+#else
+	kprintf(", %u KiB\n", npagerefpages * PAGE_SIZE / 1024);
+#endif
+
 	spinlock_release(&kmalloc_spinlock);
+
+#if OPT_KMCACHE
+	/* The blocks held by the caches are shown as allocated above */
+	kmcache_printstats();
+#endif
+#if OPT_KMCLASS
+	bigclass_printstats();
+#endif
 }
 
 ////////////////////////////////////////
@@ -971,6 +1257,10 @@ subpage_kmalloc(size_t sz
 		return NULL;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
+	if (!pageclass_ensure(prpage, 1)) {
+		free_kpages(prpage);
+		return NULL;
+	}
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
@@ -1013,20 +1303,24 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	setpageclass(prpage, blktype + 1);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Put a block back on the free list of its page. kmalloc_spinlock
+ * must be held. If the block is not on any heap page we recognize,
+ * return -1. If its page is now completely free, it's taken off the
+ * heap and *FREEPAGE is set to its address, to be released by the
+ * caller without kmalloc_spinlock; otherwise *FREEPAGE is set to 0.
  */
 static
 int
-subpage_kfree(void *ptr)
+subpage_putblock(void *ptr, vaddr_t ptraddr, vaddr_t *freepage)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
@@ -1036,32 +1330,9 @@ subpage_kfree(void *ptr)
 	size_t blocksize, smallerblocksize;
 #endif
 
-	ptraddr = (vaddr_t)ptr;
-#ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
-#endif
-#ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
-#endif
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	spinlock_acquire(&kmalloc_spinlock);
+	*freepage = 0;
 
 	checksubpages();
 
@@ -1085,7 +1356,6 @@ subpage_kfree(void *ptr)
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
@@ -1142,12 +1412,57 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		setpageclass(prpage, 0);
+		*freepage = prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	return 0;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// same as ptr
+	vaddr_t freepage;	// page left empty, if any
+	int result;
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+	result = subpage_putblock(ptr, ptraddr, &freepage);
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -1156,18 +1471,456 @@ subpage_kfree(void *ptr)
 	spinlock_release(&kmalloc_spinlock);
 #endif
 
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-CPU front-end.
+//
+//    Each CPU keeps a small stack of free blocks of each size in its
+//    struct cpu, touched only by that CPU with interrupts off, so
+//    kmalloc and kfree usually take no lock and write no shared
+//    memory. An empty stack is refilled with a batch of blocks taken
+//    from the heap pages at once, and a full one gives back a batch,
+//    so kmalloc_spinlock is taken once per batch. As far as the heap
+//    pages are concerned, the cached blocks are allocated.
+//
+//    A CPU keeps at most a page worth of blocks of each size, so the
+//    caches don't hold much memory hostage.
+//
+
+#ifdef KMCACHE
+#if KMCACHE_NSIZES != NSIZES
+#error "KMCACHE_NSIZES must match the subpage block sizes"
+#endif
+
+/*
+ * Number of free blocks of type BLKTYPE a CPU may keep.
+ */
+static
+unsigned
+kmcache_limit(unsigned blktype)
+{
+	unsigned n;
+
+	n = PAGE_SIZE / sizes[blktype];
+	return n < KMCACHE_SIZE ? n : KMCACHE_SIZE;
+}
+
+/*
+ * Take up to N free blocks of type BLKTYPE from the heap pages at
+ * once. If no page has a free block, subpage_kmalloc makes a new one.
+ * Returns the number of blocks obtained, 0 if out of memory.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, void **blocks, unsigned n)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+	struct freelist *fl;
+	unsigned got;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	got = 0;
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+
+		prpage = PR_PAGEADDR(pr);
+		while (pr->nfree > 0 && got < n) {
+			KASSERT(pr->freelist_offset < PAGE_SIZE);
+			fl = (struct freelist *)(prpage + pr->freelist_offset);
+			blocks[got++] = fl;
+			pr->nfree--;
+			if (fl->next != NULL) {
+				KASSERT(pr->nfree > 0);
+				pr->freelist_offset = (vaddr_t)fl->next - prpage;
+			}
+			else {
+				KASSERT(pr->nfree == 0);
+				pr->freelist_offset = INVALID_OFFSET;
+			}
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+
+	if (got == 0) {
+		blocks[0] = subpage_kmalloc(sizes[blktype]);
+		if (blocks[0] != NULL) {
+			got = 1;
+		}
+	}
+	return got;
+}
+
+/*
+ * Give back N blocks to their heap pages at once.
+ */
+static
+void
+subpage_putblocks(void *const *blocks, unsigned n)
+{
+	vaddr_t freepages[KMCACHE_SIZE];
+	unsigned i, nfreepages;
+	int result;
+
+	KASSERT(n <= KMCACHE_SIZE);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=nfreepages=0; i<n; i++) {
+		result = subpage_putblock(blocks[i], (vaddr_t)blocks[i],
+					  &freepages[nfreepages]);
+		KASSERT(result == 0);
+		if (freepages[nfreepages] != 0) {
+			nfreepages++;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Allocate a block of type BLKTYPE from the cache of the current CPU,
+ * refilling it if empty.
+ */
+static
+void *
+kmcache_alloc(unsigned blktype)
+{
+	struct kmcache *kc;
+	void *blocks[KMCACHE_SIZE];
+	void *ptr;
+	unsigned i, n, limit;
+	int spl;
+
+	spl = splhigh();
+	kc = &curcpu->c_kmcache;
+	if (kc->kc_count[blktype] > 0) {
+		kc->kc_hits++;
+		ptr = kc->kc_blocks[blktype][--kc->kc_count[blktype]];
+		splx(spl);
+		return ptr;
+	}
+	kc->kc_misses++;
+	splx(spl);
+
+	/* Refill with interrupts on, since a new page may be needed */
+	limit = kmcache_limit(blktype);
+	n = subpage_getblocks(blktype, blocks, DIVROUNDUP(limit, 2));
+	if (n == 0) {
+		return NULL;
+	}
+	ptr = blocks[--n];
+
+	/* We may have moved to another CPU, whose cache may be full */
+	spl = splhigh();
+	kc = &curcpu->c_kmcache;
+	for (i=0; i<n && kc->kc_count[blktype] < limit; i++) {
+		kc->kc_blocks[blktype][kc->kc_count[blktype]++] = blocks[i];
+	}
+	splx(spl);
+
+	if (i < n) {
+		subpage_putblocks(&blocks[i], n - i);
+	}
+	return ptr;
+}
+
+/*
+ * Free a block of type BLKTYPE to the cache of the current CPU,
+ * flushing half of it if full.
+ */
+static
+void
+kmcache_free(void *ptr, unsigned blktype)
+{
+	struct kmcache *kc;
+	void *blocks[KMCACHE_SIZE];
+	unsigned n, limit;
+	int spl;
+
+	if (((vaddr_t)ptr & ~PAGE_FRAME) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	limit = kmcache_limit(blktype);
+	n = 0;
+
+	spl = splhigh();
+	kc = &curcpu->c_kmcache;
+	if (kc->kc_count[blktype] == limit) {
+		kc->kc_flushes++;
+		n = DIVROUNDUP(limit, 2);
+		kc->kc_count[blktype] -= n;
+		memcpy(blocks, &kc->kc_blocks[blktype][kc->kc_count[blktype]],
+		       n * sizeof(blocks[0]));
+	}
+	kc->kc_blocks[blktype][kc->kc_count[blktype]++] = ptr;
+	splx(spl);
+
+	if (n > 0) {
+		subpage_putblocks(blocks, n);
+	}
+}
+#endif /* KMCACHE */
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Multi-page size classes.
+//
+//    Blocks from LARGEST_SUBPAGE_SIZE to LARGEST_BIG_SIZE are rounded
+//    up to the next class rather than to whole pages, and come from
+//    the free blocks of their class before new pages are asked for.
+//    The block type of their pages tells kfree the class. Anything
+//    bigger, or any class that can't get its contiguous pages, falls
+//    back on whole pages, and with OPT_KVMAP on single frames mapped
+//    in the kernel window when the pages can't be found contiguous.
+//
+
+#if OPT_KMCLASS
+/*
+ * Given a requested size, return the multi-page class to use.
+ */
+static
+unsigned
+bigtype(size_t sz)
+{
+	unsigned c;
+
+	for (c=0; c<NBIGSIZES; c++) {
+		if (sz <= bigsizes[c]) {
+			return c;
+		}
+	}
+
+	panic("Multi-page classes cannot handle allocation of size %zu\n",
+	      sz);
 	return 0;
 }
 
+/*
+ * Find the span of class C holding ADDR. kmalloc_spinlock must be held.
+ */
+static
+struct bigspan *
+bigspan_find(unsigned c, vaddr_t addr)
+{
+	struct bigspan *bs;
+
+	for (bs = bigclasses[c].spans; bs != NULL; bs = bs->next) {
+		if (addr >= bs->addr && addr < bs->addr + bigpages[c]*PAGE_SIZE) {
+			return bs;
+		}
+	}
+	panic("kfree: block %p not in any span of class %zu\n",
+	      (void *)addr, bigsizes[c]);
+	return NULL;
+}
+
+/*
+ * Allocate a block of size SZ from its multi-page class, making a new
+ * span if the class has no free block. Returns NULL if the span can't
+ * be allocated.
+ */
+static
+void *
+big_kmalloc(size_t sz)
+{
+	unsigned c, i, perspan;
+	struct bigclass *bc;
+	struct bigspan *bs;
+	struct freelist *fl;
+	vaddr_t span;
+
+	c = bigtype(sz);
+	bc = &bigclasses[c];
+	perspan = BIG_PERSPAN(c);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	fl = bc->freelist;
+	if (fl != NULL) {
+		bc->freelist = fl->next;
+		bc->nfree--;
+		if (perspan > 1) {
+			bigspan_find(c, (vaddr_t)fl)->nfree--;
+		}
+		bc->ninuse++;
+		bc->nallocs++;
+		bc->reqbytes += sz;
+		spinlock_release(&kmalloc_spinlock);
+		return fl;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Make a new span, without the lock as in subpage_kmalloc */
+	bs = NULL;
+	if (perspan > 1) {
+		bs = kmalloc(sizeof(*bs));
+		if (bs == NULL) {
+			return NULL;
+		}
+	}
+	span = alloc_kpages(bigpages[c]);
+	if (span == 0) {
+		kfree(bs);
+		return NULL;
+	}
+	KASSERT(span % PAGE_SIZE == 0);
+	if (!pageclass_ensure(span, bigpages[c])) {
+		free_kpages(span);
+		kfree(bs);
+		return NULL;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (bs != NULL) {
+		/* kfree may get any block of the span */
+		for (i=0; i<bigpages[c]; i++) {
+			setpageclass(span + i*PAGE_SIZE, NSIZES + c + 1);
+		}
+		bs->addr = span;
+		bs->nfree = perspan - 1;
+		bs->next = bc->spans;
+		bc->spans = bs;
+		for (i=perspan-1; i>0; i--) {
+			fl = (struct freelist *)(span + i*bigsizes[c]);
+			fl->next = bc->freelist;
+			bc->freelist = fl;
+		}
+		bc->nfree += perspan - 1;
+	}
+	else {
+		setpageclass(span, NSIZES + c + 1);
+	}
+	bc->nspans++;
+	bc->ninuse++;
+	bc->nallocs++;
+	bc->reqbytes += sz;
+	spinlock_release(&kmalloc_spinlock);
+
+	return (void *)span;
+}
+
+/*
+ * Free a block of multi-page class C. A span left with no block in use
+ * is released, unless its class would be left with less than BIG_KEEP
+ * free blocks.
+ */
+static
+void
+big_kfree(void *ptr, unsigned c)
+{
+	unsigned i, perspan;
+	struct bigclass *bc;
+	struct bigspan *bs, **pbs;
+	struct freelist *fl, **pfl;
+	vaddr_t addr, span;
+
+	addr = (vaddr_t)ptr;
+	bc = &bigclasses[c];
+	perspan = BIG_PERSPAN(c);
+	span = 0;
+	bs = NULL;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	if (perspan > 1) {
+		bs = bigspan_find(c, addr);
+		if ((addr - bs->addr) % bigsizes[c] != 0) {
+			panic("kfree: invalid multi-page block %p\n", ptr);
+		}
+	}
+	else if (addr % PAGE_SIZE != 0) {
+		panic("kfree: invalid multi-page block %p\n", ptr);
+	}
+
+	fl = ptr;
+	fl->next = bc->freelist;
+	bc->freelist = fl;
+	bc->nfree++;
+	KASSERT(bc->ninuse > 0);
+	bc->ninuse--;
+
+	if (bs == NULL) {
+		if (bc->nfree > BIG_KEEP) {
+			bc->freelist = fl->next;
+			bc->nfree--;
+			bc->nspans--;
+			setpageclass(addr, 0);
+			span = addr;
+		}
+	}
+	else if (++bs->nfree == perspan && bc->nfree - perspan >= BIG_KEEP) {
+		/* Take the blocks of the span off the freelist */
+		for (pfl = &bc->freelist; *pfl != NULL; ) {
+			if ((vaddr_t)*pfl >= bs->addr &&
+			    (vaddr_t)*pfl < bs->addr + bigpages[c]*PAGE_SIZE) {
+				*pfl = (*pfl)->next;
+			}
+			else {
+				pfl = &(*pfl)->next;
+			}
+		}
+		bc->nfree -= perspan;
+		for (pbs = &bc->spans; *pbs != bs; pbs = &(*pbs)->next) {
+			KASSERT(*pbs != NULL);
+		}
+		*pbs = bs->next;
+		bc->nspans--;
+		for (i=0; i<bigpages[c]; i++) {
+			setpageclass(bs->addr + i*PAGE_SIZE, 0);
+		}
+		span = bs->addr;
+	}
+	else {
+		bs = NULL;
+	}
+
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	if (span != 0) {
+		free_kpages(span);
+		kfree(bs);
+	}
+}
+#endif /* OPT_KMCLASS */
+
 //
 ////////////////////////////////////////////////////////////
 
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
  * alloc_kpages depending on how big SZ is.
+ *
+ * With the profiler this is kheap_alloc, wrapped by kmalloc below,
+ * and the call site comes from the wrapper.
  */
+#if OPT_KMPROF
+static
+void *
+kheap_alloc(size_t sz, vaddr_t caller)
+#else
 void *
 kmalloc(size_t sz)
+#endif
 {
 	size_t checksz;
 #ifdef LABELS
@@ -1175,29 +1928,69 @@ kmalloc(size_t sz)
 #endif
 
 #ifdef LABELS
-#ifdef __GNUC__
+#if OPT_KMPROF
+	label = caller;
+#elif defined(__GNUC__)
 	label = (vaddr_t)__builtin_return_address(0);
 #else
 #error "Don't know how to get return address with this compiler"
 #endif /* __GNUC__ */
+#elif OPT_KMPROF
+	(void)caller;
 #endif /* LABELS */
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
+#if OPT_KMCLASS
+		void *ptr;
+
+		if (sz <= LARGEST_BIG_SIZE) {
+			ptr = big_kmalloc(sz);
+			if (ptr != NULL) {
+				return ptr;
+			}
+			/* No contiguous span, try with whole pages */
+		}
+#endif
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
+#if OPT_KVMAP
+		if (address==0 && npages > 1) {
+			/* Too fragmented, map single frames instead */
+			address = kvmap_alloc(npages);
+		}
+#endif
 		if (address==0) {
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
 
+#if OPT_KMCLASS
+		spinlock_acquire(&kmalloc_spinlock);
+		large_nallocs++;
+		large_reqbytes += sz;
+		large_bytes += npages * PAGE_SIZE;
+#if OPT_KVMAP
+		if (kvmap_owns(address)) {
+			large_nwindow++;
+		}
+#endif
+		spinlock_release(&kmalloc_spinlock);
+#endif
+
 		return (void *)address;
 	}
 
+#ifdef KMCACHE
+	if (CURCPU_EXISTS()) {
+		return kmcache_alloc(blocktype(sz));
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1205,18 +1998,79 @@ kmalloc(size_t sz)
 #endif
 }
 
+#if OPT_KMPROF
+/*
+ * Allocate a block of size SZ, charging it to the caller.
+ */
+void *
+kmalloc(size_t sz)
+{
+	vaddr_t caller;
+	void *ptr;
+
+#ifdef __GNUC__
+	caller = (vaddr_t)__builtin_return_address(0);
+#else
+#error "Don't know how to get return address with this compiler"
+#endif /* __GNUC__ */
+
+	ptr = kheap_alloc(sz, caller);
+	kmprof_alloc(caller, ptr, sz);
+	return ptr;
+}
+#endif /* OPT_KMPROF */
+
 /*
  * Free a block previously returned from kmalloc.
  */
 void
 kfree(void *ptr)
 {
+#ifdef PAGECLASS
+	unsigned pageclass;
+#endif
+
+	if (ptr == NULL) {
+		return;
+	}
+
+#if OPT_KMPROF
+	kmprof_free(ptr);
+#endif
+
+#if OPT_KVMAP
+	if (kvmap_owns((vaddr_t)ptr)) {
+		kvmap_free((vaddr_t)ptr);
+		return;
+	}
+#endif
+
+#ifdef PAGECLASS
+	/* No need to look for the page under the lock */
+	pageclass = getpageclass((vaddr_t)ptr);
+#if OPT_KMCLASS
+	if (pageclass > NSIZES) {
+		big_kfree(ptr, pageclass - NSIZES - 1);
+		return;
+	}
+#endif
+#ifdef KMCACHE
+	if (CURCPU_EXISTS()) {
+		if (pageclass > 0) {
+			kmcache_free(ptr, pageclass - 1);
+		} else {
+			KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+			free_kpages((vaddr_t)ptr);
+		}
+		return;
+	}
+#endif
+#endif /* PAGECLASS */
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
-	if (ptr == NULL) {
-		return;
-	} else if (subpage_kfree(ptr)) {
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,370 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <kmprof.h>
+
+/*
+ * Counters of a call site.
+ */
+struct kmprof_site {
+  vaddr_t   ks_site;                    /* Return address, 0 if unused    */
+  unsigned  ks_allocs;                  /* Successful allocations         */
+  unsigned  ks_failures;                /* Allocations that failed        */
+  unsigned  ks_frees;                   /* Followed blocks freed          */
+  unsigned  ks_live;                    /* Followed blocks not freed yet  */
+  uint64_t  ks_bytes;                   /* Bytes requested                */
+  unsigned  ks_sizes[KMPROF_NBUCKETS];  /* Histogram of the sizes         */
+  uint64_t  ks_lifetime;                /* Total lifetime of the freed blocks */
+  uint32_t  ks_maxlife;                 /* Longest lifetime               */
+};
+
+/*
+ * A block followed to its kfree, in an open addressing hash table.
+ */
+struct kmprof_live {
+  vaddr_t   kl_ptr;                     /* Block, 0 if the slot is empty  */
+  unsigned  kl_site;                    /* Index of the call site         */
+  uint32_t  kl_time;                    /* Allocation time (wraps)        */
+};
+
+#define KMPROF_MASK       (KMPROF_NLIVE - 1)
+#define KMPROF_MAXLIVE    (KMPROF_NLIVE - KMPROF_NLIVE / 4)
+#define KMPROF_MAXPRINT   32
+
+#define KMPROF_HASH(x)    (((uint32_t)(x) >> 3) * 2654435761U)
+
+/*
+ * The tables are allocated by the first kmprof_start, and never freed.
+ * kmprof_on is read without the lock by kmalloc, so that a stopped
+ * profiler costs just that.
+ */
+static struct spinlock kmprof_lock = SPINLOCK_INITIALIZER;
+static volatile bool kmprof_on = false;
+static struct kmprof_site *kmprof_sites = NULL;
+static struct kmprof_live *kmprof_live = NULL;
+static unsigned kmprof_nlive = 0;
+static unsigned kmprof_lost = 0;        /* Allocations of untracked sites */
+static unsigned kmprof_unfollowed = 0;  /* Blocks not followed to kfree   */
+
+/*
+ * Current time in microseconds, wrapping every 71 minutes.
+ */
+static
+uint32_t
+kmprof_now(void)
+{
+  struct timespec ts;
+
+  gettime(&ts);
+  return (uint32_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Size bucket of SZ: up to 16, 32, ..., 16K bytes, then bigger.
+ */
+static
+unsigned
+kmprof_bucket(size_t sz)
+{
+  unsigned b;
+  size_t limit;
+
+  for (b = 0, limit = 16; sz > limit && b < KMPROF_NBUCKETS - 1; b++) {
+    limit <<= 1;
+  }
+  return b;
+}
+
+/*
+ * Find the counters of a call site, taking a free entry if it's new.
+ * The lock must be held. Returns -1 if the table is full.
+ */
+static
+int
+kmprof_findsite(vaddr_t site)
+{
+  unsigned i, n;
+
+  i = KMPROF_HASH(site) % KMPROF_NSITES;
+  for (n = 0; n < KMPROF_NSITES; n++, i = (i + 1) % KMPROF_NSITES) {
+    if (kmprof_sites[i].ks_site == site) {
+      return i;
+    }
+    if (kmprof_sites[i].ks_site == 0) {
+      kmprof_sites[i].ks_site = site;
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Empty slot I of the table of live blocks, moving back the following
+ * entries that would not be found anymore. The lock must be held.
+ */
+static
+void
+kmprof_unlink(unsigned i)
+{
+  unsigned j, home;
+
+  kmprof_live[i].kl_ptr = 0;
+  kmprof_nlive--;
+
+  for (j = (i + 1) & KMPROF_MASK; kmprof_live[j].kl_ptr != 0;
+       j = (j + 1) & KMPROF_MASK) {
+    home = KMPROF_HASH(kmprof_live[j].kl_ptr) & KMPROF_MASK;
+    /* Move it unless its home slot is cyclically in (i, j] */
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      kmprof_live[i] = kmprof_live[j];
+      kmprof_live[j].kl_ptr = 0;
+      i = j;
+    }
+  }
+}
+
+/**
+ * Start profiling
+ * @return    0 on success, ENOMEM if the tables can't be allocated
+ */
+int
+kmprof_start(void)
+{
+  struct kmprof_site *sites;
+  struct kmprof_live *live;
+
+  if (kmprof_sites == NULL) {
+    /* Allocated while stopped, so not profiled */
+    sites = kmalloc(KMPROF_NSITES * sizeof(*sites));
+    live = kmalloc(KMPROF_NLIVE * sizeof(*live));
+    if (sites == NULL || live == NULL) {
+      kfree(sites);
+      kfree(live);
+      return ENOMEM;
+    }
+    bzero(sites, KMPROF_NSITES * sizeof(*sites));
+    bzero(live, KMPROF_NLIVE * sizeof(*live));
+
+    spinlock_acquire(&kmprof_lock);
+    if (kmprof_sites == NULL) {
+      kmprof_sites = sites;
+      kmprof_live = live;
+      sites = NULL;
+      live = NULL;
+    }
+    spinlock_release(&kmprof_lock);
+
+    /* Somebody else was faster */
+    kfree(sites);
+    kfree(live);
+  }
+
+  kmprof_on = true;
+  return 0;
+}
+
+/**
+ * Stop profiling. The blocks already followed are still followed to
+ * their kfree.
+ */
+void
+kmprof_stop(void)
+{
+  kmprof_on = false;
+}
+
+/**
+ * Forget what was recorded
+ */
+void
+kmprof_reset(void)
+{
+  spinlock_acquire(&kmprof_lock);
+  if (kmprof_sites != NULL) {
+    bzero(kmprof_sites, KMPROF_NSITES * sizeof(*kmprof_sites));
+    bzero(kmprof_live, KMPROF_NLIVE * sizeof(*kmprof_live));
+  }
+  kmprof_nlive = 0;
+  kmprof_lost = 0;
+  kmprof_unfollowed = 0;
+  spinlock_release(&kmprof_lock);
+}
+
+/**
+ * Charge an allocation to its call site
+ * @param site    Return address in the caller of kmalloc
+ * @param ptr     Block allocated, NULL if the allocation failed
+ * @param sz      Size requested
+ */
+void
+kmprof_alloc(vaddr_t site, void *ptr, size_t sz)
+{
+  struct kmprof_site *ks;
+  uint32_t now;
+  unsigned i;
+  int s;
+
+  if (!kmprof_on) {
+    return;
+  }
+  now = kmprof_now();
+
+  spinlock_acquire(&kmprof_lock);
+
+  s = kmprof_findsite(site);
+  if (s < 0) {
+    kmprof_lost++;
+    spinlock_release(&kmprof_lock);
+    return;
+  }
+  ks = &kmprof_sites[s];
+
+  if (ptr == NULL) {
+    ks->ks_failures++;
+    spinlock_release(&kmprof_lock);
+    return;
+  }
+  ks->ks_allocs++;
+  ks->ks_bytes += sz;
+  ks->ks_sizes[kmprof_bucket(sz)]++;
+
+  if (kmprof_nlive < KMPROF_MAXLIVE) {
+    for (i = KMPROF_HASH(ptr) & KMPROF_MASK; kmprof_live[i].kl_ptr != 0;
+         i = (i + 1) & KMPROF_MASK) {
+      KASSERT(kmprof_live[i].kl_ptr != (vaddr_t)ptr);
+    }
+    kmprof_live[i].kl_ptr = (vaddr_t)ptr;
+    kmprof_live[i].kl_site = s;
+    kmprof_live[i].kl_time = now;
+    kmprof_nlive++;
+    ks->ks_live++;
+  } else {
+    kmprof_unfollowed++;
+  }
+
+  spinlock_release(&kmprof_lock);
+}
+
+/**
+ * Record the end of the lifetime of a block, if it was followed
+ * @param ptr     Block being freed
+ */
+void
+kmprof_free(void *ptr)
+{
+  struct kmprof_site *ks;
+  uint32_t life;
+  unsigned i;
+
+  if (kmprof_nlive == 0) {
+    return;
+  }
+
+  spinlock_acquire(&kmprof_lock);
+  if (kmprof_live != NULL) {
+    for (i = KMPROF_HASH(ptr) & KMPROF_MASK; kmprof_live[i].kl_ptr != 0;
+         i = (i + 1) & KMPROF_MASK) {
+      if (kmprof_live[i].kl_ptr != (vaddr_t)ptr) {
+        continue;
+      }
+      ks = &kmprof_sites[kmprof_live[i].kl_site];
+      life = kmprof_now() - kmprof_live[i].kl_time;
+      ks->ks_frees++;
+      ks->ks_live--;
+      ks->ks_lifetime += life;
+      if (life > ks->ks_maxlife) {
+        ks->ks_maxlife = life;
+      }
+      kmprof_unlink(i);
+      break;
+    }
+  }
+  spinlock_release(&kmprof_lock);
+}
+
+/**
+ * Print the call sites that allocated the most bytes
+ * @param n   Number of sites to print, at most 32
+ */
+void
+kmprof_print(unsigned n)
+{
+  struct kmprof_site *ks;
+  int top[KMPROF_MAXPRINT];
+  unsigned i, j, b, nsites;
+  int best;
+
+  if (n > KMPROF_MAXPRINT) {
+    n = KMPROF_MAXPRINT;
+  }
+
+  spinlock_acquire(&kmprof_lock);
+
+  if (kmprof_sites == NULL) {
+    spinlock_release(&kmprof_lock);
+    kprintf("kmalloc profiler never started\n");
+    return;
+  }
+
+  for (i = nsites = 0; i < KMPROF_NSITES; i++) {
+    if (kmprof_sites[i].ks_site != 0) {
+      nsites++;
+    }
+  }
+  kprintf("kmalloc profile (%s): %u call sites, %u live blocks followed, "
+          "%u not followed, %u allocations of untracked sites\n",
+          kmprof_on ? "running" : "stopped", nsites, kmprof_nlive,
+          kmprof_unfollowed, kmprof_lost);
+
+  /* Selection of the biggest ones, the table is small */
+  for (i = 0; i < n; i++) {
+    best = -1;
+    for (j = 0; j < KMPROF_NSITES; j++) {
+      if (kmprof_sites[j].ks_site == 0) {
+        continue;
+      }
+      for (b = 0; b < i && top[b] != (int)j; b++);
+      if (b < i) {
+        continue;
+      }
+      if (best < 0 || kmprof_sites[j].ks_bytes > kmprof_sites[best].ks_bytes) {
+        best = j;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    top[i] = best;
+  }
+  n = i;
+
+  kprintf("site        allocs  fails   frees    live       bytes   avg "
+          "avg life  max life (usec)\n");
+  for (i = 0; i < n; i++) {
+    ks = &kmprof_sites[top[i]];
+    kprintf("0x%08x %7u %6u %7u %7u %11llu %5u %9u %9u\n",
+            ks->ks_site, ks->ks_allocs, ks->ks_failures, ks->ks_frees,
+            ks->ks_live, (unsigned long long)ks->ks_bytes,
+            ks->ks_allocs == 0 ? 0 :
+              (unsigned)(ks->ks_bytes / ks->ks_allocs),
+            ks->ks_frees == 0 ? 0 :
+              (unsigned)(ks->ks_lifetime / ks->ks_frees),
+            ks->ks_maxlife);
+    kprintf("           sizes:");
+    for (b = 0; b < KMPROF_NBUCKETS; b++) {
+      if (ks->ks_sizes[b] == 0) {
+        continue;
+      }
+      if (b < KMPROF_NBUCKETS - 1) {
+        kprintf(" <=%u:%u", 16U << b, ks->ks_sizes[b]);
+      } else {
+        kprintf(" >%u:%u", 16U << (b - 1), ks->ks_sizes[b]);
+      }
+    }
+    kprintf("\n");
+  }
+
+  spinlock_release(&kmprof_lock);
+}
@@ -0,0 +1,313 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <thread.h>
+#include <vm.h>
+#include <kvmap.h>
+#if OPT_WORKQUEUE
+#include <workqueue.h>
+#endif
+
+/*
+ * Each page of the window holds the physical address of its frame, or
+ * one of the values below: frames are never at physical address 0,
+ * where the kernel is loaded.
+ */
+#define KV_FREE       0     /* Unused since the last purge            */
+#define KV_STALE      1     /* Freed, may still be in the TLB of a CPU */
+#define KV_PURGING    2     /* Stale, being shot down                 */
+#define KV_RESERVED   3     /* Allocated, frame not loaded yet        */
+
+#define KV_MAPPED(e)  ((e) >= PAGE_SIZE)
+
+#define KV_INDEX(va)  (((va) - KVMAP_BASE) / PAGE_SIZE)
+
+/* Stale pages that get purged in the background */
+#define KV_PURGE_STALE  (KVMAP_NPAGES / 4)
+
+/*
+ * The lock also covers the loading of the TLB in kvmap_fault, that
+ * can't then race with a purge.
+ */
+static struct spinlock kvmap_lock = SPINLOCK_INITIALIZER;
+static paddr_t kvmap_pt[KVMAP_NPAGES];
+static uint16_t kvmap_len[KVMAP_NPAGES];  /* Pages of the block starting here */
+static bool kvmap_purging = false;
+
+static unsigned kvmap_nused = 0;          /* Pages of live blocks   */
+static unsigned kvmap_nstale = 0;         /* Pages waiting a purge  */
+static unsigned kvmap_peak = 0;           /* Highest kvmap_nused    */
+static unsigned kvmap_nallocs = 0;        /* Blocks handed out      */
+static unsigned kvmap_npurges = 0;        /* Window shootdowns      */
+
+#if OPT_WORKQUEUE
+static void kvmap_purgework(void *arg);
+static struct work kvmap_work = WORK_INITIALIZER(kvmap_purgework, NULL);
+#endif
+
+/*
+ * Find the first run of NPAGES free pages. The lock must be held.
+ * Returns the index of the first page, -1 if there's none.
+ */
+static
+int
+kvmap_findrun(unsigned npages)
+{
+  unsigned i, run;
+
+  for (i = run = 0; i < KVMAP_NPAGES; i++) {
+    if (kvmap_pt[i] != KV_FREE) {
+      run = 0;
+      continue;
+    }
+    if (++run == npages) {
+      return i + 1 - npages;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Make the stale pages usable again, shooting down the whole window on
+ * every CPU. Gives up if the current thread can't sleep or somebody is
+ * purging already.
+ * @return    true if some pages were made free
+ */
+static
+bool
+kvmap_purge(void)
+{
+  unsigned i, n;
+  int result;
+
+  if (!CURCPU_EXISTS() || curthread->t_in_interrupt ||
+      curcpu->c_spinlocks > 0) {
+    return false;
+  }
+
+  spinlock_acquire(&kvmap_lock);
+  if (kvmap_purging) {
+    spinlock_release(&kvmap_lock);
+    return false;
+  }
+  kvmap_purging = true;
+  for (i = 0; i < KVMAP_NPAGES; i++) {
+    if (kvmap_pt[i] == KV_STALE) {
+      kvmap_pt[i] = KV_PURGING;
+    }
+  }
+  spinlock_release(&kvmap_lock);
+
+  result = vm_tlb_shootdown(NULL, KVMAP_BASE, KVMAP_NPAGES);
+
+  spinlock_acquire(&kvmap_lock);
+  for (i = n = 0; i < KVMAP_NPAGES; i++) {
+    if (kvmap_pt[i] == KV_PURGING) {
+      kvmap_pt[i] = result ? KV_STALE : KV_FREE;
+      n++;
+    }
+  }
+  if (!result) {
+    kvmap_nstale -= n;
+    kvmap_npurges++;
+  }
+  kvmap_purging = false;
+  spinlock_release(&kvmap_lock);
+
+  return !result && n > 0;
+}
+
+#if OPT_WORKQUEUE
+/*
+ * Purge from a worker, so that kvmap_alloc seldom finds the window
+ * full and has to wait for the shootdown.
+ */
+static
+void
+kvmap_purgework(void *arg)
+{
+  (void)arg;
+  kvmap_purge();
+}
+#endif
+
+/**
+ * Map new frames on consecutive pages of the window
+ * @param npages  Number of pages
+ * @return        Address of the first page, 0 if out of memory or if
+ *                there's no room in the window
+ */
+vaddr_t
+kvmap_alloc(unsigned npages)
+{
+  vaddr_t frame;
+  unsigned i;
+  int start;
+
+  KASSERT(npages > 0);
+  if (npages > KVMAP_NPAGES) {
+    return 0;
+  }
+
+  spinlock_acquire(&kvmap_lock);
+  start = kvmap_findrun(npages);
+  if (start < 0 && kvmap_nstale > 0) {
+    spinlock_release(&kvmap_lock);
+    if (!kvmap_purge()) {
+      return 0;
+    }
+    spinlock_acquire(&kvmap_lock);
+    start = kvmap_findrun(npages);
+  }
+  if (start < 0) {
+    spinlock_release(&kvmap_lock);
+    return 0;
+  }
+  for (i = 0; i < npages; i++) {
+    kvmap_pt[start + i] = KV_RESERVED;
+  }
+  kvmap_len[start] = npages;
+  kvmap_nused += npages;
+  if (kvmap_nused > kvmap_peak) {
+    kvmap_peak = kvmap_nused;
+  }
+  spinlock_release(&kvmap_lock);
+
+  /* Get the frames one by one, they needn't be contiguous */
+  for (i = 0; i < npages; i++) {
+    frame = alloc_kpages(1);
+    if (frame == 0) {
+      break;
+    }
+    spinlock_acquire(&kvmap_lock);
+    kvmap_pt[start + i] = frame - MIPS_KSEG0;
+    spinlock_release(&kvmap_lock);
+  }
+
+  if (i < npages) {
+    /* Out of memory. The pages were never seen, no need for a purge */
+    while (i-- > 0) {
+      free_kpages(PADDR_TO_KVADDR(kvmap_pt[start + i]));
+    }
+    spinlock_acquire(&kvmap_lock);
+    for (i = 0; i < npages; i++) {
+      kvmap_pt[start + i] = KV_FREE;
+    }
+    kvmap_len[start] = 0;
+    kvmap_nused -= npages;
+    spinlock_release(&kvmap_lock);
+    return 0;
+  }
+
+  spinlock_acquire(&kvmap_lock);
+  kvmap_nallocs++;
+  spinlock_release(&kvmap_lock);
+
+  return KVMAP_BASE + start * PAGE_SIZE;
+}
+
+/**
+ * Release a block of the window. The frames are freed at once, the
+ * pages when the window is next purged.
+ * @param vaddr   Address returned by kvmap_alloc
+ */
+void
+kvmap_free(vaddr_t vaddr)
+{
+  paddr_t paddr;
+  unsigned i, idx, npages, nstale;
+
+  KASSERT(kvmap_owns(vaddr));
+  idx = KV_INDEX(vaddr);
+
+  spinlock_acquire(&kvmap_lock);
+  npages = kvmap_len[idx];
+  if (vaddr % PAGE_SIZE != 0 || npages == 0) {
+    spinlock_release(&kvmap_lock);
+    panic("kfree: invalid large block %p\n", (void *)vaddr);
+  }
+  kvmap_len[idx] = 0;
+  spinlock_release(&kvmap_lock);
+
+  for (i = 0; i < npages; i++) {
+    spinlock_acquire(&kvmap_lock);
+    paddr = kvmap_pt[idx + i];
+    KASSERT(KV_MAPPED(paddr));
+    kvmap_pt[idx + i] = KV_STALE;
+    spinlock_release(&kvmap_lock);
+
+    free_kpages(PADDR_TO_KVADDR(paddr));
+  }
+
+  spinlock_acquire(&kvmap_lock);
+  kvmap_nused -= npages;
+  kvmap_nstale += npages;
+  nstale = kvmap_nstale;
+  spinlock_release(&kvmap_lock);
+
+#if OPT_WORKQUEUE
+  /* Frees in a row make one purge */
+  if (nstale >= KV_PURGE_STALE && CURCPU_EXISTS()) {
+    work_queue(&kvmap_work);
+  }
+#else
+  (void)nstale;
+#endif
+}
+
+/**
+ * Tell whether an address is in the window
+ * @param vaddr   Kernel virtual address
+ * @return        true if in the window
+ */
+bool
+kvmap_owns(vaddr_t vaddr)
+{
+  return vaddr >= KVMAP_BASE &&
+         (vaddr - KVMAP_BASE) / PAGE_SIZE < KVMAP_NPAGES;
+}
+
+/**
+ * Handle a TLB miss on the window, called by vm_fault
+ * @param vaddr   Faulting page
+ * @return        0 on success, EFAULT if the page is not mapped
+ */
+int
+kvmap_fault(vaddr_t vaddr)
+{
+  paddr_t paddr;
+
+  if (!kvmap_owns(vaddr)) {
+    return EFAULT;
+  }
+
+  spinlock_acquire(&kvmap_lock);
+  paddr = kvmap_pt[KV_INDEX(vaddr)];
+  if (!KV_MAPPED(paddr)) {
+    spinlock_release(&kvmap_lock);
+    return EFAULT;
+  }
+  vm_tlb_loadglobal(vaddr & PAGE_FRAME, paddr);
+  spinlock_release(&kvmap_lock);
+
+  return 0;
+}
+
+/**
+ * Print the usage of the window
+ */
+void
+kvmap_printstats(void)
+{
+  spinlock_acquire(&kvmap_lock);
+  kprintf("Window: %u of %u pages in use (peak %u), %u stale, "
+          "%u blocks mapped, %u purges\n",
+          kvmap_nused, KVMAP_NPAGES, kvmap_peak, kvmap_nstale,
+          kvmap_nallocs, kvmap_npurges);
+  spinlock_release(&kvmap_lock);
+  kprintf("Window page table: %u bytes\n",
+          (unsigned)(sizeof(kvmap_pt) + sizeof(kvmap_len)));
+}
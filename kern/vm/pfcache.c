@@ -0,0 +1,222 @@
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <thread.h>
+#include <membar.h>
+#include <vm.h>
+#include <pfcache.h>
+
+/*
+ * The caches are only touched by their own CPU with interrupts off. The
+ * list of all the caches is only used for statistics: caches are never
+ * removed, so once the head is read the list can be walked unlocked.
+ */
+static struct spinlock pfcache_listlock = SPINLOCK_INITIALIZER;
+static struct pfcache *pfcache_list = NULL;
+static unsigned pfcache_flushgen = 0;    /* Calls to pfcache_flushall */
+
+/**
+ * Initialize an empty cache
+ * @param pc        Cache of a new CPU
+ * @param cpunum    Number of the CPU
+ */
+void
+pfcache_init(struct pfcache *pc, unsigned cpunum)
+{
+  pc->pc_count = 0;
+  pc->pc_hits = 0;
+  pc->pc_misses = 0;
+  pc->pc_drains = 0;
+  pc->pc_flushes = 0;
+  pc->pc_flushgen = 0;
+  pc->pc_cpu = cpunum;
+
+  spinlock_acquire(&pfcache_listlock);
+  pc->pc_next = pfcache_list;
+  pfcache_list = pc;
+  spinlock_release(&pfcache_listlock);
+}
+
+/**
+ * Take a free frame from the cache of the current CPU
+ * @return    Physical address of the frame, 0 if out of memory
+ */
+paddr_t
+pfcache_get(void)
+{
+  struct pfcache *pc;
+  paddr_t paddr;
+  int spl;
+
+  if (!CURCPU_EXISTS()) {
+    return 0;
+  }
+
+  spl = splhigh();
+  pc = &curcpu->c_pfcache;
+
+  if (pc->pc_count > 0) {
+    pc->pc_hits++;
+  } else {
+    pc->pc_misses++;
+    pc->pc_count = vm_getframes(pc->pc_frames, PFCACHE_BATCH);
+    if (pc->pc_count == 0) {
+      splx(spl);
+      return 0;
+    }
+  }
+  paddr = pc->pc_frames[--pc->pc_count];
+
+  splx(spl);
+  return paddr;
+}
+
+/**
+ * Give back a frame to the cache of the current CPU
+ * @param paddr   Physical address of the frame
+ * @return        true on success, false if the frame must be released
+ *                to the global pool by the caller
+ */
+bool
+pfcache_put(paddr_t paddr)
+{
+  struct pfcache *pc;
+  int spl;
+
+  if (!CURCPU_EXISTS()) {
+    return false;
+  }
+
+  spl = splhigh();
+  pc = &curcpu->c_pfcache;
+
+  if (pc->pc_count == PFCACHE_SIZE) {
+    pc->pc_drains++;
+    pc->pc_count -= PFCACHE_BATCH;
+    vm_putframes(&pc->pc_frames[pc->pc_count], PFCACHE_BATCH);
+  }
+  pc->pc_frames[pc->pc_count++] = paddr;
+
+  splx(spl);
+  return true;
+}
+
+/**
+ * Give back every frame of the cache of the current CPU to the global pool.
+ * Also called on IPI_PFFLUSH.
+ */
+void
+pfcache_flush(void)
+{
+  struct pfcache *pc;
+  unsigned gen;
+  int spl;
+
+  if (!CURCPU_EXISTS()) {
+    return;
+  }
+
+  spl = splhigh();
+  pc = &curcpu->c_pfcache;
+
+  /* Read before flushing, so that a later request isn't taken as served */
+  spinlock_acquire(&pfcache_listlock);
+  gen = pfcache_flushgen;
+  spinlock_release(&pfcache_listlock);
+
+  if (pc->pc_count > 0) {
+    pc->pc_flushes++;
+    vm_putframes(pc->pc_frames, pc->pc_count);
+    pc->pc_count = 0;
+  }
+  membar_store_store();
+  pc->pc_flushgen = gen;
+
+  splx(spl);
+}
+
+/**
+ * Give back the frames of the caches of all the CPUs. The other CPUs flush
+ * their own cache on IPI_PFFLUSH; they're waited for only if interrupts
+ * are on here, otherwise one of them may be waiting for this CPU too, and
+ * their frames come back later.
+ */
+void
+pfcache_flushall(void)
+{
+  struct pfcache *pc;
+  volatile struct pfcache *vpc;
+  unsigned gen;
+
+  pfcache_flush();
+
+  spinlock_acquire(&pfcache_listlock);
+  gen = ++pfcache_flushgen;
+  pc = pfcache_list;
+  spinlock_release(&pfcache_listlock);
+
+  ipi_broadcast(IPI_PFFLUSH);
+
+  if (!CURCPU_EXISTS() || curthread->t_in_interrupt ||
+      curthread->t_iplhigh_count > 0) {
+    return;
+  }
+  for (; pc != NULL; pc = pc->pc_next) {
+    if (pc == &curcpu->c_pfcache) {
+      continue;
+    }
+    /* An empty cache has nothing to give back, or its CPU is not up */
+    vpc = pc;
+    while (vpc->pc_count > 0 && vpc->pc_flushgen < gen) {
+      membar_load_load();
+    }
+  }
+}
+
+/**
+ * Count the frames held by the caches of all the CPUs. The result is
+ * approximated, since the other CPUs are not stopped.
+ * @return    Number of cached frames
+ */
+unsigned
+pfcache_ncached(void)
+{
+  struct pfcache *pc;
+  unsigned n;
+
+  spinlock_acquire(&pfcache_listlock);
+  pc = pfcache_list;
+  spinlock_release(&pfcache_listlock);
+
+  for (n = 0; pc != NULL; pc = pc->pc_next) {
+    n += pc->pc_count;
+  }
+
+  return n;
+}
+
+/**
+ * Print the statistics of the caches of all the CPUs
+ */
+void
+pfcache_printstats(void)
+{
+  struct pfcache *pc;
+  unsigned total;
+
+  spinlock_acquire(&pfcache_listlock);
+  pc = pfcache_list;
+  spinlock_release(&pfcache_listlock);
+
+  for (; pc != NULL; pc = pc->pc_next) {
+    total = pc->pc_hits + pc->pc_misses;
+    kprintf("cpu%u: %u allocations, %u hits (%u%%), %u drains, "
+            "%u flushes, %u cached\n",
+            pc->pc_cpu, total, pc->pc_hits,
+            total == 0 ? 0 : (100 * pc->pc_hits + total / 2) / total,
+            pc->pc_drains, pc->pc_flushes, pc->pc_count);
+  }
+}
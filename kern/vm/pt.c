@@ -0,0 +1,192 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pt.h>
+#if OPT_SWAP
+#include <swap.h>
+#endif
+
+/**
+ * Allocate an empty page table
+ * @return  The new page table, NULL if out of memory
+ */
+struct pagetable *
+pt_create(void)
+{
+  struct pagetable *pt;
+  unsigned i;
+
+  pt = kmalloc(sizeof(struct pagetable));
+  if (pt == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < PT_L1_ENTRIES; i++) {
+    pt->pt_l2[i] = NULL;
+  }
+
+  return pt;
+}
+
+/*
+ * Release the frame or the swap slot an entry refers to, and clear it.
+ */
+static
+void
+pt_release(pte_t *pte)
+{
+  /* If the frame is being paged out the entry changes under our feet */
+  while ((*pte & PTE_VALID) && !coremap_freeupage(PTE_PADDR(*pte)));
+#if OPT_SWAP
+  if (*pte & PTE_SWAP) {
+    swap_free(PTE_SLOT(*pte));
+  }
+#endif
+  *pte = 0;
+}
+
+/**
+ * Release a page table, together with all the frames still mapped
+ * @param pt    Page table to destroy
+ */
+void
+pt_destroy(struct pagetable *pt)
+{
+  unsigned i, j;
+  pte_t *l2;
+
+  for (i = 0; i < PT_L1_ENTRIES; i++) {
+    l2 = pt->pt_l2[i];
+    if (l2 == NULL) continue;
+
+    for (j = 0; j < PT_L2_ENTRIES; j++) {
+      pt_release(&l2[j]);
+    }
+    kfree(l2);
+  }
+
+  kfree(pt);
+}
+
+/**
+ * Release the frames and swap slots of a range of pages. The range must
+ * not be reachable anymore by vm_fault, and its translations must be out
+ * of every TLB already.
+ * @param pt        Page table
+ * @param vaddr     First page
+ * @param npages    Number of pages
+ */
+void
+pt_unmap(struct pagetable *pt, vaddr_t vaddr, size_t npages)
+{
+  pte_t *pte;
+
+  for (; npages > 0; npages--, vaddr += PAGE_SIZE) {
+    pte = pt_lookup(pt, vaddr, false);
+    if (pte != NULL) {
+      pt_release(pte);
+    }
+  }
+}
+
+/**
+ * Count the pages of a page table in memory and in the swap area. The
+ * address space lock must be held.
+ * @param pt          Page table
+ * @param resident    Where to store the number of pages in memory
+ * @param swapped     Where to store the number of pages swapped out
+ */
+void
+pt_count(struct pagetable *pt, unsigned *resident, unsigned *swapped)
+{
+  unsigned i, j;
+  pte_t *l2;
+
+  *resident = *swapped = 0;
+  for (i = 0; i < PT_L1_ENTRIES; i++) {
+    l2 = pt->pt_l2[i];
+    if (l2 == NULL) continue;
+
+    for (j = 0; j < PT_L2_ENTRIES; j++) {
+      if (l2[j] & PTE_VALID) (*resident)++;
+      else if (l2[j] & PTE_SWAP) (*swapped)++;
+    }
+  }
+}
+
+/**
+ * Find the page table entry of a virtual address
+ * @param pt      Page table
+ * @param vaddr   User virtual address
+ * @param create  Allocate the second-level table if missing
+ * @return        Pointer to the entry, NULL if missing or out of memory
+ */
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+  unsigned i;
+  pte_t *l2;
+
+  KASSERT(vaddr < USERSPACETOP);
+
+  l2 = pt->pt_l2[PT_L1_INDEX(vaddr)];
+  if (l2 == NULL) {
+    if (!create) return NULL;
+
+    l2 = kmalloc(PAGE_SIZE);
+    if (l2 == NULL) return NULL;
+    for (i = 0; i < PT_L2_ENTRIES; i++) {
+      l2[i] = 0;
+    }
+    pt->pt_l2[PT_L1_INDEX(vaddr)] = l2;
+  }
+
+  return &l2[PT_L2_INDEX(vaddr)];
+}
+
+/**
+ * Duplicate a page table. Present pages are not copied: the frames are
+ * shared and both entries become copy-on-write, so that the first write
+ * from either side gets a private copy (see vm_fault). Swapped out pages
+ * share their slot the same way, and each side reads it back on its own.
+ * @param old     Source page table
+ * @param new     Destination (empty) page table
+ * @return        0 on success, an error code otherwise. On failure the
+ *                frames already shared are released by pt_destroy on NEW
+ */
+int
+pt_copy(struct pagetable *old, struct pagetable *new)
+{
+  unsigned i, j;
+  pte_t *l2, *newpte;
+
+  for (i = 0; i < PT_L1_ENTRIES; i++) {
+    l2 = old->pt_l2[i];
+    if (l2 == NULL) continue;
+
+    for (j = 0; j < PT_L2_ENTRIES; j++) {
+      if ((l2[j] & (PTE_VALID | PTE_SWAP)) == 0) continue;
+
+      newpte = pt_lookup(new, PT_VADDR(i, j), true);
+      if (newpte == NULL) {
+        return ENOMEM;
+      }
+
+#if OPT_SWAP
+      if (l2[j] & PTE_SWAP) {
+        swap_share(PTE_SLOT(l2[j]));
+        *newpte = l2[j];
+        continue;
+      }
+#endif
+
+      coremap_share(PTE_PADDR(l2[j]));
+      l2[j] |= PTE_COW;
+      *newpte = l2[j];
+    }
+  }
+
+  return 0;
+}
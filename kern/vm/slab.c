@@ -0,0 +1,345 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <slab.h>
+
+/*
+ * Header at the beginning of each slab, followed by the free list links
+ * and then by the objects. The free list is kept out of the objects, so
+ * that freed objects keep their constructed state.
+ */
+struct slab {
+  struct slab*        sl_next;        /* Slabs of the cache with free objects */
+  struct slab*        sl_prev;
+  struct slab_cache*  sl_cache;       /* Owner of the slab                */
+  unsigned            sl_nfree;       /* Free objects in the slab         */
+  uint16_t            sl_free;        /* First free object                */
+  uint16_t            sl_link[];      /* Next free object after each one  */
+};
+
+#define SLAB_NONE     0xffff          /* End of a free list */
+#define SLAB_ALIGN    8               /* Alignment of the objects */
+
+#define SLAB_OF(obj)  ((struct slab *)((vaddr_t)(obj) & PAGE_FRAME))
+#define SLAB_OBJ(sc, sl, i) \
+  ((void *)((vaddr_t)(sl) + (sc)->sc_offset + (i) * (sc)->sc_size))
+
+/*
+ * Every cache that made at least one slab. Caches are only removed by
+ * slab_destroy, that must not race with slab_printstats.
+ */
+static struct spinlock slab_listlock = SPINLOCK_INITIALIZER;
+static struct slab_cache *slab_list = NULL;
+
+/*
+ * Compute how many objects fit in a slab. The cache lock must be held.
+ */
+static
+void
+slab_setup(struct slab_cache *sc)
+{
+  unsigned n;
+
+  sc->sc_size = ROUNDUP(sc->sc_size, SLAB_ALIGN);
+  KASSERT(sc->sc_size + ROUNDUP(sizeof(struct slab) + sizeof(uint16_t),
+                                SLAB_ALIGN) <= PAGE_SIZE);
+
+  for (n = PAGE_SIZE / sc->sc_size; n > 0; n--) {
+    sc->sc_offset = ROUNDUP(sizeof(struct slab) + n * sizeof(uint16_t),
+                            SLAB_ALIGN);
+    if (sc->sc_offset + n * sc->sc_size <= PAGE_SIZE) {
+      break;
+    }
+  }
+  KASSERT(n > 0 && n < SLAB_NONE);
+  sc->sc_perslab = n;
+}
+
+/*
+ * Run the destructor on the first N objects of a slab.
+ */
+static
+void
+slab_destruct(struct slab_cache *sc, struct slab *sl, unsigned n)
+{
+  unsigned i;
+
+  if (sc->sc_dtor == NULL) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    sc->sc_dtor(SLAB_OBJ(sc, sl, i));
+  }
+}
+
+/*
+ * Make a new slab, with every object constructed and free. Called
+ * without the cache lock, since the constructors may allocate memory.
+ * Returns NULL if out of memory.
+ */
+static
+struct slab *
+slab_grow(struct slab_cache *sc)
+{
+  struct slab *sl;
+  unsigned i;
+  int result;
+
+  sl = (struct slab *)alloc_kpages(1);
+  if (sl == NULL) {
+    return NULL;
+  }
+  KASSERT(SLAB_OF(sl) == sl);
+
+  sl->sl_next = sl->sl_prev = NULL;
+  sl->sl_cache = sc;
+  sl->sl_nfree = sc->sc_perslab;
+  for (i = 0; i < sc->sc_perslab; i++) {
+    if (sc->sc_ctor != NULL) {
+      result = sc->sc_ctor(SLAB_OBJ(sc, sl, i));
+      if (result) {
+        slab_destruct(sc, sl, i);
+        free_kpages((vaddr_t)sl);
+        return NULL;
+      }
+    }
+    sl->sl_link[i] = i + 1 < sc->sc_perslab ? i + 1 : SLAB_NONE;
+  }
+  sl->sl_free = 0;
+
+  return sl;
+}
+
+/*
+ * Add a slab to the list of the ones with free objects. The cache lock
+ * must be held.
+ */
+static
+void
+slab_link(struct slab_cache *sc, struct slab *sl)
+{
+  sl->sl_prev = NULL;
+  sl->sl_next = sc->sc_partial;
+  if (sl->sl_next != NULL) {
+    sl->sl_next->sl_prev = sl;
+  }
+  sc->sc_partial = sl;
+}
+
+/*
+ * Remove a slab from the list of the ones with free objects. The cache
+ * lock must be held.
+ */
+static
+void
+slab_unlink(struct slab_cache *sc, struct slab *sl)
+{
+  if (sl->sl_prev != NULL) {
+    sl->sl_prev->sl_next = sl->sl_next;
+  } else {
+    sc->sc_partial = sl->sl_next;
+  }
+  if (sl->sl_next != NULL) {
+    sl->sl_next->sl_prev = sl->sl_prev;
+  }
+  sl->sl_next = sl->sl_prev = NULL;
+}
+
+/**
+ * Make a cache of objects
+ * @param name    Name of the cache, for statistics. Not copied
+ * @param size    Size of the objects
+ * @param ctor    Constructor of the objects, or NULL
+ * @param dtor    Destructor of the objects, or NULL
+ * @return        The new cache, NULL if out of memory
+ */
+struct slab_cache *
+slab_create(const char *name, size_t size, slab_ctor_t ctor, slab_dtor_t dtor)
+{
+  struct slab_cache *sc;
+
+  KASSERT(size > 0);
+
+  sc = kmalloc(sizeof(*sc));
+  if (sc == NULL) {
+    return NULL;
+  }
+
+  sc->sc_name = name;
+  sc->sc_size = size;
+  sc->sc_ctor = ctor;
+  sc->sc_dtor = dtor;
+  spinlock_init(&sc->sc_lock);
+  sc->sc_perslab = 0;
+  sc->sc_offset = 0;
+  sc->sc_partial = NULL;
+  sc->sc_nslabs = 0;
+  sc->sc_nfree = 0;
+  sc->sc_allocs = 0;
+  sc->sc_ctors = 0;
+  sc->sc_listed = false;
+  sc->sc_next = NULL;
+
+  return sc;
+}
+
+/**
+ * Release a cache made with slab_create and all its slabs
+ * @param sc      Cache, whose objects must all be free
+ */
+void
+slab_destroy(struct slab_cache *sc)
+{
+  struct slab_cache **p;
+  struct slab *sl;
+
+  KASSERT(sc->sc_nfree == sc->sc_nslabs * sc->sc_perslab);
+
+  while ((sl = sc->sc_partial) != NULL) {
+    slab_unlink(sc, sl);
+    slab_destruct(sc, sl, sc->sc_perslab);
+    free_kpages((vaddr_t)sl);
+  }
+
+  if (sc->sc_listed) {
+    spinlock_acquire(&slab_listlock);
+    for (p = &slab_list; *p != sc; p = &(*p)->sc_next) {
+      KASSERT(*p != NULL);
+    }
+    *p = sc->sc_next;
+    spinlock_release(&slab_listlock);
+  }
+
+  spinlock_cleanup(&sc->sc_lock);
+  kfree(sc);
+}
+
+/**
+ * Get an object from a cache
+ * @param sc      Cache
+ * @return        Constructed object, NULL if out of memory
+ */
+void *
+slab_alloc(struct slab_cache *sc)
+{
+  struct slab *sl;
+  unsigned i;
+  bool first;
+
+  spinlock_acquire(&sc->sc_lock);
+
+  if (sc->sc_partial == NULL) {
+    if (sc->sc_perslab == 0) {
+      slab_setup(sc);
+    }
+    first = !sc->sc_listed;
+    sc->sc_listed = true;
+    spinlock_release(&sc->sc_lock);
+
+    if (first) {
+      spinlock_acquire(&slab_listlock);
+      sc->sc_next = slab_list;
+      slab_list = sc;
+      spinlock_release(&slab_listlock);
+    }
+
+    sl = slab_grow(sc);
+    if (sl == NULL) {
+      return NULL;
+    }
+
+    spinlock_acquire(&sc->sc_lock);
+    slab_link(sc, sl);
+    sc->sc_nslabs++;
+    sc->sc_nfree += sc->sc_perslab;
+    sc->sc_ctors += sc->sc_perslab;
+  }
+
+  sl = sc->sc_partial;
+  KASSERT(sl->sl_nfree > 0 && sl->sl_free != SLAB_NONE);
+
+  i = sl->sl_free;
+  sl->sl_free = sl->sl_link[i];
+  sl->sl_nfree--;
+  if (sl->sl_nfree == 0) {
+    slab_unlink(sc, sl);
+  }
+  sc->sc_nfree--;
+  sc->sc_allocs++;
+
+  spinlock_release(&sc->sc_lock);
+
+  return SLAB_OBJ(sc, sl, i);
+}
+
+/**
+ * Give back an object to its cache
+ * @param sc      Cache the object came from
+ * @param obj     Object, in the state left by the constructor
+ */
+void
+slab_free(struct slab_cache *sc, void *obj)
+{
+  struct slab *sl;
+  vaddr_t offset;
+  unsigned i;
+
+  KASSERT(obj != NULL);
+
+  sl = SLAB_OF(obj);
+  KASSERT(sl->sl_cache == sc);
+
+  offset = (vaddr_t)obj - (vaddr_t)sl - sc->sc_offset;
+  i = offset / sc->sc_size;
+  if (offset % sc->sc_size != 0 || i >= sc->sc_perslab) {
+    panic("slab_free: invalid object %p for cache %s\n", obj, sc->sc_name);
+  }
+
+  spinlock_acquire(&sc->sc_lock);
+
+  sl->sl_link[i] = sl->sl_free;
+  sl->sl_free = i;
+  sl->sl_nfree++;
+  sc->sc_nfree++;
+  KASSERT(sl->sl_nfree <= sc->sc_perslab);
+
+  if (sl->sl_nfree == 1) {
+    /* It was full */
+    slab_link(sc, sl);
+  }
+
+  if (sl->sl_nfree == sc->sc_perslab &&
+      sc->sc_nfree >= 2 * sc->sc_perslab) {
+    /* Empty, and the other slabs have room enough */
+    slab_unlink(sc, sl);
+    sc->sc_nslabs--;
+    sc->sc_nfree -= sc->sc_perslab;
+    spinlock_release(&sc->sc_lock);
+
+    slab_destruct(sc, sl, sc->sc_perslab);
+    free_kpages((vaddr_t)sl);
+    return;
+  }
+
+  spinlock_release(&sc->sc_lock);
+}
+
+/**
+ * Print the usage of every cache
+ */
+void
+slab_printstats(void)
+{
+  struct slab_cache *sc;
+
+  spinlock_acquire(&slab_listlock);
+  for (sc = slab_list; sc != NULL; sc = sc->sc_next) {
+    kprintf("%-12s %4zu bytes, %3u per slab: %3u slabs, %4u in use, "
+            "%u allocations, %u constructed\n",
+            sc->sc_name, sc->sc_size, sc->sc_perslab, sc->sc_nslabs,
+            sc->sc_nslabs * sc->sc_perslab - sc->sc_nfree,
+            sc->sc_allocs, sc->sc_ctors);
+  }
+  spinlock_release(&slab_listlock);
+}
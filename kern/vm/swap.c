@@ -0,0 +1,172 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * The slot bitmap and the reference counts are protected by a spinlock:
+ * bitmap operations never sleep. I/O on the device is serialized by the
+ * disk driver itself.
+ */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+static struct vnode *swap_vnode = NULL;
+static struct bitmap *swap_map = NULL;
+static uint16_t *swap_refs = NULL;  /* Page tables sharing each slot */
+static unsigned swap_nslots = 0;
+
+/**
+ * Open the swap device and prepare the slot bitmap. A missing device is
+ * not an error: the system just runs without swap.
+ */
+void
+swap_bootstrap(void)
+{
+  char path[sizeof(SWAP_DEVICE)];
+  struct stat st;
+  int result;
+
+  /* vfs_open destroys the string it's passed */
+  strcpy(path, SWAP_DEVICE);
+
+  result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+  if (result) {
+    kprintf("swap: %s not available (%s), swapping disabled\n",
+            SWAP_DEVICE, strerror(result));
+    swap_vnode = NULL;
+    return;
+  }
+
+  result = VOP_STAT(swap_vnode, &st);
+  if (result) {
+    panic("swap: cannot stat %s: %s\n", SWAP_DEVICE, strerror(result));
+  }
+
+  swap_nslots = st.st_size / PAGE_SIZE;
+  swap_map = bitmap_create(swap_nslots);
+  swap_refs = kmalloc(swap_nslots * sizeof(*swap_refs));
+  if (swap_map == NULL || swap_refs == NULL) {
+    panic("swap: cannot allocate the bitmap for %u slots\n", swap_nslots);
+  }
+
+  kprintf("swap: %s, %u slots\n", SWAP_DEVICE, swap_nslots);
+}
+
+/**
+ * Reserve a swap slot
+ * @param slot    Where to store the slot number
+ * @return        0 on success, ENOSPC if the swap area is full (or missing)
+ */
+int
+swap_alloc(unsigned *slot)
+{
+  int result;
+
+  if (swap_map == NULL) {
+    return ENOSPC;
+  }
+
+  spinlock_acquire(&swap_lock);
+  result = bitmap_alloc(swap_map, slot);
+  if (!result) {
+    swap_refs[*slot] = 1;
+  }
+  spinlock_release(&swap_lock);
+
+  return result;
+}
+
+/**
+ * Add a reference to a swap slot, now shared by one more page table
+ * @param slot    Slot in use
+ */
+void
+swap_share(unsigned slot)
+{
+  KASSERT(swap_map != NULL);
+  KASSERT(slot < swap_nslots);
+
+  spinlock_acquire(&swap_lock);
+  KASSERT(bitmap_isset(swap_map, slot));
+  KASSERT(swap_refs[slot] < (uint16_t)-1);
+  swap_refs[slot]++;
+  spinlock_release(&swap_lock);
+}
+
+/**
+ * Drop a reference to a swap slot, releasing it with the last one
+ * @param slot    Slot to release
+ */
+void
+swap_free(unsigned slot)
+{
+  KASSERT(swap_map != NULL);
+  KASSERT(slot < swap_nslots);
+
+  spinlock_acquire(&swap_lock);
+  KASSERT(bitmap_isset(swap_map, slot));
+  KASSERT(swap_refs[slot] > 0);
+  if (--swap_refs[slot] == 0) {
+    bitmap_unmark(swap_map, slot);
+  }
+  spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between memory and the swap device.
+ */
+static
+int
+swap_io(void *kbuf, unsigned slot, enum uio_rw rw)
+{
+  struct iovec iov;
+  struct uio ku;
+  int result;
+
+  KASSERT(swap_vnode != NULL);
+  KASSERT(slot < swap_nslots);
+
+  uio_kinit(&iov, &ku, kbuf, PAGE_SIZE, (off_t)slot * PAGE_SIZE, rw);
+  result = rw == UIO_READ ? VOP_READ(swap_vnode, &ku)
+                          : VOP_WRITE(swap_vnode, &ku);
+  if (result) {
+    return result;
+  }
+  if (ku.uio_resid != 0) {
+    return EIO;
+  }
+
+  return 0;
+}
+
+/**
+ * Write a frame to the swap area
+ * @param paddr   Physical address of the frame
+ * @param slot    Destination slot (already allocated)
+ * @return        0 on success, an error code otherwise
+ */
+int
+swap_out(paddr_t paddr, unsigned slot)
+{
+  return swap_io((void *)PADDR_TO_KVADDR(paddr), slot, UIO_WRITE);
+}
+
+/**
+ * Read a frame from the swap area
+ * @param paddr   Physical address of the frame
+ * @param slot    Source slot
+ * @return        0 on success, an error code otherwise
+ */
+int
+swap_in(paddr_t paddr, unsigned slot)
+{
+  return swap_io((void *)PADDR_TO_KVADDR(paddr), slot, UIO_READ);
+}
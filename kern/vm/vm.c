@@ -0,0 +1,863 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <proc.h>
+#include <current.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pt.h>
+#if OPT_SWAP
+#include <swap.h>
+#endif
+#if OPT_KVMAP
+#include <kvmap.h>
+#endif
+#if OPT_DEMANDLOAD
+#include <uio.h>
+#include <vnode.h>
+#endif
+
+/*
+ * Demand-paged VM system.
+ *
+ * Each address space is described by a list of regions and a two-level
+ * page table. Frames are allocated by vm_fault the first time a page is
+ * touched, and zero-filled, so the cost of a program follows the pages
+ * it actually uses rather than the size of its segments.
+ *
+ * With OPT_DEMANDLOAD the segments of the executable are file-backed
+ * regions: the first touch of one of their pages reads it from the file
+ * instead, so exec costs only the pages the program actually uses.
+ * With OPT_SHARETEXT the read-only ones go to the page cache of the
+ * coremap, and the processes running the same executable share them.
+ *
+ * With OPT_MMAPFILE the regions created by mmap on a file are file-backed
+ * too. Their pages go through the page cache as well, unless they are
+ * private and writeable: the processes mapping a file with MAP_SHARED
+ * write to the cached frames directly, and the written frames go back
+ * to the file on msync, munmap or exit (vm_msync), or when the clock
+ * reclaims them (vm_pageout_cached). A shared page is
+ * loaded in the TLB read-only until the first write, that marks its
+ * frame dirty.
+ *
+ * The coremap knows which frames were written since they were filled:
+ * clean pages are loaded in the TLB read-only, and the first write faults
+ * and marks the frame dirty. A clean frame still holds a zero-filled page
+ * or the page read from the file, so vm_pageout drops it instead of
+ * writing it to the swap area. Every address space counts its faults,
+ * and the ones that had to read a page (as_getstats).
+ *
+ * After a fork parent and child share every frame copy-on-write: the
+ * translations are loaded read-only and the first write to a page gets
+ * a private copy of it. Swapped out pages share their slot instead.
+ *
+ * With OPT_SWAP the coremap pages out a victim when memory is exhausted
+ * (see vm_pageout). To avoid deadlocks between address spaces, no one
+ * asks the coremap for a user frame while holding an address space lock:
+ * vm_fault drops its own lock while allocating, then looks again at the
+ * page table entry.
+ *
+ * A frame shared copy-on-write is paged out by walking every address
+ * space (vm_pageout_shared): they all map it at the same address. So is
+ * a frame of the page cache (vm_pageout_cached), looking for the regions
+ * mapping its file, and dropped, since it can be read again.
+ */
+
+/**
+ * Initialize the physical memory management
+ */
+void
+vm_bootstrap(void)
+{
+  coremap_bootstrap();
+#if OPT_SWAP
+  swap_bootstrap();
+  as_bootstrap();
+#endif
+}
+
+/*
+ * Check if a fault on the page described by PTE needs a new frame: the
+ * page was never touched, it's swapped out or it's a write on a page
+ * still shared copy-on-write.
+ */
+static
+bool
+vm_needframe(pte_t pte, int faulttype)
+{
+  if ((pte & PTE_VALID) == 0) {
+    return true;
+  }
+  return (pte & PTE_COW) && faulttype != VM_FAULT_READ;
+}
+
+#if OPT_DEMANDLOAD
+/*
+ * Check if the page VADDR of a region holds data of its file.
+ */
+static
+bool
+vm_filebacked(struct vm_region *r, vaddr_t vaddr)
+{
+  return r->vr_vnode != NULL &&
+         vaddr < r->vr_filebase + r->vr_filesize &&
+         vaddr + PAGE_SIZE > r->vr_filebase;
+}
+
+/*
+ * Fill the frame PADDR with the page VADDR of a file-backed region: the
+ * file data is read from the vnode, the rest of the page is zero-filled.
+ */
+static
+int
+vm_readpage(struct vm_region *r, vaddr_t vaddr, paddr_t paddr)
+{
+  struct iovec iov;
+  struct uio u;
+  vaddr_t start, end;
+  char *page;
+  int result;
+
+  start = vaddr > r->vr_filebase ? vaddr : r->vr_filebase;
+  end = r->vr_filebase + r->vr_filesize;
+  if (end > vaddr + PAGE_SIZE) {
+    end = vaddr + PAGE_SIZE;
+  }
+
+  page = (char *)PADDR_TO_KVADDR(paddr);
+  bzero(page, start - vaddr);
+  bzero(page + (end - vaddr), vaddr + PAGE_SIZE - end);
+
+  uio_kinit(&iov, &u, page + (start - vaddr), end - start,
+            r->vr_offset + (start - r->vr_filebase), UIO_READ);
+  result = VOP_READ(r->vr_vnode, &u);
+  if (result) {
+    return result;
+  }
+
+  if (u.uio_resid != 0) {
+    /* short read; file truncated? */
+    kprintf("vm: short read on page 0x%x\n", vaddr);
+    return EIO;
+  }
+
+  return 0;
+}
+#endif /* OPT_DEMANDLOAD */
+
+#if OPT_SHARETEXT
+/*
+ * Check if the page VADDR of a region can be shared through the page
+ * cache: it must hold file data and never be written.
+ */
+static
+bool
+vm_sharable(struct vm_region *r, vaddr_t vaddr)
+{
+#if OPT_MMAPFILE
+  if (r->vr_shared) {
+    return vm_filebacked(r, vaddr);
+  }
+#endif
+  return vm_filebacked(r, vaddr) && (r->vr_perm & VR_WRITE) == 0;
+}
+
+/*
+ * Check if a region maps a file as it is, rather than a segment of an
+ * executable, for the page cache.
+ */
+static
+bool
+vm_filemapping(struct vm_region *r)
+{
+#if OPT_MMAPFILE
+  return r->vr_mapped;
+#else
+  (void)r;
+  return false;
+#endif
+}
+
+/*
+ * Offset in the file of the page VADDR of a file-backed region.
+ */
+static
+off_t
+vm_fileoffset(struct vm_region *r, vaddr_t vaddr)
+{
+  return r->vr_offset + ((off_t)vaddr - (off_t)r->vr_filebase);
+}
+#endif /* OPT_SHARETEXT */
+
+#if OPT_MMAPFILE
+/*
+ * Check if the page VADDR of a region is a page of a file mapped with
+ * MAP_SHARED, whose writes go to the file.
+ */
+static
+bool
+vm_sharedfile(struct vm_region *r, vaddr_t vaddr)
+{
+  return r->vr_shared && vm_filebacked(r, vaddr);
+}
+
+/*
+ * Write the page VADDR of a shared file mapping, held in the frame PADDR,
+ * back to the file. Only the part of the page inside the file is written.
+ */
+static
+int
+vm_writepage(struct vm_region *r, vaddr_t vaddr, paddr_t paddr)
+{
+  struct iovec iov;
+  struct uio u;
+  vaddr_t start, end;
+  char *page;
+  int result;
+
+  start = vaddr > r->vr_filebase ? vaddr : r->vr_filebase;
+  end = r->vr_filebase + r->vr_filesize;
+  if (end > vaddr + PAGE_SIZE) {
+    end = vaddr + PAGE_SIZE;
+  }
+
+  page = (char *)PADDR_TO_KVADDR(paddr);
+  uio_kinit(&iov, &u, page + (start - vaddr), end - start,
+            r->vr_offset + (start - r->vr_filebase), UIO_WRITE);
+  result = VOP_WRITE(r->vr_vnode, &u);
+  if (result) {
+    return result;
+  }
+
+  if (u.uio_resid != 0) {
+    kprintf("vm: short write on page 0x%x\n", vaddr);
+    return EIO;
+  }
+
+  return 0;
+}
+
+/**
+ * Write back the dirty pages of a shared file mapping. The address space
+ * lock must be held. Pages that are now clean may still have writeable
+ * translations in the TLB: the caller must drop them with vm_tlb_drop
+ * before releasing the lock.
+ * @param as        Address space
+ * @param r         Region of the pages
+ * @param vaddr     First page
+ * @param npages    Number of pages, all inside R
+ * @return          0 on success, the first error code otherwise
+ */
+int
+vm_msync(struct addrspace *as, struct vm_region *r, vaddr_t vaddr,
+         size_t npages)
+{
+  pte_t *pte;
+  paddr_t paddr;
+  int result, err;
+
+  KASSERT(lock_do_i_hold(as->as_lock));
+
+  for (err = 0; npages > 0; npages--, vaddr += PAGE_SIZE) {
+    if (!vm_sharedfile(r, vaddr)) {
+      continue;
+    }
+
+    /* Shared file pages never go to swap: evicted ones were written back */
+    pte = pt_lookup(as->as_pt, vaddr, false);
+    if (pte == NULL || (*pte & PTE_VALID) == 0) {
+      continue;
+    }
+    paddr = PTE_PADDR(*pte);
+    if (!coremap_isdirty(paddr)) {
+      continue;
+    }
+
+    result = vm_writepage(r, vaddr, paddr);
+    if (result) {
+      if (err == 0) err = result;
+      continue;
+    }
+    coremap_clean(paddr);
+  }
+
+  return err;
+}
+#endif /* OPT_MMAPFILE */
+
+/**
+ * Handle a TLB miss or a write on a read-only page
+ * @param faulttype       VM_FAULT_READ, VM_FAULT_WRITE or VM_FAULT_READONLY
+ * @param faultaddress    Faulting virtual address
+ * @return                0 on success, an error code otherwise (the
+ *                        process will be killed)
+ */
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+  struct addrspace *as;
+  struct vm_region *region;
+  pte_t *pte;
+  paddr_t paddr, newpaddr;
+  bool writeable, newzeroed;
+  int result;
+
+  faultaddress &= PAGE_FRAME;
+
+  DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+  switch (faulttype) {
+    case VM_FAULT_READONLY:
+    case VM_FAULT_READ:
+    case VM_FAULT_WRITE:
+      break;
+    default:
+      return EINVAL;
+  }
+
+#if OPT_KVMAP
+  if (faultaddress >= KVMAP_BASE) {
+    /* Kernel window, the same in every address space */
+    return kvmap_fault(faultaddress);
+  }
+#endif
+
+  if (curproc == NULL) {
+    /*
+     * No process. This is probably a kernel fault early
+     * in boot. Return EFAULT so as to panic instead of
+     * getting into an infinite faulting loop.
+     */
+    return EFAULT;
+  }
+
+  as = proc_getas();
+  if (as == NULL) {
+    /*
+     * No address space set up. This is probably also a
+     * kernel fault early in boot.
+     */
+    return EFAULT;
+  }
+
+  newpaddr = 0;
+  newzeroed = false;
+
+  /* Only the thread of the process changes its counters */
+  as->as_faults++;
+
+retry:
+  lock_acquire(as->as_lock);
+
+  region = as_find_region(as, faultaddress);
+  if (region == NULL) {
+    result = EFAULT;
+    goto fail;
+  }
+
+  /* Pages mapped with PROT_NONE can't be touched at all */
+  if ((region->vr_perm & (VR_READ | VR_WRITE | VR_EXEC)) == 0) {
+    result = EFAULT;
+    goto fail;
+  }
+
+  /* Read-only regions are writeable only while the program is loaded */
+  writeable = (region->vr_perm & VR_WRITE) || as->as_loading;
+  if (faulttype != VM_FAULT_READ && !writeable) {
+    result = EFAULT;
+    goto fail;
+  }
+
+  pte = pt_lookup(as->as_pt, faultaddress, true);
+  if (pte == NULL) {
+    result = ENOMEM;
+    goto fail;
+  }
+
+  /* A shared page nobody else maps anymore is ours */
+  if ((*pte & PTE_VALID) && (*pte & PTE_COW) &&
+      coremap_unshare(PTE_PADDR(*pte), as, faultaddress)) {
+    *pte &= ~PTE_COW;
+  }
+
+#if OPT_MMAPFILE
+  /* After a fork the shared file pages stay shared, not copy-on-write */
+  if ((*pte & PTE_VALID) && (*pte & PTE_COW) &&
+      vm_sharedfile(region, faultaddress)) {
+    *pte &= ~PTE_COW;
+  }
+#endif
+
+#if OPT_SHARETEXT
+  /* Read-only pages of a file may be in the page cache already */
+  if ((*pte & (PTE_VALID | PTE_SWAP)) == 0 &&
+      vm_sharable(region, faultaddress)) {
+    paddr = coremap_lookupfile(region->vr_vnode,
+                               vm_fileoffset(region, faultaddress),
+                               vm_filemapping(region));
+    if (paddr != 0) {
+      *pte = PTE_MKVALID(paddr);
+    }
+  }
+#endif
+
+  if (vm_needframe(*pte, faulttype) && newpaddr == 0) {
+    /* First touch: ask for a frame already zero-filled */
+    newzeroed = (*pte & (PTE_VALID | PTE_SWAP)) == 0;
+#if OPT_DEMANDLOAD
+    if (vm_filebacked(region, faultaddress)) {
+      newzeroed = false;
+    }
+#endif
+
+    /* The coremap may page out: never ask for a frame with the lock held */
+    lock_release(as->as_lock);
+    newpaddr = coremap_getupage(as, faultaddress, newzeroed);
+    if (newpaddr == 0) {
+      return ENOMEM;
+    }
+    goto retry;
+  }
+
+  if ((*pte & PTE_VALID) == 0) {
+#if OPT_SWAP
+    if (*pte & PTE_SWAP) {
+      result = swap_in(newpaddr, PTE_SLOT(*pte));
+      if (result) {
+        goto fail;
+      }
+      swap_free(PTE_SLOT(*pte));
+      /* The only copy is in memory now */
+      coremap_dirty(newpaddr);
+      as->as_pageins++;
+    } else
+#endif
+#if OPT_DEMANDLOAD
+    if (vm_filebacked(region, faultaddress)) {
+      /* First touch of a page of the file */
+      result = vm_readpage(region, faultaddress, newpaddr);
+      if (result) {
+        goto fail;
+      }
+      as->as_pageins++;
+#if OPT_SHARETEXT
+      if (vm_sharable(region, faultaddress)) {
+        paddr = coremap_cachefile(newpaddr, region->vr_vnode,
+                                  vm_fileoffset(region, faultaddress),
+                                  vm_filemapping(region));
+        if (paddr != newpaddr) {
+          /* Somebody else read the same page meanwhile: use theirs */
+          *pte = PTE_MKVALID(paddr);
+          goto mapped;
+        }
+      }
+#endif
+    } else
+#endif
+    if (!newzeroed) {
+      /* First touch: zero-filled page */
+      bzero((void *)PADDR_TO_KVADDR(newpaddr), PAGE_SIZE);
+    }
+    *pte = PTE_MKVALID(newpaddr);
+    coremap_unpin(newpaddr);
+    newpaddr = 0;
+  } else if ((*pte & PTE_COW) && faulttype != VM_FAULT_READ) {
+    /* Write on a shared page: get a private copy */
+    paddr = PTE_PADDR(*pte);
+    memmove((void *)PADDR_TO_KVADDR(newpaddr),
+            (const void *)PADDR_TO_KVADDR(paddr),
+            PAGE_SIZE);
+    coremap_freeupage(paddr);
+    *pte = PTE_MKVALID(newpaddr);
+    coremap_unpin(newpaddr);
+    newpaddr = 0;
+
+    /* The CPUs that ran us before may still map the shared frame */
+    if (vm_tlb_shootdown(as, faultaddress, 1)) {
+      vm_tlb_drop(as);
+    }
+  }
+#if OPT_SHARETEXT
+mapped:
+#endif
+  paddr = PTE_PADDR(*pte);
+
+  /* Shared pages are mapped read-only until they're copied */
+  if (*pte & PTE_COW) {
+    writeable = false;
+  }
+
+  /* Clean pages are mapped read-only, to catch the first write */
+  if (writeable) {
+    if (faulttype == VM_FAULT_READ) {
+      writeable = coremap_isdirty(paddr);
+    } else {
+      coremap_dirty(paddr);
+    }
+  }
+
+  KASSERT((paddr & PAGE_FRAME) == paddr);
+  DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
+
+  coremap_touch(paddr);
+  vm_tlb_load(faultaddress, paddr, writeable);
+
+  lock_release(as->as_lock);
+
+  /* The page changed while we were allocating: the frame is not needed */
+  if (newpaddr != 0) {
+    coremap_freeupage(newpaddr);
+  }
+
+  return 0;
+
+fail:
+  lock_release(as->as_lock);
+  if (newpaddr != 0) {
+    coremap_freeupage(newpaddr);
+  }
+  return result;
+}
+
+#if OPT_SWAP
+/**
+ * Page out a user frame chosen by the coremap. The frame is marked busy,
+ * so it can't be released while this function runs, but the page may have
+ * changed since it was chosen: it's checked again under the address
+ * space lock.
+ * @param as      Address space owning the frame
+ * @param vaddr   Virtual page mapped on the frame
+ * @param paddr   Physical frame
+ * @return        0 if the page is now in the swap area, ENOSPC if the
+ *                swap area is full, another error code if the frame
+ *                can't be paged out
+ */
+int
+vm_pageout(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+  pte_t *pte;
+  unsigned slot;
+  int result;
+
+  KASSERT(!lock_do_i_hold(as->as_lock));
+
+  lock_acquire(as->as_lock);
+
+  pte = pt_lookup(as->as_pt, vaddr, false);
+  if (pte == NULL || (*pte & PTE_VALID) == 0 || PTE_PADDR(*pte) != paddr ||
+      (*pte & PTE_COW)) {
+    /* Shared by a fork in the meantime */
+    lock_release(as->as_lock);
+    return EBUSY;
+  }
+
+  if (!coremap_isdirty(paddr)) {
+    /* Still zero-filled or as read from the file: the next fault refills it */
+    result = vm_tlb_shootdown(as, vaddr, 1);
+    if (!result) {
+      *pte = 0;
+    }
+    lock_release(as->as_lock);
+    return result;
+  }
+
+  result = swap_alloc(&slot);
+  if (result) {
+    lock_release(as->as_lock);
+    return result;
+  }
+
+  result = vm_tlb_shootdown(as, vaddr, 1);
+  if (!result) {
+    result = swap_out(paddr, slot);
+  }
+  if (result) {
+    swap_free(slot);
+    lock_release(as->as_lock);
+    return result;
+  }
+
+  *pte = PTE_MKSWAP(slot);
+
+  lock_release(as->as_lock);
+
+  return 0;
+}
+
+/*
+ * A shared frame being paged out, for vm_unmapshared: either a frame
+ * shared copy-on-write, mapped at the same address everywhere, or a frame
+ * of the page cache (OPT_SHARETEXT), mapped wherever its file is.
+ */
+struct vm_sharedpage {
+  vaddr_t sp_vaddr;         /* Page, the same in every address space */
+  paddr_t sp_paddr;         /* Frame */
+  bool sp_swapped;          /* Saved in sp_slot, not just dropped */
+  unsigned sp_slot;
+#if OPT_SHARETEXT
+  struct vnode *sp_vnode;   /* File of a cached frame, or NULL */
+  off_t sp_offset;          /* Offset of the page in the file */
+  bool sp_mapped;           /* Page of a file mapping */
+#endif
+#if OPT_MMAPFILE
+  struct vm_region sp_region; /* Copy of a region mapping the page, to */
+  vaddr_t sp_regvaddr;        /* write it back from if dirty           */
+#endif
+};
+
+/*
+ * Replace the mapping of a shared frame at VADDR of AS with its swap
+ * slot, or with an empty entry if the frame needs no saving. The address
+ * space lock must be held.
+ */
+static
+void
+vm_unmappage(struct addrspace *as, vaddr_t vaddr, struct vm_sharedpage *sp)
+{
+  pte_t *pte;
+
+  pte = pt_lookup(as->as_pt, vaddr, false);
+  if (pte == NULL || (*pte & PTE_VALID) == 0 ||
+      PTE_PADDR(*pte) != sp->sp_paddr) {
+    return;
+  }
+
+  if (vm_tlb_shootdown(as, vaddr, 1)) {
+    /* Still mapped here: the frame stays */
+    return;
+  }
+  if (sp->sp_swapped) {
+    swap_share(sp->sp_slot);
+    *pte = PTE_MKSWAP(sp->sp_slot);
+  } else {
+    *pte = 0;
+  }
+  /* The frame is busy: the last reference is left to the coremap */
+  coremap_freeupage(sp->sp_paddr);
+}
+
+#if OPT_SHARETEXT
+/*
+ * Find the page of a region that would be the cached page of SP, in
+ * *VADDR. Returns false if the region doesn't map it through the cache.
+ */
+static
+bool
+vm_cachedpage(struct vm_region *r, const struct vm_sharedpage *sp,
+              vaddr_t *vaddr)
+{
+  off_t page;
+
+  if (r->vr_vnode != sp->sp_vnode || vm_filemapping(r) != sp->sp_mapped) {
+    return false;
+  }
+
+  page = (off_t)r->vr_filebase + (sp->sp_offset - r->vr_offset);
+  if (page < (off_t)r->vr_base ||
+      page >= (off_t)r->vr_base + (off_t)r->vr_npages * PAGE_SIZE ||
+      page % PAGE_SIZE != 0) {
+    return false;
+  }
+
+  *vaddr = (vaddr_t)page;
+  return vm_sharable(r, *vaddr);
+}
+#endif /* OPT_SHARETEXT */
+
+/*
+ * Drop the mappings of a shared frame in one address space.
+ */
+static
+void
+vm_unmapshared(struct addrspace *as, void *arg)
+{
+  struct vm_sharedpage *sp = arg;
+#if OPT_SHARETEXT
+  struct vm_region *r;
+  vaddr_t vaddr;
+#endif
+
+  lock_acquire(as->as_lock);
+
+#if OPT_SHARETEXT
+  if (sp->sp_vnode != NULL) {
+    /* A file may be mapped more than once */
+    for (r = as->as_regions; r != NULL; r = r->vr_next) {
+      if (vm_cachedpage(r, sp, &vaddr)) {
+#if OPT_MMAPFILE
+        if (sp->sp_region.vr_vnode == NULL) {
+          /* The region may go away once unlocked, the file must not */
+          VOP_INCREF(r->vr_vnode);
+          sp->sp_region = *r;
+          sp->sp_regvaddr = vaddr;
+        }
+#endif
+        vm_unmappage(as, vaddr, sp);
+      }
+    }
+    lock_release(as->as_lock);
+    return;
+  }
+#endif
+
+  /* Pages already unmapped are released by pt_unmap, without the lock */
+  if (as_find_region(as, sp->sp_vaddr) != NULL) {
+    vm_unmappage(as, sp->sp_vaddr, sp);
+  }
+
+  lock_release(as->as_lock);
+}
+
+/**
+ * Page out a frame shared copy-on-write by a fork. Its owner in the
+ * coremap is not reliable, but every page table mapping it does so at
+ * the same address, and read-only: the frame is written once, then the
+ * entries of every address space are replaced. The frame is busy, so the
+ * references dropped meanwhile leave it to the coremap.
+ * @param vaddr   Virtual page mapped on the frame
+ * @param paddr   Physical frame
+ * @return        0 if the mappings were replaced (the frame is free if
+ *                nobody shared it again meanwhile), ENOSPC if the swap
+ *                area is full, another error code if the frame can't be
+ *                written
+ */
+int
+vm_pageout_shared(vaddr_t vaddr, paddr_t paddr)
+{
+  struct vm_sharedpage sp;
+  int result;
+
+  sp.sp_vaddr = vaddr;
+  sp.sp_paddr = paddr;
+  sp.sp_swapped = coremap_isdirty(paddr);
+#if OPT_SHARETEXT
+  sp.sp_vnode = NULL;
+#endif
+
+  if (sp.sp_swapped) {
+    result = swap_alloc(&sp.sp_slot);
+    if (result) {
+      return result;
+    }
+    result = swap_out(paddr, sp.sp_slot);
+    if (result) {
+      swap_free(sp.sp_slot);
+      return result;
+    }
+  }
+
+  as_foreach(vm_unmapshared, &sp);
+
+  if (sp.sp_swapped) {
+    /* The page tables hold their own references */
+    swap_free(sp.sp_slot);
+  }
+
+  return 0;
+}
+
+#if OPT_SHARETEXT
+/**
+ * Reclaim a frame of the page cache: it's dropped from every address
+ * space mapping the page, and the next fault reads it again (or finds it
+ * cached again). A frame written through a shared file mapping goes back
+ * to the file first, once nobody can write it anymore. Like
+ * vm_pageout_shared, the references dropped meanwhile leave the frame to
+ * the coremap.
+ * @param v         File of the page
+ * @param offset    Offset of the page in the file
+ * @param mapped    Page of a file mapping, not of an executable
+ * @param paddr     Physical frame
+ * @return          0 on success (the frame is free if nobody mapped it
+ *                  again), an error code if it couldn't be written back
+ */
+int
+vm_pageout_cached(struct vnode *v, off_t offset, bool mapped, paddr_t paddr)
+{
+  struct vm_sharedpage sp;
+  int result;
+
+  sp.sp_vaddr = 0;
+  sp.sp_paddr = paddr;
+  sp.sp_swapped = false;
+  sp.sp_vnode = v;
+  sp.sp_offset = offset;
+  sp.sp_mapped = mapped;
+#if OPT_MMAPFILE
+  sp.sp_region.vr_vnode = NULL;
+#endif
+
+  as_foreach(vm_unmapshared, &sp);
+
+  result = 0;
+#if OPT_MMAPFILE
+  if (sp.sp_region.vr_vnode != NULL) {
+    /* Cleaned first: a write after a new fault makes it dirty again */
+    if (coremap_isdirty(paddr) && coremap_clean(paddr)) {
+      result = vm_writepage(&sp.sp_region, sp.sp_regvaddr, paddr);
+      if (result) {
+        coremap_dirty(paddr);
+      }
+    }
+    VOP_DECREF(sp.sp_region.vr_vnode);
+  }
+#endif
+
+  return result;
+}
+#endif /* OPT_SHARETEXT */
+#endif /* OPT_SWAP */
+
+#if OPT_COMPACT
+/**
+ * Move a user page to another frame, to free a block of contiguous frames.
+ * The old frame is marked busy and the new one pinned by the coremap, so
+ * neither can be released meanwhile; the page is checked again under the
+ * address space lock like in vm_pageout.
+ * @param as      Address space owning the page
+ * @param vaddr   Virtual page
+ * @param from    Frame currently holding the page
+ * @param to      Frame taking its place
+ * @return        0 on success, EBUSY if the page changed meanwhile or the
+ *                address space is locked by the caller, ENOMEM if the TLBs
+ *                can't be shot down
+ */
+int
+vm_relocate(struct addrspace *as, vaddr_t vaddr, paddr_t from, paddr_t to)
+{
+  pte_t *pte;
+  int result;
+
+  if (lock_do_i_hold(as->as_lock)) {
+    /* Compacting for an allocation made under this lock */
+    return EBUSY;
+  }
+
+  lock_acquire(as->as_lock);
+
+  pte = pt_lookup(as->as_pt, vaddr, false);
+  if (pte == NULL || (*pte & PTE_VALID) == 0 || PTE_PADDR(*pte) != from ||
+      (*pte & PTE_COW)) {
+    lock_release(as->as_lock);
+    return EBUSY;
+  }
+
+  /* Nobody can write the old frame once its translations are gone */
+  result = vm_tlb_shootdown(as, vaddr, 1);
+  if (result) {
+    lock_release(as->as_lock);
+    return result;
+  }
+
+  memmove((void *)PADDR_TO_KVADDR(to), (const void *)PADDR_TO_KVADDR(from),
+          PAGE_SIZE);
+  *pte = PTE_MKVALID(to);
+
+  lock_release(as->as_lock);
+
+  return 0;
+}
+#endif /* OPT_COMPACT */
@@ -0,0 +1,433 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <proc.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+
+/*
+ * MIPS TLB handling for the paging VM system. Every function disables
+ * interrupts on the current CPU while frobbing the TLB.
+ *
+ * With OPT_ASID every entry is tagged with the 6-bit address space ID of
+ * its owner, so the TLB needs no flush on a context switch. The ASIDs are
+ * handed out in generations: when they run out a new generation begins,
+ * and each CPU flushes its TLB the first time it activates an address
+ * space of the new generation. An address space whose ASID belongs to an
+ * old generation gets a new one on its next activation.
+ *
+ * The hardware matches the entries against the ASID held in the EntryHi
+ * register, that is overwritten by every TLB operation: all the entries
+ * we write, valid or not, carry the ASID of the current CPU, and the
+ * register is restored after probing for an entry of another ASID.
+ *
+ * Every address space records the CPUs that activated it (as_cpus), the
+ * only ones whose TLB may hold its translations: vm_tlb_shootdown sends
+ * them one IPI for a whole range of pages, and no other CPU is disturbed.
+ * With OPT_ASID the set starts over whenever the address space gets a new
+ * ASID, since the entries tagged with the old one can't be matched.
+ *
+ * The kernel window of OPT_KVMAP is mapped with global entries, that match
+ * every ASID. A null address space stands for the window, shot down on all
+ * the other CPUs.
+ */
+
+#define ASID_SHIFT    6                   /* Position in EntryHi (TLBHI_PID) */
+#define ASID_FIELD    (0x3f << ASID_SHIFT)
+
+/* Left out of mips/tlb.h: the entry matches any ASID */
+#define TLBLO_GLOBAL  0x00000100
+
+/* Ranges longer than this are invalidated scanning the whole TLB */
+#define TLB_PROBEMAX  4
+
+#if MAXCPUS > 32
+#error "as_cpus holds one bit for each CPU"
+#endif
+
+/* Protects the as_cpus of every address space */
+static struct spinlock tlb_cpulock = SPINLOCK_INITIALIZER;
+
+#if OPT_ASID
+#define NUM_ASID      64
+#define ASID_MASK     (NUM_ASID - 1)
+
+/* as_asid holds the generation in the upper bits */
+#define ASID_GEN(a)   ((a) >> ASID_SHIFT)
+#define ASID_NUM(a)   ((a) & ASID_MASK)
+
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_generation = 1;      /* Current generation         */
+static unsigned asid_next = 1;            /* Next free ASID, 0 is unused */
+static unsigned asid_rollovers = 0;       /* Generations exhausted      */
+
+#define CUR_ASID      (curcpu->c_asid << ASID_SHIFT)
+#else
+#define CUR_ASID      0
+#endif /* OPT_ASID */
+
+/*
+ * Counters, updated by each CPU on its own slot with interrupts off.
+ */
+struct tlb_stats {
+  unsigned ts_refills;    /* Entries loaded by vm_fault (TLB misses) */
+  unsigned ts_flushes;    /* Whole TLB flushes                       */
+  unsigned ts_sent;       /* Shootdowns sent to other CPUs           */
+  unsigned ts_received;   /* Shootdowns handled for other CPUs       */
+};
+
+static struct tlb_stats tlb_stats[MAXCPUS];
+
+/*
+ * Write the invalid entry of slot I. Interrupts must be off.
+ */
+static
+void
+vm_tlb_clear(int i)
+{
+  tlb_write(TLBHI_INVALID(i) | CUR_ASID, TLBLO_INVALID(), i);
+}
+
+/*
+ * Invalidate every entry. Interrupts must be off.
+ */
+static
+void
+vm_tlb_clearall(void)
+{
+  int i;
+
+  for (i = 0; i < NUM_TLB; i++) {
+    vm_tlb_clear(i);
+  }
+  tlb_stats[curcpu->c_number].ts_flushes++;
+}
+
+/**
+ * Load a translation of the current address space in the TLB
+ * @param vaddr       Virtual page
+ * @param paddr       Physical frame
+ * @param writeable   Allow writes through this translation
+ */
+void
+vm_tlb_load(vaddr_t vaddr, paddr_t paddr, bool writeable)
+{
+  uint32_t ehi, elo;
+  int i, spl;
+
+  elo = (paddr & TLBLO_PPAGE) | TLBLO_VALID;
+  if (writeable) elo |= TLBLO_DIRTY;
+
+  spl = splhigh();
+
+  ehi = (vaddr & TLBHI_VPAGE) | CUR_ASID;
+
+  /* Never write two entries for the same page */
+  i = tlb_probe(ehi, 0);
+  if (i >= 0) {
+    tlb_write(ehi, elo, i);
+  } else {
+    tlb_random(ehi, elo);
+  }
+  tlb_stats[curcpu->c_number].ts_refills++;
+
+  splx(spl);
+}
+
+#if OPT_KVMAP
+/**
+ * Load a translation of the kernel window in the TLB, valid in every
+ * address space
+ * @param vaddr       Virtual page
+ * @param paddr       Physical frame
+ */
+void
+vm_tlb_loadglobal(vaddr_t vaddr, paddr_t paddr)
+{
+  uint32_t ehi, elo;
+  int i, spl;
+
+  elo = (paddr & TLBLO_PPAGE) | TLBLO_VALID | TLBLO_DIRTY | TLBLO_GLOBAL;
+
+  spl = splhigh();
+
+  ehi = (vaddr & TLBHI_VPAGE) | CUR_ASID;
+  i = tlb_probe(ehi, 0);
+  if (i >= 0) {
+    tlb_write(ehi, elo, i);
+  } else {
+    tlb_random(ehi, elo);
+  }
+  tlb_stats[curcpu->c_number].ts_refills++;
+
+  splx(spl);
+}
+#endif /* OPT_KVMAP */
+
+/**
+ * Remove the translation of a virtual page from the TLB, if present
+ * @param as      Address space of the page. Without OPT_ASID only the
+ *                current one can have translations in the TLB
+ * @param vaddr   Virtual page
+ */
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+  vm_tlb_invalidate_range(as, vaddr, 1);
+}
+
+/**
+ * Remove the translations of a range of pages from the TLB of the current
+ * CPU. Short ranges are probed page by page, long ones are looked for in
+ * a single pass over the TLB.
+ * @param as      Address space of the pages, NULL for the kernel window
+ * @param vaddr   First page
+ * @param npages  Number of pages
+ */
+void
+vm_tlb_invalidate_range(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+  uint32_t tag, ehi, elo;
+  vaddr_t page;
+  unsigned n;
+  int i, spl;
+
+  spl = splhigh();
+
+#if OPT_ASID
+  /*
+   * No lock: if the ASID changes meanwhile, the entries tagged with the
+   * old one can't be matched anymore anyway. Global entries match any.
+   */
+  tag = as == NULL ? CUR_ASID : ASID_NUM(as->as_asid) << ASID_SHIFT;
+  if (as != NULL && tag == 0) {
+    /* Never activated, so nothing in the TLB */
+    splx(spl);
+    return;
+  }
+#else
+  (void)as;
+  tag = 0;
+#endif
+
+  if (npages <= TLB_PROBEMAX) {
+    for (n = 0, page = vaddr; n < npages; n++, page += PAGE_SIZE) {
+      i = tlb_probe((page & TLBHI_VPAGE) | tag, 0);
+      if (i >= 0) {
+        vm_tlb_clear(i);
+      }
+    }
+  } else {
+    for (i = 0; i < NUM_TLB; i++) {
+      tlb_read(&ehi, &elo, i);
+      if ((elo & TLBLO_VALID) &&
+          (as == NULL ? (elo & TLBLO_GLOBAL) != 0
+                      : (ehi & ASID_FIELD) == tag) &&
+          (ehi & TLBHI_VPAGE) >= vaddr &&
+          ((ehi & TLBHI_VPAGE) - vaddr) / PAGE_SIZE < npages) {
+        vm_tlb_clear(i);
+      }
+    }
+  }
+
+  /* Put back the current ASID in EntryHi */
+  tlb_probe(TLBHI_INVALID(0) | CUR_ASID, 0);
+
+  splx(spl);
+}
+
+/**
+ * Remove the translations of a range of pages from the TLB of every CPU
+ * that ran the address space, and wait for the other CPUs to be done.
+ * @param as      Address space of the pages, NULL for the kernel window,
+ *                that any CPU may have in its TLB
+ * @param vaddr   First page
+ * @param npages  Number of pages
+ * @return        0 on success, ENOMEM if the other CPUs can't be waited
+ *                for, in which case nothing was sent to them
+ */
+int
+vm_tlb_shootdown(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+  struct tlbshootdown ts;
+  uint32_t cpus;
+  unsigned n;
+  int spl;
+
+  /* No migration between the local invalidation and reading the set */
+  spl = splhigh();
+  vm_tlb_invalidate_range(as, vaddr, npages);
+  if (as == NULL) {
+    cpus = ~((uint32_t)1 << curcpu->c_number);
+  } else {
+    spinlock_acquire(&tlb_cpulock);
+    cpus = as->as_cpus & ~((uint32_t)1 << curcpu->c_number);
+    spinlock_release(&tlb_cpulock);
+  }
+  splx(spl);
+
+  if (cpus == 0) {
+    return 0;
+  }
+
+  ts.ts_as = as;
+  ts.ts_vaddr = vaddr;
+  ts.ts_npages = npages;
+  ts.ts_done = sem_create("shootdown", 0);
+  if (ts.ts_done == NULL) {
+    return ENOMEM;
+  }
+
+  n = ipi_tlbshootdown_mask(cpus, &ts);
+
+  spl = splhigh();
+  tlb_stats[curcpu->c_number].ts_sent += n;
+  splx(spl);
+
+  for (; n > 0; n--) {
+    P(ts.ts_done);
+  }
+
+  sem_destroy(ts.ts_done);
+  return 0;
+}
+
+/*
+ * Handle a shootdown sent by vm_tlb_shootdown, called by the IPI handler.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+  vm_tlb_invalidate_range(ts->ts_as, ts->ts_vaddr, ts->ts_npages);
+  tlb_stats[curcpu->c_number].ts_received++;
+  if (ts->ts_done != NULL) {
+    V(ts->ts_done);
+  }
+}
+
+/**
+ * Remove every translation from the TLB
+ */
+void
+vm_tlb_flush(void)
+{
+  int spl;
+
+  spl = splhigh();
+  vm_tlb_clearall();
+  splx(spl);
+}
+
+/**
+ * Make an address space the one seen by the current CPU
+ * @param as    Address space
+ */
+void
+vm_tlb_activate(struct addrspace *as)
+{
+#if OPT_ASID
+  unsigned gen;
+  int spl;
+
+  spl = splhigh();
+
+  spinlock_acquire(&asid_lock);
+  spinlock_acquire(&tlb_cpulock);
+  if (as->as_asid == 0 || ASID_GEN(as->as_asid) != asid_generation) {
+    if (asid_next == NUM_ASID) {
+      /* Out of ASIDs: every TLB must be flushed before reusing them */
+      asid_generation++;
+      asid_next = 1;
+      asid_rollovers++;
+    }
+    as->as_asid = (asid_generation << ASID_SHIFT) | asid_next++;
+    /* Nobody holds entries with the new ASID yet */
+    as->as_cpus = 0;
+  }
+  as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+  gen = asid_generation;
+  curcpu->c_asid = ASID_NUM(as->as_asid);
+  spinlock_release(&tlb_cpulock);
+  spinlock_release(&asid_lock);
+
+  if (curcpu->c_asidgen != gen) {
+    /* Drop the entries of the ASIDs of the previous generations */
+    vm_tlb_clearall();
+    curcpu->c_asidgen = gen;
+  } else {
+    /* Just load the new ASID in EntryHi */
+    tlb_probe(TLBHI_INVALID(0) | CUR_ASID, 0);
+  }
+
+  splx(spl);
+#else
+  /* TLB entries are not tagged, drop the ones of the previous process */
+  spinlock_acquire(&tlb_cpulock);
+  as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+  spinlock_release(&tlb_cpulock);
+  vm_tlb_flush();
+#endif /* OPT_ASID */
+}
+
+/**
+ * Forget the translations of an address space on every CPU. With OPT_ASID
+ * the address space just gets a new ASID, which leaves the old entries
+ * unreachable. Only the current address space can be running, so no other
+ * CPU is still using the old ASID.
+ * @param as    Address space
+ */
+void
+vm_tlb_drop(struct addrspace *as)
+{
+#if OPT_ASID
+  spinlock_acquire(&asid_lock);
+  as->as_asid = 0;
+  spinlock_acquire(&tlb_cpulock);
+  as->as_cpus = 0;
+  spinlock_release(&tlb_cpulock);
+  spinlock_release(&asid_lock);
+
+  if (as == proc_getas()) {
+    vm_tlb_activate(as);
+  }
+#else
+  (void)as;
+  vm_tlb_flush();
+#endif /* OPT_ASID */
+}
+
+/**
+ * Print the TLB statistics of every CPU
+ */
+void
+vm_tlb_printstats(void)
+{
+  unsigned i, refills, flushes, sent;
+
+  refills = flushes = sent = 0;
+  for (i = 0; i < MAXCPUS; i++) {
+    if (tlb_stats[i].ts_refills == 0 && tlb_stats[i].ts_flushes == 0) {
+      continue;
+    }
+    kprintf("cpu%u: %u TLB misses, %u TLB flushes, "
+            "%u shootdowns sent, %u received\n",
+            i, tlb_stats[i].ts_refills, tlb_stats[i].ts_flushes,
+            tlb_stats[i].ts_sent, tlb_stats[i].ts_received);
+    refills += tlb_stats[i].ts_refills;
+    flushes += tlb_stats[i].ts_flushes;
+    sent += tlb_stats[i].ts_sent;
+  }
+  kprintf("Total: %u TLB misses, %u TLB flushes, %u shootdowns\n",
+          refills, flushes, sent);
+#if OPT_ASID
+  kprintf("ASID generation %u, %u rollovers\n",
+          asid_generation, asid_rollovers);
+#endif
+}
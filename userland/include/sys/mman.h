@@ -0,0 +1,17 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+/*
+ * Get the mmap flags from the kernel.
+ */
+#include <kern/mman.h>
+#include <sys/types.h>
+
+/* Returned by mmap() on failure. */
+#define MAP_FAILED ((void *)-1)
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+
+#endif /* _SYS_MMAN_H_ */
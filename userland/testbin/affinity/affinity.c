@@ -0,0 +1,129 @@
+/*
+ * affinity.c
+ *
+ * 	Tests sched_setaffinity: processes pinned to one CPU must stay
+ *	there, so several of them spinning at once take as long as
+ *	running them one after the other.
+ *
+ * The children inherit the mask of the parent. On a single CPU
+ * machine every run takes the same time and the test passes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#define NCHILDREN	4
+#define NLOOPS		2000000
+#define ALLCPUS		0xffffffffU
+
+static volatile unsigned spinval;
+
+/*
+ * Burn the CPU for a while.
+ */
+static
+void
+spin(void)
+{
+	unsigned i;
+
+	for (i=0; i<NLOOPS; i++) {
+		spinval += i;
+	}
+}
+
+static
+unsigned long
+now_ms(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs)) {
+		err(1, "__time");
+	}
+	return secs * 1000UL + nsecs / 1000000;
+}
+
+static
+void
+setaffinity(unsigned mask)
+{
+	if (sched_setaffinity(0, mask)) {
+		err(1, "sched_setaffinity 0x%x", mask);
+	}
+}
+
+/*
+ * Fork N children that spin, wait for them, and return the time it
+ * took in milliseconds.
+ */
+static
+unsigned long
+spinchildren(unsigned n)
+{
+	unsigned long start;
+	pid_t pids[NCHILDREN];
+	unsigned i;
+	int status;
+
+	start = now_ms();
+	for (i=0; i<n; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			spin();
+			_exit(0);
+		}
+	}
+	for (i=0; i<n; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (status != 0) {
+			errx(1, "child %u failed", i);
+		}
+	}
+	return now_ms() - start;
+}
+
+int
+main(void)
+{
+	unsigned long one, pinned, unpinned;
+
+	/* Bad arguments */
+	if (sched_setaffinity(0, 0) == 0 || errno != EINVAL) {
+		errx(1, "empty mask accepted");
+	}
+	if (sched_setaffinity(getpid() + 1, ALLCPUS) == 0 || errno != ESRCH) {
+		errx(1, "mask of another process changed");
+	}
+
+	setaffinity(1);
+	one = spinchildren(1);
+	pinned = spinchildren(NCHILDREN);
+	setaffinity(ALLCPUS);
+	unpinned = spinchildren(NCHILDREN);
+
+	printf("1 pinned: %lu ms, %u pinned: %lu ms, %u unpinned: %lu ms\n",
+	       one, NCHILDREN, pinned, NCHILDREN, unpinned);
+
+	/* Allow for the noise of the other threads */
+	if (pinned < NCHILDREN * one * 3 / 4) {
+		errx(1, "pinned processes ran on other CPUs");
+	}
+	if (unpinned > 0 && unpinned < pinned * 3 / 4) {
+		printf("Unpinned processes used about %lu CPUs\n",
+		       (pinned + unpinned / 2) / unpinned);
+	}
+
+	printf("affinity: passed\n");
+	return 0;
+}
@@ -0,0 +1,373 @@
+/*
+ * mmaptest.c
+ *
+ * 	Tests mmap, munmap and msync: anonymous mappings, private and
+ *	shared mappings of a file, write-back with msync, and unmapping
+ *	part of a mapping.
+ *
+ * Needs a kernel built with mmap support for files, and a writable
+ * current directory for the scratch file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		8
+#define SCRATCH		"mmaptest.tmp"
+
+////////////////////////////////////////////////////////////
+// support code
+
+/*
+ * The value stored at OFFSET of the scratch file, and of the pages
+ * mapped from it.
+ */
+static
+char
+fileval(unsigned offset)
+{
+	return 'a' + (offset / PAGE_SIZE + offset) % 26;
+}
+
+static
+void *
+domap(size_t len, int prot, int flags, int fd, off_t offset)
+{
+	void *p;
+
+	p = mmap(NULL, len, prot, flags, fd, offset);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+dounmap(void *p, size_t len)
+{
+	if (munmap(p, len)) {
+		err(1, "munmap");
+	}
+}
+
+static
+pid_t
+dofork(void)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	return pid;
+}
+
+/*
+ * Wait for PID and return its wait status.
+ */
+static
+int
+dowait(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) == -1) {
+		err(1, "waitpid");
+	}
+	return status;
+}
+
+/*
+ * Create the scratch file, NPAGES pages of fileval().
+ */
+static
+void
+mkscratch(void)
+{
+	char buf[PAGE_SIZE];
+	unsigned i, j;
+	int fd;
+
+	fd = open(SCRATCH, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", SCRATCH);
+	}
+	for (i=0; i<NPAGES; i++) {
+		for (j=0; j<PAGE_SIZE; j++) {
+			buf[j] = fileval(i*PAGE_SIZE + j);
+		}
+		if (write(fd, buf, PAGE_SIZE) != PAGE_SIZE) {
+			err(1, "%s: write", SCRATCH);
+		}
+	}
+	close(fd);
+}
+
+static
+int
+openscratch(int flags)
+{
+	int fd;
+
+	fd = open(SCRATCH, flags);
+	if (fd < 0) {
+		err(1, "%s", SCRATCH);
+	}
+	return fd;
+}
+
+/*
+ * Read the byte at OFFSET of the scratch file with read().
+ */
+static
+char
+readscratch(int fd, unsigned offset)
+{
+	char ch;
+
+	if (lseek(fd, offset, SEEK_SET) < 0) {
+		err(1, "%s: lseek", SCRATCH);
+	}
+	if (read(fd, &ch, 1) != 1) {
+		err(1, "%s: read", SCRATCH);
+	}
+	return ch;
+}
+
+////////////////////////////////////////////////////////////
+// tests
+
+/*
+ * Anonymous memory is zero-filled, keeps what's written to it, and is
+ * copied, not shared, by fork.
+ */
+static
+void
+test1(void)
+{
+	char *p;
+	unsigned i;
+	pid_t pid;
+	int status;
+
+	p = domap(NPAGES*PAGE_SIZE, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANON, -1, 0);
+	for (i=0; i<NPAGES*PAGE_SIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous: byte %u not zero", i);
+		}
+	}
+	for (i=0; i<NPAGES; i++) {
+		p[i*PAGE_SIZE] = i+1;
+	}
+
+	pid = dofork();
+	if (pid == 0) {
+		for (i=0; i<NPAGES; i++) {
+			if (p[i*PAGE_SIZE] != (char)(i+1)) {
+				errx(1, "anonymous: page %u lost in child", i);
+			}
+			p[i*PAGE_SIZE] = 0;
+		}
+		_exit(0);
+	}
+	status = dowait(pid);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "anonymous: child failed");
+	}
+
+	for (i=0; i<NPAGES; i++) {
+		if (p[i*PAGE_SIZE] != (char)(i+1)) {
+			errx(1, "anonymous: child write seen in page %u", i);
+		}
+	}
+	dounmap(p, NPAGES*PAGE_SIZE);
+	printf("test1: anonymous mapping OK\n");
+}
+
+/*
+ * A private mapping of a file starts with its contents, and writes to
+ * it don't reach the file.
+ */
+static
+void
+test2(void)
+{
+	char *p;
+	unsigned i;
+	int fd;
+
+	fd = openscratch(O_RDONLY);
+	p = domap(NPAGES*PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	for (i=0; i<NPAGES*PAGE_SIZE; i++) {
+		if (p[i] != fileval(i)) {
+			errx(1, "private: byte %u is %d, not %d",
+			     i, p[i], fileval(i));
+		}
+	}
+	for (i=0; i<NPAGES; i++) {
+		p[i*PAGE_SIZE] = '#';
+	}
+	for (i=0; i<NPAGES; i++) {
+		if (readscratch(fd, i*PAGE_SIZE) != fileval(i*PAGE_SIZE)) {
+			errx(1, "private: write reached page %u of the file",
+			     i);
+		}
+	}
+	dounmap(p, NPAGES*PAGE_SIZE);
+	close(fd);
+	printf("test2: private file mapping OK\n");
+}
+
+/*
+ * Writes to a shared mapping reach the file after msync, are seen by
+ * another process mapping it, and are still there once mapped again.
+ */
+static
+void
+test3(void)
+{
+	char *p;
+	unsigned i;
+	pid_t pid;
+	int fd, status;
+
+	fd = openscratch(O_RDWR);
+	p = domap(NPAGES*PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+	pid = dofork();
+	if (pid == 0) {
+		for (i=0; i<NPAGES; i++) {
+			p[i*PAGE_SIZE] = 'A' + i;
+		}
+		if (msync(p, NPAGES*PAGE_SIZE, MS_SYNC)) {
+			err(1, "msync");
+		}
+		_exit(0);
+	}
+	status = dowait(pid);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "shared: child failed");
+	}
+
+	for (i=0; i<NPAGES; i++) {
+		if (p[i*PAGE_SIZE] != 'A' + (int)i) {
+			errx(1, "shared: child write not seen in page %u", i);
+		}
+		if (readscratch(fd, i*PAGE_SIZE) != 'A' + (int)i) {
+			errx(1, "shared: page %u not written back", i);
+		}
+	}
+	dounmap(p, NPAGES*PAGE_SIZE);
+
+	p = domap(NPAGES*PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	for (i=0; i<NPAGES; i++) {
+		if (p[i*PAGE_SIZE] != 'A' + (int)i) {
+			errx(1, "shared: page %u lost after remapping", i);
+		}
+		if (p[i*PAGE_SIZE + 1] != fileval(i*PAGE_SIZE + 1)) {
+			errx(1, "shared: page %u damaged", i);
+		}
+	}
+	dounmap(p, NPAGES*PAGE_SIZE);
+	close(fd);
+	printf("test3: shared file mapping OK\n");
+}
+
+/*
+ * Mappings can't give more access than the file was opened with.
+ */
+static
+void
+test4(void)
+{
+	void *p;
+	int fd;
+
+	fd = openscratch(O_RDONLY);
+	p = mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p != MAP_FAILED) {
+		errx(1, "shared writable mapping of a read-only file");
+	}
+	if (errno != EACCES) {
+		err(1, "read-only file: expected EACCES, got");
+	}
+	close(fd);
+
+	fd = openscratch(O_WRONLY);
+	p = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p != MAP_FAILED) {
+		errx(1, "mapping of a write-only file");
+	}
+	if (errno != EACCES) {
+		err(1, "write-only file: expected EACCES, got");
+	}
+	close(fd);
+	printf("test4: access checks OK\n");
+}
+
+/*
+ * Unmapping the middle of a mapping leaves both ends in place, as two
+ * mappings.
+ */
+static
+void
+test5(void)
+{
+	char *p;
+	unsigned i;
+
+	p = domap(NPAGES*PAGE_SIZE, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANON, -1, 0);
+	for (i=0; i<NPAGES; i++) {
+		p[i*PAGE_SIZE] = i+1;
+	}
+
+	dounmap(p + 2*PAGE_SIZE, 2*PAGE_SIZE);
+	for (i=0; i<NPAGES; i++) {
+		if (i == 2 || i == 3) {
+			continue;
+		}
+		if (p[i*PAGE_SIZE] != (char)(i+1)) {
+			errx(1, "munmap: page %u lost", i);
+		}
+	}
+
+	/* The hole is no longer mapped */
+	if (munmap(p + 2*PAGE_SIZE, PAGE_SIZE) == 0) {
+		errx(1, "munmap: hole unmapped twice");
+	}
+	if (errno != EINVAL) {
+		err(1, "munmap: expected EINVAL, got");
+	}
+
+	dounmap(p, 2*PAGE_SIZE);
+	dounmap(p + 4*PAGE_SIZE, (NPAGES-4)*PAGE_SIZE);
+	printf("test5: partial munmap OK\n");
+}
+
+int
+main(void)
+{
+	mkscratch();
+
+	test1();
+	test2();
+	test3();
+	test4();
+	test5();
+
+	remove(SCRATCH);
+	printf("mmaptest: passed\n");
+	return 0;
+}
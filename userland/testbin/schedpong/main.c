@@ -283,6 +283,8 @@ usage(const char *av0)
 	warnx("  [-s ponggroupsize]    set pong group size (default 6)");
 	warnx("Thinkers are CPU bound; grinders are memory-bound;");
 	warnx("pong groups are I/O bound.");
+	warnx("Each pong group reports the round trip latency of its");
+	warnx("wakeups, which is the interactive response to compare.");
 	exit(1);
 }
 
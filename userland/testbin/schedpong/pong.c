@@ -32,7 +32,9 @@
  * Semaphore pong.
  */
 
+#include <sys/types.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <err.h>
 #include <assert.h>
 
@@ -46,6 +48,17 @@
 static struct usem sems[MAXCOUNT];
 static unsigned nsems;
 
+/*
+ * Round trips timed by ponger 0 in the cyclic phases, from waking up
+ * the next ponger to being woken up again. Pongers block all the
+ * time, like interactive programs; with thinkers competing for the
+ * cpu this measures how fast the scheduler gets them running again.
+ */
+static time_t rtsecs;
+static unsigned long rtnsecs;
+static unsigned long rttotal, rtmax;	/* microseconds */
+static unsigned rtcount;
+
 /*
  * Set up the semaphores. This happens in the task director process,
  * so if we have multiple pong groups each has its own sems[] array.
@@ -82,6 +95,39 @@ pong_cleanup(unsigned groupid, unsigned count)
 	}
 }
 
+/*
+ * Start timing a round trip.
+ */
+static
+void
+roundtrip_start(void)
+{
+	__time(&rtsecs, &rtnsecs);
+}
+
+/*
+ * Finish timing a round trip.
+ */
+static
+void
+roundtrip_end(void)
+{
+	time_t secs;
+	unsigned long nsecs, usecs;
+
+	__time(&secs, &nsecs);
+	if (nsecs < rtnsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	usecs = (secs - rtsecs) * 1000000 + (nsecs - rtnsecs) / 1000;
+	rttotal += usecs;
+	if (usecs > rtmax) {
+		rtmax = usecs;
+	}
+	rtcount++;
+}
+
 /*
  * Pong in order. Wait on our semaphore, then wake the next one.
  * If we're id 0, don't wait the first go so things start, but do
@@ -98,6 +144,9 @@ pong_cyclic(unsigned id)
 	for (i=0; i<PONGLOOPS; i++) {
 		if (i > 0 || id > 0) {
 			P(&sems[id]);
+			if (id == 0) {
+				roundtrip_end();
+			}
 		}
 #ifdef VERBOSE_PONG
 		printf(" %u", id);
@@ -106,10 +155,14 @@ pong_cyclic(unsigned id)
 			putchar('.');
 		}
 #endif
+		if (id == 0) {
+			roundtrip_start();
+		}
 		V(&sems[nextid]);
 	}
 	if (id == 0) {
 		P(&sems[id]);
+		roundtrip_end();
 	}
 #ifdef VERBOSE_PONG
 	putchar('\n');
@@ -186,8 +239,6 @@ pong(unsigned groupid, unsigned id)
 {
 	unsigned idfwd, idback;
 
-	(void)groupid;
-
 	idfwd = (id + 1) % nsems;
 	idback = (id + nsems - 1) % nsems;
 	usem_open(&sems[id]);
@@ -205,6 +256,12 @@ pong(unsigned groupid, unsigned id)
 #endif
 	pong_cyclic(id);
 
+	if (id == 0 && rtcount > 0) {
+		printf("Pong group %u: %u round trips of %u, "
+		       "avg %lu usec, max %lu usec\n", groupid - 2, rtcount,
+		       nsems, rttotal / rtcount, rtmax);
+	}
+
 	usem_close(&sems[id]);
 	usem_close(&sems[idfwd]);
 	usem_close(&sems[idback]);
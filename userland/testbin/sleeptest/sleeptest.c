@@ -0,0 +1,96 @@
+/*
+ * sleeptest.c
+ *
+ * 	Tests nanosleep: it sleeps at least the time asked for, measured
+ *	with __time, and refuses a time that's not valid.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+static
+unsigned long
+now_ms(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs)) {
+		err(1, "__time");
+	}
+	return secs * 1000UL + nsecs / 1000000;
+}
+
+/*
+ * Sleep SECS seconds and NSECS nanoseconds and check the time it took.
+ */
+static
+void
+checksleep(time_t secs, long nsecs)
+{
+	struct timespec req, rem;
+	unsigned long start, elapsed, asked;
+
+	req.tv_sec = secs;
+	req.tv_nsec = nsecs;
+	rem.tv_sec = rem.tv_nsec = -1;
+
+	start = now_ms();
+	if (nanosleep(&req, &rem)) {
+		err(1, "nanosleep %lu.%09ld", (unsigned long)secs, nsecs);
+	}
+	elapsed = now_ms() - start;
+
+	/* The clock is read in whole milliseconds */
+	asked = secs * 1000UL + nsecs / 1000000;
+	printf("Asked %lu ms, slept %lu ms\n", asked, elapsed);
+	if (elapsed < asked) {
+		errx(1, "nanosleep %lu.%09ld: woke up early",
+		     (unsigned long)secs, nsecs);
+	}
+	if (rem.tv_sec != 0 || rem.tv_nsec != 0) {
+		errx(1, "nanosleep %lu.%09ld: time left not zero",
+		     (unsigned long)secs, nsecs);
+	}
+}
+
+/*
+ * Check that a sleep of SECS seconds and NSECS nanoseconds fails with
+ * EINVAL.
+ */
+static
+void
+checkinval(time_t secs, long nsecs)
+{
+	struct timespec req;
+
+	req.tv_sec = secs;
+	req.tv_nsec = nsecs;
+	if (nanosleep(&req, NULL) == 0) {
+		errx(1, "nanosleep %ld.%09ld accepted", (long)secs, nsecs);
+	}
+	if (errno != EINVAL) {
+		err(1, "nanosleep %ld.%09ld: expected EINVAL, got",
+		    (long)secs, nsecs);
+	}
+}
+
+int
+main(void)
+{
+	checksleep(0, 0);
+	checksleep(0, 1);
+	checksleep(0, 250000000);
+	checksleep(1, 0);
+	checksleep(1, 500000000);
+
+	checkinval(0, -1);
+	checkinval(0, 1000000000);
+	checkinval(-1, 0);
+
+	printf("sleeptest: passed\n");
+	return 0;
+}